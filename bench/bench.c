@@ -0,0 +1,786 @@
+#include "vector.h"
+#include "render.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+#include "camera.h"
+#include "curve.h"
+#include "thread_pool.h"
+#include "math.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_LIST 16
+#define BENCH_TILE 32
+#define BENCH_FOV 1.f
+// Task latency mode: samples of a single task's submit-to-start time, and empty tasks per throughput run
+// submitted in bursts
+#define BENCH_LATENCY_SAMPLES 20000
+#define BENCH_LATENCY_BATCH 200000
+#define BENCH_LATENCY_BURST 1000
+
+// Structs
+typedef struct resolution
+{
+    size_t width;
+    size_t height;
+} resolution;
+
+typedef struct bench_options
+{
+    size_t spheres[BENCH_MAX_LIST];
+    size_t spheres_len;
+    size_t lights[BENCH_MAX_LIST];
+    size_t lights_len;
+    resolution resolutions[BENCH_MAX_LIST];
+    size_t resolutions_len;
+    size_t threads[BENCH_MAX_LIST];
+    size_t threads_len;
+    // Tile dispatch and pixel order inside the tiles, each one is a run of its own
+    curve_order orders[BENCH_MAX_LIST];
+    size_t orders_len;
+    size_t warmup;
+    size_t iterations;
+    // "bvh", "soa" or "linear"
+    const char *accel;
+    thread_pool_scheduler scheduler;
+    thread_pool_queue queue;
+    // Measure the pool itself with empty tasks instead of rendering
+    int task_latency;
+    // "csv" or "json"
+    const char *format;
+    const char *output;
+    uint64_t seed;
+} bench_options;
+
+typedef struct bench_frame
+{
+    const scene *scene;
+    vec3 *framebuffer;
+    size_t width;
+    size_t height;
+    size_t tiles_x;
+    camera camera;
+    // Dispatch position to tile and the pixels of a tile in visiting order, NULL for row-major
+    size_t *tile_order;
+    size_t *pixel_order;
+} bench_frame;
+
+typedef struct bench_result
+{
+    size_t spheres;
+    size_t lights;
+    size_t width;
+    size_t height;
+    size_t threads;
+    curve_order order;
+    double build_ms;
+    double mean_ms;
+    double min_ms;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    double mrays_per_s;
+    double ns_per_ray;
+    // Hardware cache misses of the measured frames per ray, negative where the counter is not available
+    double cache_misses_per_ray;
+    double efficiency;
+} bench_result;
+
+typedef struct latency_result
+{
+    size_t threads;
+    double p50_ns;
+    double p99_ns;
+    double max_ns;
+    double mtasks_per_s;
+} latency_result;
+
+// Functions
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, the same seed always produces the same scene
+static float random_float(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (float)((*state * 0x2545f4914f6cdd1dull) >> 40) / (float)(1 << 24);
+}
+
+// Spheres are spread through the view frustum, the depth range grows with the count so the density stays similar
+static sphere *generate_spheres(size_t count, float aspect, uint64_t seed)
+{
+    const material materials[3] = {
+        material_create(vector_create(0.f, 0.5f, 0.f), vector_create(0.6f, 0.3f, 0.1f), 50.),
+        material_create(vector_create(1.f, 1.f, 1.f), vector_create(0.6f, 0.6f, 0.f), 20.),
+        material_create(vector_create(1.f, 1.f, 1.f), vector_create(0.0f, 10.f, 0.8f), 1425.),
+    };
+
+    sphere *spheres = (sphere *)malloc((count ? count : 1) * sizeof(sphere));
+    if (spheres == NULL)
+        return NULL;
+
+    float depth_range = 20.f * cbrtf((float)count / 4.f);
+    float radius = 2.f / cbrtf((float)count / 4.f + 1.f) + 0.05f;
+    float half_fov = tanf(BENCH_FOV / 2.f);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        float z = 8.f + random_float(&seed) * depth_range;
+        float x = (2.f * random_float(&seed) - 1.f) * half_fov * aspect * z;
+        float y = (2.f * random_float(&seed) - 1.f) * half_fov * z;
+        float r = radius * (0.5f + random_float(&seed));
+        spheres[i] = sphere_create(vector_create(x, y, -z), r, materials[i % 3]);
+    }
+    return spheres;
+}
+
+static light *generate_lights(size_t count, uint64_t seed)
+{
+    light *lights = (light *)malloc((count ? count : 1) * sizeof(light));
+    if (lights == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        vec3 position = vector_create(60.f * random_float(&seed) - 30.f,
+                                      20.f + 30.f * random_float(&seed),
+                                      50.f * random_float(&seed) - 25.f);
+        lights[i] = light_create(position, 1.5f / (float)(count > 2 ? count / 2 : 1));
+    }
+    return lights;
+}
+
+static void render_tiles(size_t begin, size_t end, void *ctx)
+{
+    const bench_frame *frame = (const bench_frame *)ctx;
+    const vec3 background = vector_create(0.5f, 0.5f, 0.5f);
+    float dir_x[BENCH_TILE], dir_y[BENCH_TILE], dir_z[BENCH_TILE];
+
+    for (size_t position = begin; position < end; ++position)
+    {
+        size_t tile = frame->tile_order != NULL ? frame->tile_order[position] : position;
+        size_t begin_x = (tile % frame->tiles_x) * BENCH_TILE;
+        size_t begin_y = (tile / frame->tiles_x) * BENCH_TILE;
+        size_t end_x = MIN(begin_x + BENCH_TILE, frame->width);
+        size_t end_y = MIN(begin_y + BENCH_TILE, frame->height);
+
+        if (frame->pixel_order != NULL)
+        {
+            // BENCH_TILE pixels of the curve at a time, edge tiles skip the ones outside
+            size_t xs[BENCH_TILE], ys[BENCH_TILE];
+            for (size_t i = 0; i < BENCH_TILE * BENCH_TILE; i += BENCH_TILE)
+            {
+                size_t count = 0;
+                for (size_t j = i; j < i + BENCH_TILE; ++j)
+                {
+                    xs[count] = begin_x + frame->pixel_order[j] % BENCH_TILE;
+                    ys[count] = begin_y + frame->pixel_order[j] / BENCH_TILE;
+                    count += xs[count] < end_x && ys[count] < end_y;
+                }
+                camera_pixel_dirs(&frame->camera, xs, ys, count, dir_x, dir_y, dir_z);
+                for (size_t j = 0; j < count; ++j)
+                {
+                    vec3 dir = vector_create(dir_x[j], dir_y[j], dir_z[j]);
+                    frame->framebuffer[xs[j] + ys[j] * frame->width] = cast_ray(frame->camera.position, dir, background, frame->scene, 0);
+                }
+            }
+            continue;
+        }
+
+        for (size_t y = begin_y; y < end_y; ++y)
+        {
+            camera_row_dirs(&frame->camera, begin_x, y, end_x - begin_x, dir_x, dir_y, dir_z);
+            for (size_t x = begin_x; x < end_x; ++x)
+            {
+                vec3 dir = vector_create(dir_x[x - begin_x], dir_y[x - begin_x], dir_z[x - begin_x]);
+                frame->framebuffer[x + y * frame->width] = cast_ray(frame->camera.position, dir, background, frame->scene, 0);
+            }
+        }
+    }
+}
+
+static int compare_double(const void *lhs, const void *rhs)
+{
+    double a = *(const double *)lhs, b = *(const double *)rhs;
+    return (a > b) - (a < b);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, size_t len, double p)
+{
+    size_t rank = (size_t)ceil(p / 100. * (double)len);
+    return sorted[rank ? rank - 1 : 0];
+}
+
+// Counts cache misses of this thread and of every thread started after it, so it has to be opened
+// before the pool is created
+// @return counter, -1 if the kernel or the machine has none
+static int open_cache_miss_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// @return the count including the threads the counter was inherited by, 0 without a counter
+static uint64_t read_counter(int fd)
+{
+    uint64_t count = 0;
+    if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+    return count;
+}
+
+static thread_pool_t create_pool(const bench_options *opts, size_t threads)
+{
+    thread_pool_config config;
+    init_thread_pool_config(&config, threads);
+    config.scheduler = opts->scheduler;
+    config.queue = opts->queue;
+    return create_thread_pool_with_config(&config);
+}
+
+static int run_frames(const bench_options *opts, const scene *sc, resolution res, size_t threads, curve_order order,
+                      bench_result *result)
+{
+    int counter = open_cache_miss_counter();
+    thread_pool_t pool = create_pool(opts, threads);
+    if (pool == NULL)
+    {
+        if (counter >= 0)
+            close(counter);
+        return -1;
+    }
+
+    bench_frame frame;
+    frame.scene = sc;
+    frame.width = res.width;
+    frame.height = res.height;
+    frame.tiles_x = (res.width + BENCH_TILE - 1) / BENCH_TILE;
+    size_t tiles_y = (res.height + BENCH_TILE - 1) / BENCH_TILE;
+    size_t tiles = frame.tiles_x * tiles_y;
+    int camera_failed = camera_init(&frame.camera, res.width, res.height, vector_create(0.f, 0.f, 0.f),
+                                    vector_create(0.f, 0.f, -1.f), vector_create(0.f, 1.f, 0.f), BENCH_FOV) != 0;
+    frame.framebuffer = (vec3 *)malloc(res.width * res.height * sizeof(vec3));
+    frame.tile_order = NULL;
+    frame.pixel_order = NULL;
+    if (order != CURVE_ROW_MAJOR)
+    {
+        frame.tile_order = (size_t *)malloc(tiles * sizeof(size_t));
+        frame.pixel_order = (size_t *)malloc(BENCH_TILE * BENCH_TILE * sizeof(size_t));
+    }
+    double *samples = (double *)malloc(opts->iterations * sizeof(double));
+    if (camera_failed || frame.framebuffer == NULL || samples == NULL ||
+        (order != CURVE_ROW_MAJOR && (frame.tile_order == NULL || frame.pixel_order == NULL)))
+    {
+        camera_close(&frame.camera);
+        free(frame.framebuffer);
+        free(frame.tile_order);
+        free(frame.pixel_order);
+        free(samples);
+        destroy_thread_pool(pool);
+        if (counter >= 0)
+            close(counter);
+        return -1;
+    }
+    if (order != CURVE_ROW_MAJOR)
+    {
+        curve_order_fill(order, frame.tiles_x, tiles_y, frame.tile_order);
+        curve_order_fill(order, BENCH_TILE, BENCH_TILE, frame.pixel_order);
+    }
+
+    uint64_t misses = 0;
+    for (size_t i = 0; i < opts->warmup + opts->iterations; ++i)
+    {
+        uint64_t misses_start = read_counter(counter);
+        double start = now_ms();
+        parallel_for_thread_pool(pool, 0, tiles, 1, render_tiles, &frame);
+        wait_thread_pool(pool);
+        if (i >= opts->warmup)
+        {
+            samples[i - opts->warmup] = now_ms() - start;
+            misses += read_counter(counter) - misses_start;
+        }
+    }
+
+    qsort(samples, opts->iterations, sizeof(double), compare_double);
+    double total = 0.;
+    for (size_t i = 0; i < opts->iterations; ++i)
+        total += samples[i];
+
+    double rays = (double)(res.width * res.height);
+    result->mean_ms = total / opts->iterations;
+    result->min_ms = samples[0];
+    result->p50_ms = percentile(samples, opts->iterations, 50.);
+    result->p90_ms = percentile(samples, opts->iterations, 90.);
+    result->p99_ms = percentile(samples, opts->iterations, 99.);
+    result->mrays_per_s = rays / (result->p50_ms * 1e3);
+    result->ns_per_ray = result->p50_ms * 1e6 / rays;
+    result->cache_misses_per_ray = counter >= 0 ? (double)misses / (rays * opts->iterations) : -1.;
+
+    free(samples);
+    free(frame.framebuffer);
+    free(frame.tile_order);
+    free(frame.pixel_order);
+    camera_close(&frame.camera);
+    destroy_thread_pool(pool);
+    if (counter >= 0)
+        close(counter);
+    return 0;
+}
+
+static void record_start(void *arg)
+{
+    atomic_store_explicit((_Atomic uint64_t *)arg, now_ns(), memory_order_release);
+}
+
+static void empty_task(void *arg)
+{
+    (void)arg;
+}
+
+// Submit-to-start time of one task at a time on an otherwise idle pool, then the rate of a burst of
+// empty tasks, both measure the queue and the wakeup path only
+static int run_task_latency(const bench_options *opts, size_t threads, latency_result *result)
+{
+    thread_pool_t pool = create_pool(opts, threads);
+    double *samples = (double *)malloc(BENCH_LATENCY_SAMPLES * sizeof(double));
+    if (pool == NULL || samples == NULL)
+    {
+        free(samples);
+        destroy_thread_pool(pool);
+        return -1;
+    }
+
+    _Atomic uint64_t started;
+    for (size_t i = 0; i < BENCH_LATENCY_SAMPLES; ++i)
+    {
+        atomic_store(&started, 0);
+        uint64_t submitted = now_ns();
+        add_task_thread_pool(pool, record_start, (void *)&started);
+        uint64_t start;
+        while ((start = atomic_load_explicit(&started, memory_order_acquire)) == 0)
+            sched_yield();
+        samples[i] = (double)(start - submitted);
+        wait_thread_pool(pool);
+    }
+
+    qsort(samples, BENCH_LATENCY_SAMPLES, sizeof(double), compare_double);
+    result->threads = threads;
+    result->p50_ns = percentile(samples, BENCH_LATENCY_SAMPLES, 50.);
+    result->p99_ns = percentile(samples, BENCH_LATENCY_SAMPLES, 99.);
+    result->max_ns = samples[BENCH_LATENCY_SAMPLES - 1];
+
+    // Bursts small enough for the default ring, a larger one measures its overflow list instead
+    double start = now_ms();
+    for (size_t i = 0; i < BENCH_LATENCY_BATCH; ++i)
+    {
+        add_task_thread_pool(pool, empty_task, NULL);
+        if (i % BENCH_LATENCY_BURST == BENCH_LATENCY_BURST - 1)
+            wait_thread_pool(pool);
+    }
+    wait_thread_pool(pool);
+    result->mtasks_per_s = BENCH_LATENCY_BATCH / ((now_ms() - start) * 1e3);
+
+    free(samples);
+    destroy_thread_pool(pool);
+    return 0;
+}
+
+static void write_latency_results(FILE *out, const bench_options *opts, const latency_result *results, size_t len)
+{
+    static const char *schedulers[] = {"fifo", "ws"};
+    static const char *queues[] = {"locked", "ring"};
+    const char *scheduler = schedulers[opts->scheduler];
+    const char *queue = opts->scheduler == THREAD_POOL_SCHEDULER_FIFO ? queues[opts->queue] : "deque";
+
+    int json = strcmp(opts->format, "json") == 0;
+    if (json)
+        fprintf(out, "[\n");
+    else
+        fprintf(out, "scheduler,queue,threads,p50_ns,p99_ns,max_ns,mtasks_per_s\n");
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        const latency_result *r = &results[i];
+        if (json)
+            fprintf(out,
+                    "  {\"scheduler\": \"%s\", \"queue\": \"%s\", \"threads\": %zu, \"p50_ns\": %.0f, "
+                    "\"p99_ns\": %.0f, \"max_ns\": %.0f, \"mtasks_per_s\": %.3f}%s\n",
+                    scheduler, queue, r->threads, r->p50_ns, r->p99_ns, r->max_ns, r->mtasks_per_s,
+                    i + 1 < len ? "," : "");
+        else
+            fprintf(out, "%s,%s,%zu,%.0f,%.0f,%.0f,%.3f\n", scheduler, queue, r->threads, r->p50_ns, r->p99_ns,
+                    r->max_ns, r->mtasks_per_s);
+    }
+
+    if (json)
+        fprintf(out, "]\n");
+}
+
+// Speedup over the smallest thread count divided by the growth in threads, 1 is perfect scaling
+static void compute_efficiency(bench_result *results, size_t len)
+{
+    if (len == 0)
+        return;
+
+    const bench_result *base = &results[0];
+    for (size_t i = 1; i < len; ++i)
+    {
+        if (results[i].threads < base->threads)
+            base = &results[i];
+    }
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        results[i].efficiency = (base->p50_ms * base->threads) / (results[i].p50_ms * results[i].threads);
+    }
+}
+
+static void write_results(FILE *out, const bench_options *opts, const bench_result *results, size_t len)
+{
+    int json = strcmp(opts->format, "json") == 0;
+    if (json)
+        fprintf(out, "[\n");
+    else
+        fprintf(out, "accel,spheres,lights,width,height,threads,order,build_ms,mean_ms,min_ms,p50_ms,p90_ms,p99_ms,"
+                     "mrays_per_s,ns_per_ray,cache_misses_per_ray,scaling_efficiency\n");
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        const bench_result *r = &results[i];
+        // Left empty, or null in JSON, where there was no counter
+        char misses[32];
+        if (r->cache_misses_per_ray >= 0.)
+            snprintf(misses, sizeof(misses), "%.4f", r->cache_misses_per_ray);
+        else
+            strcpy(misses, json ? "null" : "");
+
+        if (json)
+            fprintf(out,
+                    "  {\"accel\": \"%s\", \"spheres\": %zu, \"lights\": %zu, \"width\": %zu, \"height\": %zu, "
+                    "\"threads\": %zu, \"order\": \"%s\", \"build_ms\": %.3f, \"mean_ms\": %.3f, \"min_ms\": %.3f, "
+                    "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"mrays_per_s\": %.3f, \"ns_per_ray\": %.2f, "
+                    "\"cache_misses_per_ray\": %s, \"scaling_efficiency\": %.3f}%s\n",
+                    opts->accel, r->spheres, r->lights, r->width, r->height, r->threads, curve_order_name(r->order),
+                    r->build_ms, r->mean_ms, r->min_ms, r->p50_ms, r->p90_ms, r->p99_ms, r->mrays_per_s, r->ns_per_ray,
+                    misses, r->efficiency, i + 1 < len ? "," : "");
+        else
+            fprintf(out, "%s,%zu,%zu,%zu,%zu,%zu,%s,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.2f,%s,%.3f\n",
+                    opts->accel, r->spheres, r->lights, r->width, r->height, r->threads, curve_order_name(r->order),
+                    r->build_ms, r->mean_ms, r->min_ms, r->p50_ms, r->p90_ms, r->p99_ms, r->mrays_per_s, r->ns_per_ray,
+                    misses, r->efficiency);
+    }
+
+    if (json)
+        fprintf(out, "]\n");
+}
+
+static int parse_size_list(const char *arg, size_t *list, size_t *len)
+{
+    char *end;
+    *len = 0;
+    while (*arg && *len < BENCH_MAX_LIST)
+    {
+        list[(*len)++] = strtoul(arg, &end, 10);
+        if (end == arg || list[*len - 1] == 0 || (*end != ',' && *end != '\0'))
+            return -1;
+        arg = *end ? end + 1 : end;
+    }
+    return *len ? 0 : -1;
+}
+
+static int parse_resolution_list(const char *arg, resolution *list, size_t *len)
+{
+    int consumed;
+    *len = 0;
+    while (*arg && *len < BENCH_MAX_LIST)
+    {
+        resolution *res = &list[(*len)++];
+        if (sscanf(arg, "%zux%zu%n", &res->width, &res->height, &consumed) != 2 || res->width == 0 || res->height == 0)
+            return -1;
+        arg += consumed;
+        if (*arg == ',')
+            ++arg;
+    }
+    return *len ? 0 : -1;
+}
+
+static int parse_order_list(const char *arg, curve_order *list, size_t *len)
+{
+    char name[16];
+    int consumed;
+    *len = 0;
+    while (*arg && *len < BENCH_MAX_LIST)
+    {
+        if (sscanf(arg, "%15[^,]%n", name, &consumed) != 1 || curve_order_parse(name, &list[(*len)++]) != 0)
+            return -1;
+        arg += consumed;
+        if (*arg == ',')
+            ++arg;
+    }
+    return *len ? 0 : -1;
+}
+
+static int parse_options(int argc, char **argv, bench_options *opts)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = cpus > 0 ? (size_t)cpus : 1;
+
+    opts->spheres[0] = 4;
+    opts->spheres[1] = 256;
+    opts->spheres[2] = 16384;
+    opts->spheres_len = 3;
+    opts->lights[0] = 2;
+    opts->lights_len = 1;
+    opts->resolutions[0].width = 640;
+    opts->resolutions[0].height = 360;
+    opts->resolutions_len = 1;
+    opts->threads_len = 0;
+    for (size_t threads = 1; threads < max_threads && opts->threads_len < BENCH_MAX_LIST - 1; threads *= 2)
+        opts->threads[opts->threads_len++] = threads;
+    opts->threads[opts->threads_len++] = max_threads;
+    opts->orders[0] = CURVE_ROW_MAJOR;
+    opts->orders_len = 1;
+    opts->warmup = 1;
+    opts->iterations = 5;
+    opts->accel = "bvh";
+    opts->scheduler = THREAD_POOL_SCHEDULER_FIFO;
+    opts->queue = THREAD_POOL_QUEUE_LOCKED;
+    opts->task_latency = 0;
+    opts->format = "csv";
+    opts->output = NULL;
+    opts->seed = 1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        int ok = 1;
+        if (strcmp(argv[i], "--spheres") == 0 && i + 1 < argc)
+            ok = parse_size_list(argv[++i], opts->spheres, &opts->spheres_len) == 0;
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+            ok = parse_size_list(argv[++i], opts->lights, &opts->lights_len) == 0;
+        else if (strcmp(argv[i], "--resolutions") == 0 && i + 1 < argc)
+            ok = parse_resolution_list(argv[++i], opts->resolutions, &opts->resolutions_len) == 0;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            ok = parse_size_list(argv[++i], opts->threads, &opts->threads_len) == 0;
+        else if (strcmp(argv[i], "--order") == 0 && i + 1 < argc)
+            ok = parse_order_list(argv[++i], opts->orders, &opts->orders_len) == 0;
+        else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+            opts->warmup = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            ok = (opts->iterations = strtoul(argv[++i], NULL, 10)) > 0;
+        else if (strcmp(argv[i], "--accel") == 0 && i + 1 < argc)
+            opts->accel = argv[++i];
+        else if (strcmp(argv[i], "--scheduler") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "fifo") == 0)
+                opts->scheduler = THREAD_POOL_SCHEDULER_FIFO;
+            else if (strcmp(argv[i], "ws") == 0)
+                opts->scheduler = THREAD_POOL_SCHEDULER_WORK_STEALING;
+            else
+                ok = 0;
+        }
+        else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "locked") == 0)
+                opts->queue = THREAD_POOL_QUEUE_LOCKED;
+            else if (strcmp(argv[i], "ring") == 0)
+                opts->queue = THREAD_POOL_QUEUE_RING;
+            else
+                ok = 0;
+        }
+        else if (strcmp(argv[i], "--task-latency") == 0)
+            opts->task_latency = 1;
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+            opts->format = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            opts->output = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            opts->seed = strtoull(argv[++i], NULL, 10) | 1;
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+
+        if (!ok)
+        {
+            printf("Invalid value for %s\n", argv[i - 1]);
+            return -1;
+        }
+    }
+
+    if (strcmp(opts->accel, "bvh") != 0 && strcmp(opts->accel, "soa") != 0 && strcmp(opts->accel, "linear") != 0)
+    {
+        printf("Unknown acceleration structure %s\n", opts->accel);
+        return -1;
+    }
+
+    if (strcmp(opts->format, "csv") != 0 && strcmp(opts->format, "json") != 0)
+    {
+        printf("Unknown output format %s\n", opts->format);
+        return -1;
+    }
+
+    return 0;
+}
+
+static FILE *open_output(const bench_options *opts)
+{
+    FILE *out = opts->output != NULL ? fopen(opts->output, "w") : stdout;
+    if (out == NULL)
+        printf("Error opening %s\n", opts->output);
+    return out;
+}
+
+static int run_latency_bench(const bench_options *opts)
+{
+    latency_result results[BENCH_MAX_LIST];
+    size_t results_len = 0;
+    for (size_t t = 0; t < opts->threads_len; ++t)
+    {
+        if (run_task_latency(opts, opts->threads[t], &results[results_len]) != 0)
+        {
+            printf("Error running the task latency bench on %zu threads\n", opts->threads[t]);
+            continue;
+        }
+        fprintf(stderr, "%zu threads: submit-to-start p50 %.0f ns, %.3f Mtasks/s\n", opts->threads[t],
+                results[results_len].p50_ns, results[results_len].mtasks_per_s);
+        results_len++;
+    }
+
+    FILE *out = open_output(opts);
+    if (out == NULL)
+        return 1;
+    write_latency_results(out, opts, results, results_len);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options opts;
+    if (parse_options(argc, argv, &opts) != 0)
+        return 1;
+
+    if (opts.task_latency)
+        return run_latency_bench(&opts);
+
+    size_t results_cap = opts.spheres_len * opts.lights_len * opts.resolutions_len * opts.threads_len * opts.orders_len;
+    bench_result *results = (bench_result *)calloc(results_cap, sizeof(bench_result));
+    if (results == NULL)
+    {
+        printf("Error allocate memory for results");
+        return 1;
+    }
+    size_t results_len = 0;
+
+    for (size_t s = 0; s < opts.spheres_len; ++s)
+    {
+        for (size_t r = 0; r < opts.resolutions_len; ++r)
+        {
+            resolution res = opts.resolutions[r];
+            sphere *spheres = generate_spheres(opts.spheres[s], res.width / (float)res.height, opts.seed);
+            if (spheres == NULL)
+            {
+                printf("Error allocate memory for spheres");
+                free(results);
+                return 1;
+            }
+
+            bvh *tree = NULL;
+            sphere_soa *soa = NULL;
+            double build_start = now_ms();
+            if (strcmp(opts.accel, "bvh") == 0)
+                tree = bvh_create(spheres, opts.spheres[s]);
+            else if (strcmp(opts.accel, "soa") == 0)
+                soa = sphere_soa_create(spheres, opts.spheres[s]);
+            double build_ms = now_ms() - build_start;
+
+            for (size_t l = 0; l < opts.lights_len; ++l)
+            {
+                light *lights = generate_lights(opts.lights[l], opts.seed + 1);
+                if (lights == NULL)
+                    break;
+
+                scene sc = scene_create(spheres, opts.spheres[s], lights, opts.lights[l]);
+                sc.bvh = tree;
+                sc.soa = soa;
+
+                for (size_t o = 0; o < opts.orders_len; ++o)
+                {
+                    bench_result *group = &results[results_len];
+                    for (size_t t = 0; t < opts.threads_len; ++t)
+                    {
+                        bench_result *result = &results[results_len];
+                        result->spheres = opts.spheres[s];
+                        result->lights = opts.lights[l];
+                        result->width = res.width;
+                        result->height = res.height;
+                        result->threads = opts.threads[t];
+                        result->order = opts.orders[o];
+                        result->build_ms = build_ms;
+                        if (run_frames(&opts, &sc, res, opts.threads[t], opts.orders[o], result) != 0)
+                        {
+                            printf("Error running %zu spheres on %zu threads\n", opts.spheres[s], opts.threads[t]);
+                            continue;
+                        }
+                        fprintf(stderr, "%zu spheres, %zu lights, %zux%zu, %zu threads, %s order: %.3f ms\n",
+                                result->spheres, result->lights, res.width, res.height, result->threads,
+                                curve_order_name(result->order), result->p50_ms);
+                        results_len++;
+                    }
+                    compute_efficiency(group, &results[results_len] - group);
+                }
+                free(lights);
+            }
+
+            bvh_destroy(tree);
+            sphere_soa_destroy(soa);
+            free(spheres);
+        }
+    }
+
+    FILE *out = open_output(&opts);
+    if (out == NULL)
+    {
+        free(results);
+        return 1;
+    }
+    write_results(out, &opts, results, results_len);
+    if (out != stdout)
+        fclose(out);
+
+    free(results);
+    return 0;
+}
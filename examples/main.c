@@ -1,132 +1,1856 @@
 #include "vector.h"
 #include "render.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+#include "packet.h"
+#include "image.h"
+#include "pixel_format.h"
+#include "stats.h"
+#include "scene_file.h"
+#include "animation.h"
+#include "camera.h"
+#include "curve.h"
 #include "math.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "float.h"
+#include "limits.h"
+#include "string.h"
+#include "time.h"
 #include "thread_pool.h"
+#include "net.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 // Global variables
-const size_t width = 3840;
-const size_t height = 2160;
-const size_t width_parts = 4;
-const size_t height_parts = 2;
-const size_t step_width = width / width_parts;
-const size_t step_height = height / height_parts;
-const int fov = M_PI / 2;
-vec3 *framebuffer;
+// Image size, set by --resolution before anything is rendered
+size_t width = 3840;
+size_t height = 2160;
+#define RENDER_ROW_CHUNK 64
+// Most NUMA nodes the counter dispatch gives their own tile region, and CPUs --affinity can list
+#define TILE_MAX_NODES 8
+#define AFFINITY_MAX_CPUS 256
+// Preview mode traces one pixel per PREVIEW_SCALE x PREVIEW_SCALE block first, then renders the
+// tiles within height / PREVIEW_FOCUS_SHARE of the focus point before all others
+#define PREVIEW_SCALE 8
+#define PREVIEW_FOCUS_SHARE 4
+// Pixels in the format chosen with --pixel
+unsigned char *framebuffer;
 
 // Structs
+typedef struct render_options
+{
+    // "bvh", "soa" or "linear"
+    const char *accel;
+    // SoA kernel override, NULL picks the best one for this CPU
+    const char *simd;
+    // Camera rays traced together, 1x1 traces one ray at a time
+    size_t packet_width;
+    size_t packet_height;
+    size_t thread_count;
+    thread_pool_scheduler scheduler;
+    thread_pool_queue queue;
+    // Worker pinning, the counter dispatch keeps each node on its own rows when workers are pinned
+    thread_pool_affinity affinity;
+    int affinity_cpus[AFFINITY_MAX_CPUS];
+    size_t affinity_cpus_len;
+    size_t tile_width;
+    size_t tile_height;
+    pixel_format pixel_format;
+    // "counter": one tile loop per worker claiming tiles, "pool": one parallel_for chunk per tile
+    const char *dispatch;
+    const char *output;
+    image_format format;
+    // Tonemap straight into the mapped output file instead of a buffer (TGA and PPM only)
+    int output_mmap;
+    integrator_settings integrator;
+    int occluder_cache;
+    // Print the RT_STATS summary after the frame
+    int stats;
+    // Chrome trace of tiles and tasks, NULL writes none
+    const char *trace;
+    // Rows per band in streaming mode, 0 renders the whole frame before writing it
+    size_t band_height;
+    // Bands rendered or waiting to be written at the same time, bounds memory in streaming mode
+    size_t band_window;
+    // Per-frame camera and sphere transforms, output then is a pattern such as frame_%04d.tga
+    const char *animation;
+    // Coordinator: hand tiles to worker processes connecting to this address
+    const char *listen;
+    // Worker: render tiles for the coordinator at this address
+    const char *connect;
+    // Text or binary scene, NULL renders the built-in one
+    const char *scene;
+    // Write the scene and its BVH as a binary scene file instead of rendering
+    const char *export_path;
+    // Low resolution image written before the frame, tiles then render nearest the focus first
+    const char *preview;
+    size_t focus_x;
+    size_t focus_y;
+    vec3 camera_position;
+    vec3 look_at;
+    // Vertical field of view in radians
+    float fov;
+    // Order tiles are handed out in and order of the packets or pixels inside a tile
+    curve_order tile_order;
+    curve_order pixel_order;
+} render_options;
+
+// Tiles [next, end) not claimed yet, counters of different regions sit on their own cache lines
+typedef struct tile_region
+{
+    _Alignas(64) atomic_size_t next;
+    size_t end;
+} tile_region;
+
+// Hands out tiles of rows [row_begin, row_end) to whichever worker asks next, in row-major order or
+// along a space-filling curve. Split by NUMA node, each node's workers drain their own band of tile
+// rows before helping the others, so the framebuffer pages a node renders are also the ones it touches first.
+typedef struct tile_scheduler
+{
+    tile_region regions[TILE_MAX_NODES];
+    size_t regions_len;
+    // Worker nodes pick the region, only used when regions_len > 1
+    thread_pool_t pool;
+    size_t tiles_x;
+    size_t tiles_y;
+    size_t tile_width;
+    size_t tile_height;
+    size_t row_begin;
+    size_t row_end;
+    // Dispatch position to tile, NULL for row-major
+    size_t *order;
+    // Packets, or pixels for 1x1 packets, of a full tile in the order render_tile traces them,
+    // NULL for row-major. Edge tiles skip the cells they do not have.
+    size_t *cell_order;
+    size_t cells_x;
+    size_t cells_y;
+} tile_scheduler;
+
 typedef struct render_thread_args
 {
-    size_t width_part_idx;
-    size_t height_part_idx;
-    sphere *spheres;
-    size_t spheres_len;
-    light *lights;
-    size_t lights_len;
-    const vec3 *orig;
-} render_thread_args;
+    tile_scheduler *tiles;
+    // Receives the pixels from (target_col, target_row) on with target_stride pixels per row: the whole
+    // framebuffer, the buffer of one band or of one tile
+    unsigned char *target;
+    size_t target_row;
+    size_t target_col;
+    size_t target_stride;
+    pixel_format format;
+    const scene *scene;
+    // Primary rays start at orig, the camera position or an animation frame's, and point where camera looks
+    const camera *camera;
+    const vec3 *orig;
+    size_t packet_width;
+    size_t packet_height;
+} render_thread_args;
+
+// Functions
+// Stores count pixels of one row starting at (x, y)
+void store_pixels(const render_thread_args *render_args, size_t x, size_t y, const vec3 *colors, size_t count)
+{
+    size_t offset = (x - render_args->target_col) + (y - render_args->target_row) * render_args->target_stride;
+    pixel_format_encode(render_args->format, colors, count,
+                        render_args->target + offset * pixel_format_size(render_args->format));
+}
+
+// Traces the packet with its top left pixel at (width_idx, height_idx)
+void render_packet(const render_thread_args *render_args, ray_packet *packet,
+                   size_t width_idx, size_t height_idx, size_t end_width, size_t end_height)
+{
+    size_t packet_width = render_args->packet_width;
+    size_t packet_height = render_args->packet_height;
+    vec3 colors[RAY_PACKET_MAX];
+
+    // Rays past the tile edge repeat the last pixel and are not stored
+    size_t count = MIN(packet_width, end_width - width_idx);
+    for (size_t row = 0; row < packet_height; ++row)
+    {
+        size_t y = MIN(height_idx + row, end_height - 1);
+        size_t first = row * packet_width;
+        camera_row_dirs(render_args->camera, width_idx, y, count,
+                        packet->dir_x + first, packet->dir_y + first, packet->dir_z + first);
+        for (size_t i = first + count; i < first + packet_width; ++i)
+        {
+            packet->dir_x[i] = packet->dir_x[first + count - 1];
+            packet->dir_y[i] = packet->dir_y[first + count - 1];
+            packet->dir_z[i] = packet->dir_z[first + count - 1];
+        }
+    }
+
+    cast_packet(packet, vector_create(0.5f, 0.5f, 0.5f), render_args->scene, colors);
+
+    for (size_t i = 0; i < packet->len; ++i)
+    {
+        size_t x = width_idx + i % packet_width;
+        size_t y = height_idx + i / packet_width;
+        if (x < end_width && y < end_height)
+            store_pixels(render_args, x, y, &colors[i], 1);
+    }
+}
+
+void render_packets(const render_thread_args *render_args,
+                    size_t begin_width, size_t begin_height, size_t end_width, size_t end_height)
+{
+    const tile_scheduler *tiles = render_args->tiles;
+    size_t packet_width = render_args->packet_width;
+    size_t packet_height = render_args->packet_height;
+
+    ray_packet packet;
+    packet.orig = *render_args->orig;
+    packet.len = packet_width * packet_height;
+
+    if (tiles->cell_order != NULL)
+    {
+        for (size_t i = 0; i < tiles->cells_x * tiles->cells_y; ++i)
+        {
+            size_t width_idx = begin_width + tiles->cell_order[i] % tiles->cells_x * packet_width;
+            size_t height_idx = begin_height + tiles->cell_order[i] / tiles->cells_x * packet_height;
+            if (width_idx < end_width && height_idx < end_height)
+                render_packet(render_args, &packet, width_idx, height_idx, end_width, end_height);
+        }
+        return;
+    }
+
+    for (size_t height_idx = begin_height; height_idx < end_height; height_idx += packet_height)
+    {
+        for (size_t width_idx = begin_width; width_idx < end_width; width_idx += packet_width)
+        {
+            render_packet(render_args, &packet, width_idx, height_idx, end_width, end_height);
+        }
+    }
+}
+
+void render_tile(const render_thread_args *render_args,
+                 size_t begin_width, size_t begin_height, size_t end_width, size_t end_height)
+{
+    size_t depth = 0;
+
+    if (render_args->packet_width * render_args->packet_height > 1)
+    {
+        render_packets(render_args, begin_width, begin_height, end_width, end_height);
+        return;
+    }
+
+    // Directions and colors are computed per row segment, colors are converted to the framebuffer format together
+    vec3 colors[RENDER_ROW_CHUNK];
+    float dir_x[RENDER_ROW_CHUNK], dir_y[RENDER_ROW_CHUNK], dir_z[RENDER_ROW_CHUNK];
+
+    const tile_scheduler *tiles = render_args->tiles;
+    if (tiles->cell_order != NULL)
+    {
+        // The same per stretch of the curve, but the pixels of a stretch are stored one by one
+        size_t xs[RENDER_ROW_CHUNK], ys[RENDER_ROW_CHUNK];
+        size_t cells_len = tiles->cells_x * tiles->cells_y;
+        for (size_t chunk = 0; chunk < cells_len; chunk += RENDER_ROW_CHUNK)
+        {
+            size_t chunk_end = MIN(chunk + RENDER_ROW_CHUNK, cells_len);
+            size_t count = 0;
+            for (size_t i = chunk; i < chunk_end; ++i)
+            {
+                xs[count] = begin_width + tiles->cell_order[i] % tiles->cells_x;
+                ys[count] = begin_height + tiles->cell_order[i] / tiles->cells_x;
+                count += xs[count] < end_width && ys[count] < end_height;
+            }
+            camera_pixel_dirs(render_args->camera, xs, ys, count, dir_x, dir_y, dir_z);
+            for (size_t i = 0; i < count; ++i)
+            {
+                colors[i] = cast_ray(*render_args->orig, vector_create(dir_x[i], dir_y[i], dir_z[i]),
+                                     vector_create(0.5f, 0.5f, 0.5f), render_args->scene, depth);
+            }
+            for (size_t i = 0; i < count; ++i)
+                store_pixels(render_args, xs[i], ys[i], &colors[i], 1);
+        }
+        return;
+    }
+    for (size_t height_idx = begin_height; height_idx < end_height; ++height_idx)
+    {
+        for (size_t chunk = begin_width; chunk < end_width; chunk += RENDER_ROW_CHUNK)
+        {
+            size_t chunk_end = MIN(chunk + RENDER_ROW_CHUNK, end_width);
+            camera_row_dirs(render_args->camera, chunk, height_idx, chunk_end - chunk, dir_x, dir_y, dir_z);
+            for (size_t width_idx = chunk; width_idx < chunk_end; ++width_idx)
+            {
+                size_t i = width_idx - chunk;
+                colors[i] =
+                    cast_ray(
+                        *render_args->orig,
+                        vector_create(dir_x[i], dir_y[i], dir_z[i]),
+                        vector_create(0.5f, 0.5f, 0.5f),
+                        render_args->scene, depth);
+            }
+            store_pixels(render_args, chunk, height_idx, colors, chunk_end - chunk);
+        }
+    }
+}
+
+// @return 0 on success, -1 if the curve orders could not be allocated
+int tile_scheduler_init(tile_scheduler *tiles, const render_options *opts, size_t row_begin, size_t row_end)
+{
+    tiles->tile_width = opts->tile_width;
+    tiles->tile_height = opts->tile_height;
+    tiles->tiles_x = (width + opts->tile_width - 1) / opts->tile_width;
+    tiles->tiles_y = (row_end - row_begin + opts->tile_height - 1) / opts->tile_height;
+    tiles->row_begin = row_begin;
+    tiles->row_end = row_end;
+
+    atomic_init(&tiles->regions[0].next, 0);
+    tiles->regions[0].end = tiles->tiles_x * tiles->tiles_y;
+    tiles->regions_len = 1;
+    tiles->pool = NULL;
+
+    tiles->order = NULL;
+    tiles->cell_order = NULL;
+    tiles->cells_x = (opts->tile_width + opts->packet_width - 1) / opts->packet_width;
+    tiles->cells_y = (opts->tile_height + opts->packet_height - 1) / opts->packet_height;
+    if (opts->tile_order != CURVE_ROW_MAJOR)
+    {
+        if ((tiles->order = (size_t *)malloc(tiles->tiles_x * tiles->tiles_y * sizeof(size_t))) == NULL)
+            return -1;
+        curve_order_fill(opts->tile_order, tiles->tiles_x, tiles->tiles_y, tiles->order);
+    }
+    if (opts->pixel_order != CURVE_ROW_MAJOR)
+    {
+        if ((tiles->cell_order = (size_t *)malloc(tiles->cells_x * tiles->cells_y * sizeof(size_t))) == NULL)
+            return -1;
+        curve_order_fill(opts->pixel_order, tiles->cells_x, tiles->cells_y, tiles->cell_order);
+    }
+    return 0;
+}
+
+void tile_scheduler_close(tile_scheduler *tiles)
+{
+    free(tiles->order);
+    free(tiles->cell_order);
+    tiles->order = NULL;
+    tiles->cell_order = NULL;
+}
+
+// Tile handed out at dispatch position
+size_t tile_scheduler_tile(const tile_scheduler *tiles, size_t position)
+{
+    return tiles->order != NULL ? tiles->order[position] : position;
+}
+
+// One region of whole tile rows per node of the pool, a region is one contiguous framebuffer range.
+// With a curve order a region is a stretch of the curve instead, which is just as compact.
+void tile_scheduler_split(tile_scheduler *tiles, thread_pool_t pool)
+{
+    size_t regions_len = MIN(get_node_count_thread_pool(pool), TILE_MAX_NODES);
+    regions_len = MIN(regions_len, tiles->tiles_y);
+    if (regions_len <= 1)
+        return;
+
+    for (size_t i = 0; i < regions_len; ++i)
+    {
+        atomic_init(&tiles->regions[i].next, i * tiles->tiles_y / regions_len * tiles->tiles_x);
+        tiles->regions[i].end = (i + 1) * tiles->tiles_y / regions_len * tiles->tiles_x;
+    }
+    tiles->regions_len = regions_len;
+    tiles->pool = pool;
+}
+
+void tile_bounds(const tile_scheduler *tiles, size_t tile,
+                 size_t *begin_width, size_t *begin_height, size_t *end_width, size_t *end_height)
+{
+    *begin_width = (tile % tiles->tiles_x) * tiles->tile_width;
+    *begin_height = tiles->row_begin + (tile / tiles->tiles_x) * tiles->tile_height;
+    *end_width = MIN(*begin_width + tiles->tile_width, width);
+    *end_height = MIN(*begin_height + tiles->tile_height, tiles->row_end);
+}
+
+void render_tile_index(const render_thread_args *render_args, size_t tile)
+{
+    size_t begin_width, begin_height, end_width, end_height;
+    tile_bounds(render_args->tiles, tile, &begin_width, &begin_height, &end_width, &end_height);
+
+    RT_STATS_TIME(tile_start);
+    render_tile(render_args, begin_width, begin_height, end_width, end_height);
+    RT_STATS_SPAN("tile", tile, tile_start);
+}
+
+// Every worker keeps taking tiles until none are left, so all of them stay busy to the end of the frame
+void render_thread(void *args)
+{
+    const render_thread_args *render_args = (const render_thread_args *)args;
+    tile_scheduler *tiles = render_args->tiles;
+
+    size_t home = 0;
+    if (tiles->regions_len > 1)
+        home = get_worker_node_thread_pool(tiles->pool, get_current_worker_thread_pool(tiles->pool)) % tiles->regions_len;
+
+    for (size_t i = 0; i < tiles->regions_len; ++i)
+    {
+        tile_region *region = &tiles->regions[(home + i) % tiles->regions_len];
+        for (size_t position = atomic_fetch_add(&region->next, 1); position < region->end; position = atomic_fetch_add(&region->next, 1))
+        {
+            render_tile_index(render_args, tile_scheduler_tile(tiles, position));
+        }
+    }
+}
+
+// Renders the tiles at dispatch positions [begin, end)
+void render_tiles(size_t begin, size_t end, void *args)
+{
+    const render_thread_args *render_args = (const render_thread_args *)args;
+    for (size_t position = begin; position < end; ++position)
+    {
+        render_tile_index(render_args, tile_scheduler_tile(render_args->tiles, position));
+    }
+}
+
+// Task timelines from a pool built with THPOOL_TRACE
+void trace_task(const thread_pool_trace_event *event, void *user)
+{
+    (void)user;
+    rt_stats_record("task", event->worker, event->start_ns, event->end_ns, event->start_ns - event->enqueue_ns);
+}
+
+typedef struct tonemap_args
+{
+    const unsigned char *pixels;
+    pixel_format format;
+    unsigned char *rgb;
+} tonemap_args;
+
+void tonemap_rows(size_t begin, size_t end, void *ctx)
+{
+    tonemap_args *args = (tonemap_args *)ctx;
+    pixel_format_tonemap(args->format, args->pixels + begin * width * pixel_format_size(args->format),
+                         (end - begin) * width, args->rgb + begin * width * 3);
+}
+
+// Tonemaps the framebuffer on the pool into packed 8-bit RGB, then hands it to the encoder in one call
+void write_output(thread_pool_t pool, const render_options *opts)
+{
+    tonemap_args args;
+    args.pixels = framebuffer;
+    args.format = opts->pixel_format;
+
+    if (opts->output_mmap)
+    {
+        image_mapping mapping;
+        if (image_map_create(&mapping, opts->output, opts->format, width, height) != 0)
+        {
+            printf("Error map output file %s\n", opts->output);
+            return;
+        }
+
+        args.rgb = mapping.pixels;
+        parallel_for_thread_pool(pool, 0, height, 16, tonemap_rows, &args);
+        wait_thread_pool(pool);
+        image_map_close(&mapping);
+        return;
+    }
+
+    // An RGB8 framebuffer already is the 8-bit image
+    args.rgb = opts->pixel_format == PIXEL_FORMAT_RGB8 ? framebuffer : (unsigned char *)malloc(width * height * 3);
+    if (args.rgb == NULL)
+    {
+        printf("Error allocate memory for output");
+        return;
+    }
+
+    if (args.rgb != framebuffer)
+    {
+        parallel_for_thread_pool(pool, 0, height, 16, tonemap_rows, &args);
+        wait_thread_pool(pool);
+    }
+
+    image_writer *writer = image_writer_open(opts->output, opts->format, width, height);
+    if (writer == NULL || image_writer_write_rows(writer, args.rgb, height) != 0 || image_writer_close(writer) != 0)
+        printf("Error write output file %s\n", opts->output);
+    if (args.rgb != framebuffer)
+        free(args.rgb);
+}
+
+// Time since start on the monotonic clock
+double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+typedef struct preview_milestone
+{
+    const struct timespec *start;
+    double ms;
+} preview_milestone;
+
+typedef struct preview_state
+{
+    const render_thread_args *args;
+    const render_options *opts;
+    // One traced pixel per block, 8-bit RGB
+    unsigned char *rgb;
+    size_t width;
+    size_t height;
+    // Tile indices by distance of the tile center from the focus point
+    size_t *order;
+    struct timespec start;
+    preview_milestone written;
+    preview_milestone focused;
+} preview_state;
+
+typedef struct tile_distance
+{
+    double distance;
+    size_t tile;
+} tile_distance;
+
+int tile_distance_compare(const void *a, const void *b)
+{
+    const tile_distance *lhs = (const tile_distance *)a;
+    const tile_distance *rhs = (const tile_distance *)b;
+    if (lhs->distance != rhs->distance)
+        return lhs->distance < rhs->distance ? -1 : 1;
+    return lhs->tile < rhs->tile ? -1 : lhs->tile > rhs->tile;
+}
+
+// Sorts the tiles by distance from the focus point, returns how many lie within the focus radius
+size_t preview_order(const tile_scheduler *tiles, const render_options *opts, size_t *order)
+{
+    size_t tiles_len = tiles->tiles_x * tiles->tiles_y;
+    tile_distance *distances = (tile_distance *)malloc(tiles_len * sizeof(tile_distance));
+    if (distances == NULL)
+    {
+        for (size_t i = 0; i < tiles_len; ++i)
+            order[i] = i;
+        return tiles_len;
+    }
+
+    double radius = (double)height / PREVIEW_FOCUS_SHARE;
+    size_t focus_len = 0;
+    for (size_t tile = 0; tile < tiles_len; ++tile)
+    {
+        size_t begin_width, begin_height, end_width, end_height;
+        tile_bounds(tiles, tile, &begin_width, &begin_height, &end_width, &end_height);
+        double dx = (begin_width + end_width) / 2. - opts->focus_x;
+        double dy = (begin_height + end_height) / 2. - opts->focus_y;
+        distances[tile].distance = sqrt(dx * dx + dy * dy);
+        distances[tile].tile = tile;
+        focus_len += distances[tile].distance <= radius;
+    }
+
+    qsort(distances, tiles_len, sizeof(tile_distance), tile_distance_compare);
+    for (size_t i = 0; i < tiles_len; ++i)
+        order[i] = distances[i].tile;
+    free(distances);
+    return focus_len;
+}
+
+void record_milestone(void *arg)
+{
+    preview_milestone *milestone = (preview_milestone *)arg;
+    milestone->ms = elapsed_ms(milestone->start);
+}
+
+// Traces the center pixel of every block in preview rows [begin, end)
+void preview_rows(size_t begin, size_t end, void *ctx)
+{
+    preview_state *state = (preview_state *)ctx;
+    const render_thread_args *args = state->args;
+
+    vec3 colors[RENDER_ROW_CHUNK];
+    for (size_t row = begin; row < end; ++row)
+    {
+        size_t y = MIN(row * PREVIEW_SCALE + PREVIEW_SCALE / 2, height - 1);
+        for (size_t chunk = 0; chunk < state->width; chunk += RENDER_ROW_CHUNK)
+        {
+            size_t chunk_end = MIN(chunk + RENDER_ROW_CHUNK, state->width);
+            for (size_t col = chunk; col < chunk_end; ++col)
+            {
+                size_t x = MIN(col * PREVIEW_SCALE + PREVIEW_SCALE / 2, width - 1);
+                colors[col - chunk] = cast_ray(*args->orig, camera_ray_dir(args->camera, x, y),
+                                               vector_create(0.5f, 0.5f, 0.5f), args->scene, 0);
+            }
+            pixel_format_encode(PIXEL_FORMAT_RGB8, colors, chunk_end - chunk,
+                                state->rgb + (row * state->width + chunk) * 3);
+        }
+    }
+}
+
+void write_preview(void *arg)
+{
+    preview_state *state = (preview_state *)arg;
+
+    // Like the output, the extension picks the format and anything unknown is TGA
+    image_format format = IMAGE_FORMAT_TGA;
+    image_format_parse(state->opts->preview, &format);
+
+    image_writer *writer = image_writer_open(state->opts->preview, format, state->width, state->height);
+    if (writer == NULL || image_writer_write_rows(writer, state->rgb, state->height) != 0 || image_writer_close(writer) != 0)
+        printf("Error write preview file %s\n", state->opts->preview);
+    record_milestone(&state->written);
+}
+
+void preview_tiles(size_t begin, size_t end, void *ctx)
+{
+    preview_state *state = (preview_state *)ctx;
+    for (size_t i = begin; i < end; ++i)
+    {
+        render_tile_index(state->args, state->order[i]);
+    }
+}
+
+// Queues the whole frame at once as prioritized groups: the coarse pass and the preview write first,
+// then the tiles around the focus point nearest first, then the remaining tiles at low priority.
+// Workers never idle between the stages, so the frame costs little more than the coarse pass.
+void render_preview(thread_pool_t pool, const render_thread_args *args, const tile_scheduler *tiles,
+                    const render_options *opts)
+{
+    preview_state state;
+    state.args = args;
+    state.opts = opts;
+    state.width = (width + PREVIEW_SCALE - 1) / PREVIEW_SCALE;
+    state.height = (height + PREVIEW_SCALE - 1) / PREVIEW_SCALE;
+    state.rgb = (unsigned char *)malloc(state.width * state.height * 3);
+    size_t tiles_len = tiles->tiles_x * tiles->tiles_y;
+    state.order = (size_t *)malloc(tiles_len * sizeof(size_t));
+    if (state.rgb == NULL || state.order == NULL)
+    {
+        printf("Error allocate memory for preview");
+        free(state.rgb);
+        free(state.order);
+        return;
+    }
+    size_t focus_len = preview_order(tiles, opts, state.order);
+
+    clock_gettime(CLOCK_MONOTONIC, &state.start);
+    state.written.start = &state.start;
+    state.written.ms = 0.;
+    state.focused.start = &state.start;
+    state.focused.ms = 0.;
+
+    thread_pool_group_t coarse = create_group_thread_pool(pool);
+    thread_pool_group_t written = create_group_thread_pool(pool);
+    thread_pool_group_t focus = create_group_thread_pool(pool);
+    thread_pool_group_t focused = create_group_thread_pool(pool);
+    thread_pool_group_t rest = create_group_thread_pool(pool);
+    int result = coarse == NULL || written == NULL || focus == NULL || focused == NULL || rest == NULL ? -1 : 0;
+
+    if (result == 0)
+    {
+        set_group_priority_thread_pool(coarse, THREAD_POOL_PRIORITY_HIGH);
+        set_group_priority_thread_pool(written, THREAD_POOL_PRIORITY_HIGH);
+        set_group_priority_thread_pool(focused, THREAD_POOL_PRIORITY_HIGH);
+        set_group_priority_thread_pool(rest, THREAD_POOL_PRIORITY_LOW);
+
+        result |= add_group_dependency_thread_pool(written, coarse);
+        result |= add_group_task_thread_pool(written, write_preview, &state);
+        result |= add_group_dependency_thread_pool(focused, focus);
+        result |= add_group_task_thread_pool(focused, record_milestone, &state.focused);
+        result |= parallel_for_group_thread_pool(coarse, 0, state.height, 1, preview_rows, &state);
+        result |= parallel_for_group_thread_pool(focus, 0, focus_len, 1, preview_tiles, &state);
+        result |= parallel_for_group_thread_pool(rest, focus_len, tiles_len, 1, preview_tiles, &state);
+    }
+    if (result != 0)
+        printf("Error allocate memory for preview tasks");
+
+    // Everything queued finishes even after an error, the state the tasks point to lives on this
+    // stack. Prerequisites are closed before anything waits for their dependents.
+    thread_pool_group_t groups[] = {coarse, written, focus, focused, rest};
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i)
+    {
+        if (groups[i] != NULL)
+            close_group_thread_pool(groups[i]);
+    }
+    destroy_group_thread_pool(rest);
+    double frame_ms = elapsed_ms(&state.start);
+    for (size_t i = 0; i + 1 < sizeof(groups) / sizeof(groups[0]); ++i)
+        destroy_group_thread_pool(groups[i]);
+
+    if (result == 0)
+        printf("Preview %s after %.1f ms, tiles around the focus after %.1f ms, frame after %.1f ms\n",
+               opts->preview, state.written.ms, state.focused.ms, frame_ms);
+    free(state.order);
+    free(state.rgb);
+}
+
+// Renders the whole frame into the framebuffer, then writes it. The framebuffer is large enough to
+// come straight from mmap, its pages are untouched until the worker rendering a tile writes them.
+void render_frame(thread_pool_t pool, render_thread_args *args, const render_options *opts)
+{
+    framebuffer = (unsigned char *)malloc(width * height * pixel_format_size(opts->pixel_format));
+    if (framebuffer == NULL)
+    {
+        printf("Error allocate memory for framebuffer");
+        return;
+    }
+
+    tile_scheduler tiles;
+    if (tile_scheduler_init(&tiles, opts, 0, height) != 0)
+    {
+        printf("Error allocate memory for tile order");
+        tile_scheduler_close(&tiles);
+        free(framebuffer);
+        return;
+    }
+
+    args->tiles = &tiles;
+    args->target = framebuffer;
+    args->target_row = 0;
+    args->target_col = 0;
+    args->target_stride = width;
+    args->format = opts->pixel_format;
+
+    if (opts->preview != NULL)
+    {
+        render_preview(pool, args, &tiles, opts);
+    }
+    else if (strcmp(opts->dispatch, "pool") == 0)
+    {
+        parallel_for_thread_pool(pool, 0, tiles.tiles_x * tiles.tiles_y, 1, render_tiles, args);
+    }
+    else
+    {
+        // One tile loop per worker, the tiles themselves are claimed through the atomic counter
+        tile_scheduler_split(&tiles, pool);
+        for (size_t i = 0; i < opts->thread_count; ++i)
+        {
+            add_task_thread_pool(pool, render_thread, args);
+        }
+    }
+
+    wait_thread_pool(pool);
+    write_output(pool, opts);
+    tile_scheduler_close(&tiles);
+    free(framebuffer);
+}
+
+typedef struct band_stream
+{
+    image_writer *writer;
+    const render_options *opts;
+    atomic_int failed;
+} band_stream;
+
+// One slot of the reorder window, band i is rendered into slot i % window. Each band is a small graph:
+// its tiles, then the tonemap of its rows, then the write, which also waits for the previous band's write.
+typedef struct stream_band
+{
+    band_stream *stream;
+    render_thread_args args;
+    tile_scheduler tiles;
+    tonemap_args tonemap;
+    size_t rows;
+    unsigned char *pixels;
+    // Same buffer as pixels for RGB8
+    unsigned char *rgb;
+    thread_pool_group_t rendered;
+    thread_pool_group_t tonemapped;
+    thread_pool_group_t written;
+} stream_band;
+
+void write_band(void *arg)
+{
+    stream_band *band = (stream_band *)arg;
+    band_stream *stream = band->stream;
+
+    if (!atomic_load(&stream->failed) && image_writer_write_rows(stream->writer, band->rgb, band->rows) != 0)
+    {
+        printf("Error write output file %s\n", stream->opts->output);
+        atomic_store(&stream->failed, 1);
+    }
+}
+
+// Waits until the band in the slot is written, running tiles of the other bands meanwhile
+void finish_band(stream_band *band)
+{
+    destroy_group_thread_pool(band->written);
+    destroy_group_thread_pool(band->tonemapped);
+    destroy_group_thread_pool(band->rendered);
+    band->written = NULL;
+    band->tonemapped = NULL;
+    band->rendered = NULL;
+    tile_scheduler_close(&band->tiles);
+}
+
+int submit_band(thread_pool_t pool, stream_band *band, const render_thread_args *base, size_t index,
+                thread_pool_group_t previous_written, const render_options *opts)
+{
+    size_t row_begin = index * opts->band_height;
+
+    band->rows = MIN(opts->band_height, height - row_begin);
+    if (tile_scheduler_init(&band->tiles, opts, row_begin, row_begin + band->rows) != 0)
+        return -1;
+
+    band->args = *base;
+    band->args.tiles = &band->tiles;
+    band->args.target = band->pixels;
+    band->args.target_row = row_begin;
+    band->args.target_col = 0;
+    band->args.target_stride = width;
+    band->args.format = opts->pixel_format;
+
+    band->tonemap.pixels = band->pixels;
+    band->tonemap.format = opts->pixel_format;
+    band->tonemap.rgb = band->rgb;
+
+    band->rendered = create_group_thread_pool(pool);
+    band->tonemapped = band->rgb != band->pixels ? create_group_thread_pool(pool) : NULL;
+    band->written = create_group_thread_pool(pool);
+    if (band->rendered == NULL || band->written == NULL || (band->rgb != band->pixels && band->tonemapped == NULL))
+        return -1;
+
+    thread_pool_group_t pixels_ready = band->rendered;
+    int result = parallel_for_group_thread_pool(band->rendered, 0, band->tiles.tiles_x * band->tiles.tiles_y, 1,
+                                                render_tiles, &band->args);
+    close_group_thread_pool(band->rendered);
+
+    if (band->tonemapped != NULL)
+    {
+        result |= add_group_dependency_thread_pool(band->tonemapped, band->rendered);
+        result |= parallel_for_group_thread_pool(band->tonemapped, 0, band->rows, 16, tonemap_rows, &band->tonemap);
+        close_group_thread_pool(band->tonemapped);
+        pixels_ready = band->tonemapped;
+    }
+
+    result |= add_group_dependency_thread_pool(band->written, pixels_ready);
+    if (previous_written != NULL)
+        result |= add_group_dependency_thread_pool(band->written, previous_written);
+    result |= add_group_task_thread_pool(band->written, write_band, band);
+    close_group_thread_pool(band->written);
+    return result;
+}
+
+// Renders the frame in horizontal bands and writes each band as soon as every band above it is written.
+// At most band_window bands are in flight, bands that finish early wait in their slot, so memory
+// depends on the width, band height and window but not on the image height.
+void render_stream(thread_pool_t pool, const render_thread_args *args, const render_options *opts)
+{
+    size_t bands_count = (height + opts->band_height - 1) / opts->band_height;
+    size_t window = MIN(opts->band_window, bands_count);
+
+    band_stream stream;
+    stream.opts = opts;
+    atomic_init(&stream.failed, 0);
+
+    stream_band *bands = (stream_band *)calloc(window, sizeof(stream_band));
+    int failed = bands == NULL;
+    for (size_t i = 0; i < window && !failed; ++i)
+    {
+        bands[i].stream = &stream;
+        bands[i].pixels = (unsigned char *)malloc(opts->band_height * width * pixel_format_size(opts->pixel_format));
+        bands[i].rgb = opts->pixel_format == PIXEL_FORMAT_RGB8 ? bands[i].pixels : (unsigned char *)malloc(opts->band_height * width * 3);
+        failed = bands[i].pixels == NULL || bands[i].rgb == NULL;
+    }
+
+    stream.writer = failed ? NULL : image_writer_open(opts->output, opts->format, width, height);
+    if (failed)
+        printf("Error allocate memory for bands");
+    else if (stream.writer == NULL)
+        printf("Error write output file %s\n", opts->output);
+
+    for (size_t index = 0; index < bands_count && stream.writer != NULL && !failed; ++index)
+    {
+        // A slot is refilled only after the band that used it has been written
+        stream_band *band = &bands[index % window];
+        finish_band(band);
+        if (atomic_load(&stream.failed))
+            break;
+
+        thread_pool_group_t previous = index && window > 1 ? bands[(index - 1) % window].written : NULL;
+        if (submit_band(pool, band, args, index, previous, opts) != 0)
+        {
+            printf("Error allocate memory for band tasks");
+            failed = 1;
+        }
+    }
+
+    // Bands still in flight after an error must finish before their slots are freed
+    for (size_t i = 0; bands != NULL && i < window; ++i)
+        finish_band(&bands[i]);
+    failed |= atomic_load(&stream.failed);
+    if (stream.writer != NULL && image_writer_close(stream.writer) != 0 && !failed)
+        printf("Error write output file %s\n", opts->output);
+
+    for (size_t i = 0; bands != NULL && i < window; ++i)
+    {
+        if (bands[i].rgb != bands[i].pixels)
+            free(bands[i].rgb);
+        free(bands[i].pixels);
+    }
+    free(bands);
+}
+
+// Frames in flight: the one being prepared and started, the one finishing and the one being encoded
+#define ANIMATION_SLOTS 3
+
+struct animation_state;
+
+// Everything one frame in flight needs. Slots are set up on first use and reused for every
+// ANIMATION_SLOTS-th frame, nothing is allocated per frame.
+typedef struct frame_slot
+{
+    struct animation_state *state;
+    size_t frame;
+    sphere *spheres;
+    bvh *tree;
+    sphere_soa *soa;
+    scene sc;
+    // Shares the offsets of the render's camera, only position and basis are the frame's
+    camera cam;
+    tile_scheduler tiles;
+    render_thread_args args;
+    unsigned char *pixels;
+    // Same buffer as pixels for RGB8
+    unsigned char *rgb;
+    // The frame's tiles and its encoding, which depends on them, NULL while the slot is free
+    thread_pool_group_t rendered;
+    thread_pool_group_t encoded;
+} frame_slot;
+
+typedef struct animation_state
+{
+    thread_pool_t pool;
+    const render_options *opts;
+} animation_state;
+
+// Runs on the pool next to the tiles of the following frames
+void encode_frame(void *arg)
+{
+    frame_slot *slot = (frame_slot *)arg;
+    const render_options *opts = slot->state->opts;
+
+    RT_STATS_TIME(encode_start);
+    if (slot->rgb != slot->pixels)
+        pixel_format_tonemap(slot->args.format, slot->pixels, width * height, slot->rgb);
+
+    char path[1024];
+    snprintf(path, sizeof(path), opts->output, (int)slot->frame);
+    image_writer *writer = image_writer_open(path, opts->format, width, height);
+    if (writer == NULL || image_writer_write_rows(writer, slot->rgb, height) != 0 || image_writer_close(writer) != 0)
+        printf("Error write output file %s\n", path);
+    RT_STATS_SPAN("encode", slot->frame, encode_start);
+}
+
+// Waits until the frame in the slot is written, running tiles of the other frames meanwhile
+void frame_slot_finish(frame_slot *slot)
+{
+    destroy_group_thread_pool(slot->encoded);
+    destroy_group_thread_pool(slot->rendered);
+    slot->encoded = NULL;
+    slot->rendered = NULL;
+    tile_scheduler_close(&slot->tiles);
+}
+
+int frame_slot_init(frame_slot *slot, animation_state *state, const scene *base)
+{
+    const render_options *opts = state->opts;
+
+    slot->state = state;
+    slot->sc = *base;
+    slot->spheres = (sphere *)malloc((base->spheres_len ? base->spheres_len : 1) * sizeof(sphere));
+    slot->pixels = (unsigned char *)malloc(width * height * pixel_format_size(opts->pixel_format));
+    slot->rgb = opts->pixel_format == PIXEL_FORMAT_RGB8 ? slot->pixels : (unsigned char *)malloc(width * height * 3);
+    if (slot->spheres == NULL || slot->pixels == NULL || slot->rgb == NULL)
+        return -1;
+    memcpy(slot->spheres, base->spheres, base->spheres_len * sizeof(sphere));
+    slot->sc.spheres = slot->spheres;
+
+    // The structures of the first frame are copied and refit from then on, never rebuilt
+    if (base->bvh != NULL && (slot->tree = bvh_copy(base->bvh)) == NULL)
+        return -1;
+    if (base->soa != NULL)
+    {
+        if ((slot->soa = sphere_soa_create(slot->spheres, base->spheres_len)) == NULL)
+            return -1;
+        sphere_soa_set_kernel(slot->soa, base->soa->kernel_name);
+    }
+    slot->sc.bvh = slot->tree;
+    slot->sc.soa = slot->soa;
+    return 0;
+}
+
+void frame_slot_destroy(frame_slot *slot)
+{
+    frame_slot_finish(slot);
+    if (slot->rgb != slot->pixels)
+        free(slot->rgb);
+    free(slot->pixels);
+    free(slot->spheres);
+    bvh_destroy(slot->tree);
+    sphere_soa_destroy(slot->soa);
+}
+
+int submit_frame(frame_slot *slot, const scene *base, const animation *anim, size_t frame,
+                 const render_thread_args *args)
+{
+    const render_options *opts = slot->state->opts;
+
+    slot->frame = frame;
+    animation_apply(anim, frame, base->spheres, base->spheres_len, slot->spheres);
+    if (slot->tree != NULL)
+        bvh_refit(slot->tree, slot->spheres);
+    if (slot->soa != NULL)
+        sphere_soa_update(slot->soa, slot->spheres);
+    const animation_frame *f = &anim->frames[frame];
+    slot->cam = *args->camera;
+    slot->cam.position = f->camera;
+    if (f->has_look_at && camera_look_at(&slot->cam, f->camera, f->look_at, vector_create(0.f, 1.f, 0.f)) != 0)
+        return -1;
+
+    if (tile_scheduler_init(&slot->tiles, opts, 0, height) != 0)
+        return -1;
+
+    slot->args = *args;
+    slot->args.tiles = &slot->tiles;
+    slot->args.scene = &slot->sc;
+    slot->args.camera = &slot->cam;
+    slot->args.orig = &slot->cam.position;
+    slot->args.target = slot->pixels;
+    slot->args.target_row = 0;
+    slot->args.target_col = 0;
+    slot->args.target_stride = width;
+    slot->args.format = opts->pixel_format;
+
+    slot->rendered = create_group_thread_pool(slot->state->pool);
+    slot->encoded = create_group_thread_pool(slot->state->pool);
+    if (slot->rendered == NULL || slot->encoded == NULL)
+        return -1;
+
+    // The encoding is queued as soon as the last tile is done, behind the tiles already waiting
+    int result = parallel_for_group_thread_pool(slot->rendered, 0, slot->tiles.tiles_x * slot->tiles.tiles_y, 1,
+                                                render_tiles, &slot->args);
+    close_group_thread_pool(slot->rendered);
+    result |= add_group_dependency_thread_pool(slot->encoded, slot->rendered);
+    result |= add_group_task_thread_pool(slot->encoded, encode_frame, slot);
+    close_group_thread_pool(slot->encoded);
+    return result;
+}
+
+// Frames are submitted as soon as a slot is free, so the pool works on the tail of one frame, the
+// start of the next and the encoding of the previous one at the same time
+void render_animation(thread_pool_t pool, const render_thread_args *args, const scene *base,
+                      const animation *anim, const render_options *opts)
+{
+    animation_state state;
+    state.pool = pool;
+    state.opts = opts;
+
+    frame_slot slots[ANIMATION_SLOTS];
+    memset(slots, 0, sizeof(slots));
+    size_t slots_len = 0;
+
+    for (size_t frame = 0; frame < anim->frames_len; ++frame)
+    {
+        frame_slot *slot = &slots[frame % ANIMATION_SLOTS];
+        if (frame < ANIMATION_SLOTS)
+        {
+            slots_len++;
+            if (frame_slot_init(slot, &state, base) != 0)
+            {
+                printf("Error allocate memory for frame");
+                break;
+            }
+        }
+
+        frame_slot_finish(slot);
+        if (submit_frame(slot, base, anim, frame, args) != 0)
+        {
+            printf("Error submit frame %zu\n", frame);
+            break;
+        }
+    }
+
+    // Destroying a slot first waits for its frame to be written
+    for (size_t i = 0; i < slots_len; ++i)
+        frame_slot_destroy(&slots[i]);
+}
+
+void render(thread_pool_t pool, const scene *sc, const animation *anim, const render_options *opts)
+{
+    camera cam;
+    if (camera_init(&cam, width, height, opts->camera_position, opts->look_at, vector_create(0.f, 1.f, 0.f), opts->fov) != 0)
+    {
+        printf("Error set up camera");
+        return;
+    }
 
-// Functions
-void render_thread(void *args)
+#ifdef RT_STATS
+    rt_stats_reset();
+    set_trace_thread_pool(pool, trace_task, NULL);
+#endif
+
+    render_thread_args args;
+    args.camera = &cam;
+    args.orig = &cam.position;
+    args.scene = sc;
+    args.packet_width = opts->packet_width;
+    args.packet_height = opts->packet_height;
+
+    if (anim != NULL)
+        render_animation(pool, &args, sc, anim, opts);
+    else if (opts->band_height)
+        render_stream(pool, &args, opts);
+    else
+        render_frame(pool, &args, opts);
+
+#ifdef RT_STATS
+    set_trace_thread_pool(pool, NULL, NULL);
+    if (opts->stats)
+        rt_stats_write_summary(stdout);
+    if (opts->trace != NULL && rt_stats_write_chrome_trace(opts->trace) != 0)
+        printf("Error write trace %s\n", opts->trace);
+#endif
+    camera_close(&cam);
+}
+
+#define COORDINATOR_MAX_WORKERS 64
+
+typedef struct remote_worker
 {
-    render_thread_args *render_args = (render_thread_args *)args;
+    int fd;
+    // Tiles the worker asked to have queued at once
+    size_t capacity;
+    size_t in_flight;
+} remote_worker;
 
-    size_t depth = 0;
+// Tiles are handed out from the pending stack and remembered by the socket that renders them, so a
+// worker that disconnects has its tiles pushed back and reissued to the others
+typedef struct coordinator
+{
+    const render_options *opts;
+    tile_scheduler tiles;
+    unsigned char *rgb;
+    size_t *pending;
+    size_t pending_len;
+    int *owner;
+    size_t done;
+    remote_worker workers[COORDINATOR_MAX_WORKERS];
+    size_t workers_len;
+    unsigned char *job;
+    size_t job_size;
+} coordinator;
+
+void coordinator_lose_worker(coordinator *co, size_t index)
+{
+    remote_worker *worker = &co->workers[index];
+    size_t tiles_count = co->tiles.tiles_x * co->tiles.tiles_y;
 
-    size_t begin_width = step_width * render_args->width_part_idx;
-    size_t begin_height = step_height * render_args->height_part_idx;
+    size_t reissued = 0;
+    for (size_t tile = 0; tile < tiles_count; ++tile)
+    {
+        if (co->owner[tile] == worker->fd)
+        {
+            co->owner[tile] = -1;
+            co->pending[co->pending_len++] = tile;
+            ++reissued;
+        }
+    }
+    printf("Worker lost, reissuing %zu tiles\n", reissued);
 
-    size_t end_width = begin_width + step_width;
-    size_t end_height = begin_height + step_height;
+    close(worker->fd);
+    *worker = co->workers[--co->workers_len];
+}
 
-    for (size_t height_idx = begin_height; height_idx < end_height; ++height_idx)
+int coordinator_assign(coordinator *co, remote_worker *worker)
+{
+    while (worker->in_flight < worker->capacity && co->pending_len)
+    {
+        size_t tile = co->pending[co->pending_len - 1];
+        if (net_send(worker->fd, NET_MESSAGE_TILE, (unsigned int)tile, NULL, 0) != 0)
+            return -1;
+        co->pending_len--;
+        co->owner[tile] = worker->fd;
+        worker->in_flight++;
+    }
+    return 0;
+}
+
+void coordinator_accept(coordinator *co, int listen_fd)
+{
+    int fd = net_accept(listen_fd);
+    if (fd < 0)
+        return;
+
+    net_header hello;
+    if (co->workers_len == COORDINATOR_MAX_WORKERS || net_recv_header(fd, &hello) != 0 ||
+        hello.type != NET_MESSAGE_HELLO || hello.value == 0 ||
+        net_send(fd, NET_MESSAGE_JOB, 0, co->job, co->job_size) != 0)
+    {
+        close(fd);
+        return;
+    }
+
+    remote_worker *worker = &co->workers[co->workers_len++];
+    worker->fd = fd;
+    worker->capacity = hello.value;
+    worker->in_flight = 0;
+    printf("Worker joined, %zu connected\n", co->workers_len);
+}
+
+// Reads one result, anything unexpected is treated like a lost connection
+int coordinator_receive(coordinator *co, remote_worker *worker, unsigned char *tile_rgb)
+{
+    net_header header;
+    size_t tiles_count = co->tiles.tiles_x * co->tiles.tiles_y;
+    if (net_recv_header(worker->fd, &header) != 0 || header.type != NET_MESSAGE_RESULT ||
+        header.value >= tiles_count || co->owner[header.value] != worker->fd)
+        return -1;
+
+    size_t begin_width, begin_height, end_width, end_height;
+    tile_bounds(&co->tiles, header.value, &begin_width, &begin_height, &end_width, &end_height);
+    size_t row_size = (end_width - begin_width) * 3;
+    if (header.size != row_size * (end_height - begin_height) || net_recv(worker->fd, tile_rgb, header.size) != 0)
+        return -1;
+
+    for (size_t y = begin_height; y < end_height; ++y)
+        memcpy(co->rgb + (y * width + begin_width) * 3, tile_rgb + (y - begin_height) * row_size, row_size);
+
+    co->owner[header.value] = -1;
+    co->done++;
+    worker->in_flight--;
+    return 0;
+}
+
+// Renders nothing itself: waits for workers, keeps each one's queue filled and writes the image
+// once every tile came back
+void coordinate(const render_options *opts)
+{
+    coordinator co;
+    memset(&co, 0, sizeof(co));
+    co.opts = opts;
+    int tiles_failed = tile_scheduler_init(&co.tiles, opts, 0, height);
+    size_t tiles_count = co.tiles.tiles_x * co.tiles.tiles_y;
+
+    size_t scene_len = opts->scene != NULL ? strlen(opts->scene) : 0;
+    co.job_size = sizeof(net_job) + scene_len;
+    co.job = (unsigned char *)calloc(1, co.job_size);
+    co.rgb = (unsigned char *)malloc(width * height * 3);
+    co.pending = (size_t *)malloc(tiles_count * sizeof(size_t));
+    co.owner = (int *)malloc(tiles_count * sizeof(int));
+    unsigned char *tile_rgb = (unsigned char *)malloc(opts->tile_width * opts->tile_height * 3);
+
+    int listen_fd = -1;
+    if (tiles_failed || co.job == NULL || co.rgb == NULL || co.pending == NULL || co.owner == NULL || tile_rgb == NULL)
+        printf("Error allocate memory for coordinator");
+    else if ((listen_fd = net_listen(opts->listen)) < 0)
+        printf("Error listen on %s\n", opts->listen);
+
+    if (listen_fd >= 0)
+    {
+        net_job *job = (net_job *)co.job;
+        job->version = NET_VERSION;
+        job->width = (unsigned int)width;
+        job->height = (unsigned int)height;
+        job->camera[0] = opts->camera_position.x;
+        job->camera[1] = opts->camera_position.y;
+        job->camera[2] = opts->camera_position.z;
+        job->look_at[0] = opts->look_at.x;
+        job->look_at[1] = opts->look_at.y;
+        job->look_at[2] = opts->look_at.z;
+        job->fov = opts->fov;
+        job->tile_width = (unsigned int)opts->tile_width;
+        job->tile_height = (unsigned int)opts->tile_height;
+        job->packet_width = (unsigned int)opts->packet_width;
+        job->packet_height = (unsigned int)opts->packet_height;
+        job->pixel_order = (unsigned int)opts->pixel_order;
+        job->max_depth = (unsigned int)opts->integrator.max_depth;
+        job->roulette_depth = (unsigned int)opts->integrator.roulette_depth;
+        job->min_throughput = opts->integrator.min_throughput;
+        job->occluder_cache = opts->occluder_cache;
+        strncpy(job->accel, opts->accel, sizeof(job->accel) - 1);
+        job->scene_len = (unsigned int)scene_len;
+        memcpy(co.job + sizeof(net_job), opts->scene, scene_len);
+
+        // Stack of tiles, popped from the back so the first tile of the dispatch order goes out first
+        for (size_t i = 0; i < tiles_count; ++i)
+        {
+            co.pending[i] = tile_scheduler_tile(&co.tiles, tiles_count - 1 - i);
+            co.owner[i] = -1;
+        }
+        co.pending_len = tiles_count;
+    }
+
+    struct pollfd fds[COORDINATOR_MAX_WORKERS + 1];
+    while (listen_fd >= 0 && co.done < tiles_count)
     {
-        for (size_t width_idx = begin_width; width_idx < end_width; ++width_idx)
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < co.workers_len; ++i)
+        {
+            fds[i + 1].fd = co.workers[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        size_t polled = co.workers_len;
+        if (poll(fds, polled + 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("Error poll workers\n");
+            break;
+        }
+
+        // Backwards, so removing a lost worker never moves one that was not looked at yet
+        for (size_t i = polled; i-- > 0;)
         {
-            float x = (2 * (width_idx + 0.5) / (float)width - 1) * tan(fov / 2.) * width / (float)height;
-            float y = -(2 * (height_idx + 0.5) / (float)height - 1) * tan(fov / 2.);
-            vec3 dir_not_normal;
-            dir_not_normal.x = x;
-            dir_not_normal.y = y;
-            dir_not_normal.z = -1;
-            vec3 dir = vector_normalize(dir_not_normal);
+            if (fds[i + 1].revents && coordinator_receive(&co, &co.workers[i], tile_rgb) != 0)
+                coordinator_lose_worker(&co, i);
+        }
+        if (fds[0].revents & POLLIN)
+            coordinator_accept(&co, listen_fd);
 
-            framebuffer[width_idx + height_idx * width] =
-                cast_ray(
-                    *render_args->orig,
-                    dir,
-                    vector_create(0.5f, 0.5f, 0.5f),
-                    render_args->spheres, render_args->spheres_len,
-                    render_args->lights, render_args->lights_len, depth);
+        for (size_t i = co.workers_len; i-- > 0;)
+        {
+            if (coordinator_assign(&co, &co.workers[i]) != 0)
+                coordinator_lose_worker(&co, i);
         }
     }
 
-    free(render_args);
+    for (size_t i = 0; i < co.workers_len; ++i)
+    {
+        net_send(co.workers[i].fd, NET_MESSAGE_DONE, 0, NULL, 0);
+        close(co.workers[i].fd);
+    }
+
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        net_unlink(opts->listen);
+    }
+
+    if (listen_fd >= 0 && co.done == tiles_count)
+    {
+        image_writer *writer = image_writer_open(opts->output, opts->format, width, height);
+        if (writer == NULL || image_writer_write_rows(writer, co.rgb, height) != 0 || image_writer_close(writer) != 0)
+            printf("Error write output file %s\n", opts->output);
+    }
+
+    free(tile_rgb);
+    free(co.owner);
+    free(co.pending);
+    free(co.rgb);
+    free(co.job);
+    tile_scheduler_close(&co.tiles);
 }
 
-void render(thread_pool_t pool, sphere *spheres, size_t spheres_len, light *lights, size_t lights_len)
+// Connects to the coordinator and takes over the render settings of its job
+// @return socket, -1 on failure
+int join_coordinator(render_options *opts, char *scene_path, size_t scene_path_size)
 {
-    const vec3 camera_pos = vector_create(0.f, 0.f, 0.f);
+    int fd = net_connect(opts->connect);
+    if (fd < 0)
+    {
+        printf("Error connect to %s\n", opts->connect);
+        return -1;
+    }
 
-    framebuffer = (vec3 *)malloc(width * height * sizeof(vec3));
-    if (framebuffer == NULL)
+    // Two tiles per thread keep the pool busy while results travel back
+    net_header header;
+    net_job job;
+    if (net_send(fd, NET_MESSAGE_HELLO, (unsigned int)(2 * opts->thread_count), NULL, 0) != 0 ||
+        net_recv_header(fd, &header) != 0 || header.type != NET_MESSAGE_JOB || header.size < sizeof(job) ||
+        net_recv(fd, &job, sizeof(job)) != 0 || job.version != NET_VERSION ||
+        job.scene_len != header.size - sizeof(job) || job.scene_len >= scene_path_size ||
+        net_recv(fd, scene_path, job.scene_len) != 0)
     {
-        printf("Error allocate memory for framebuffer");
+        printf("Error receive job from %s\n", opts->connect);
+        close(fd);
+        return -1;
+    }
+    scene_path[job.scene_len] = '\0';
+    job.accel[sizeof(job.accel) - 1] = '\0';
+
+    // The same limits parse_options puts on the coordinator's own options, anything else would
+    // divide by zero or overrun the packet arrays
+    if (job.width == 0 || job.height == 0 || job.tile_width == 0 || job.tile_height == 0 ||
+        job.packet_width == 0 || job.packet_height == 0 || job.packet_width > RAY_PACKET_MAX ||
+        job.packet_height > RAY_PACKET_MAX || (size_t)job.packet_width * job.packet_height > RAY_PACKET_MAX)
+    {
+        printf("Error receive job from %s\n", opts->connect);
+        close(fd);
+        return -1;
+    }
+
+    width = job.width;
+    height = job.height;
+    opts->camera_position = vector_create(job.camera[0], job.camera[1], job.camera[2]);
+    opts->look_at = vector_create(job.look_at[0], job.look_at[1], job.look_at[2]);
+    opts->fov = job.fov;
+    opts->accel = strcmp(job.accel, "soa") == 0 ? "soa" : (strcmp(job.accel, "linear") == 0 ? "linear" : "bvh");
+    opts->tile_width = job.tile_width;
+    opts->tile_height = job.tile_height;
+    opts->packet_width = job.packet_width;
+    opts->packet_height = job.packet_height;
+    opts->pixel_order = job.pixel_order <= CURVE_HILBERT ? (curve_order)job.pixel_order : CURVE_ROW_MAJOR;
+    opts->integrator.max_depth = job.max_depth;
+    opts->integrator.roulette_depth = job.roulette_depth;
+    opts->integrator.min_throughput = job.min_throughput;
+    opts->occluder_cache = job.occluder_cache;
+    opts->scene = job.scene_len ? scene_path : NULL;
+    return fd;
+}
+
+typedef struct tile_service
+{
+    int fd;
+    // Results are sent by the pool threads, one message at a time
+    pthread_mutex_t send_mtx;
+    int failed;
+    render_thread_args args;
+    tile_scheduler tiles;
+} tile_service;
+
+typedef struct remote_tile
+{
+    tile_service *service;
+    size_t tile;
+} remote_tile;
+
+void render_remote_tile(void *arg)
+{
+    remote_tile *task = (remote_tile *)arg;
+    tile_service *service = task->service;
+
+    size_t begin_width, begin_height, end_width, end_height;
+    tile_bounds(&service->tiles, task->tile, &begin_width, &begin_height, &end_width, &end_height);
+    size_t size = (end_width - begin_width) * (end_height - begin_height) * 3;
+
+    // Tonemapped right away, the coordinator only assembles 8-bit rows
+    render_thread_args args = service->args;
+    args.target = (unsigned char *)malloc(size);
+    args.target_row = begin_height;
+    args.target_col = begin_width;
+    args.target_stride = end_width - begin_width;
+    args.format = PIXEL_FORMAT_RGB8;
+
+    if (args.target != NULL)
+        render_tile_index(&args, task->tile);
+
+    pthread_mutex_lock(&service->send_mtx);
+    if (!service->failed && (args.target == NULL || net_send(service->fd, NET_MESSAGE_RESULT, (unsigned int)task->tile, args.target, size) != 0))
+        service->failed = 1;
+    pthread_mutex_unlock(&service->send_mtx);
+
+    free(args.target);
+    free(task);
+}
+
+// Queues every tile the coordinator sends on the pool until it says the frame is done
+void serve_tiles(thread_pool_t pool, const scene *sc, const render_options *opts, int fd)
+{
+    camera cam;
+    if (camera_init(&cam, width, height, opts->camera_position, opts->look_at, vector_create(0.f, 1.f, 0.f), opts->fov) != 0)
+    {
+        printf("Error set up camera");
+        close(fd);
+        return;
+    }
+
+    tile_service service;
+    service.fd = fd;
+    pthread_mutex_init(&service.send_mtx, NULL);
+    service.failed = 0;
+    if (tile_scheduler_init(&service.tiles, opts, 0, height) != 0)
+    {
+        printf("Error allocate memory for tile order");
+        tile_scheduler_close(&service.tiles);
+        pthread_mutex_destroy(&service.send_mtx);
+        close(fd);
+        camera_close(&cam);
         return;
     }
+    service.args.tiles = &service.tiles;
+    service.args.camera = &cam;
+    service.args.orig = &cam.position;
+    service.args.scene = sc;
+    service.args.packet_width = opts->packet_width;
+    service.args.packet_height = opts->packet_height;
+
+    size_t tiles_count = service.tiles.tiles_x * service.tiles.tiles_y;
+    size_t rendered = 0;
+    net_header header;
+    while (net_recv_header(fd, &header) == 0 && header.type == NET_MESSAGE_TILE && header.value < tiles_count)
+    {
+        remote_tile *task = (remote_tile *)malloc(sizeof(remote_tile));
+        if (task == NULL)
+            break;
+        task->service = &service;
+        task->tile = header.value;
+        if (add_task_thread_pool(pool, render_remote_tile, task) != 0)
+        {
+            free(task);
+            break;
+        }
+        ++rendered;
+    }
+
+    // On a lost connection the queued tiles still run, their results are dropped
+    wait_thread_pool(pool);
+    if (header.type != NET_MESSAGE_DONE || service.failed)
+        printf("Connection to coordinator lost\n");
+    printf("Rendered %zu tiles\n", rendered);
+
+    close(fd);
+    pthread_mutex_destroy(&service.send_mtx);
+    tile_scheduler_close(&service.tiles);
+    camera_close(&cam);
+}
+
+// Accepts exactly one %d conversion with an optional zero flag and width, and no other %
+int output_pattern_valid(const char *pattern)
+{
+    int conversions = 0;
+    for (const char *c = strchr(pattern, '%'); c != NULL; c = strchr(c, '%'))
+    {
+        ++c;
+        if (*c == '%')
+        {
+            ++c;
+            continue;
+        }
+        while (*c >= '0' && *c <= '9')
+            ++c;
+        if (*c != 'd')
+            return 0;
+        ++conversions;
+    }
+    return conversions == 1;
+}
+
+// "none", "compact", "scatter" or a comma separated list of CPU ids
+int parse_affinity(const char *value, render_options *opts)
+{
+    opts->affinity_cpus_len = 0;
+    if (strcmp(value, "none") == 0)
+        opts->affinity = THREAD_POOL_AFFINITY_NONE;
+    else if (strcmp(value, "compact") == 0)
+        opts->affinity = THREAD_POOL_AFFINITY_COMPACT;
+    else if (strcmp(value, "scatter") == 0)
+        opts->affinity = THREAD_POOL_AFFINITY_SCATTER;
+    else
+    {
+        opts->affinity = THREAD_POOL_AFFINITY_LIST;
+        const char *cursor = value;
+        do
+        {
+            char *end;
+            long cpu = strtol(cursor, &end, 10);
+            if (end == cursor || cpu < 0 || cpu > INT_MAX || opts->affinity_cpus_len == AFFINITY_MAX_CPUS ||
+                (*end != ',' && *end != '\0'))
+                return -1;
+            opts->affinity_cpus[opts->affinity_cpus_len++] = (int)cpu;
+            cursor = end + 1;
+        } while (cursor[-1] == ',');
+    }
+    return 0;
+}
 
-    for (size_t i = 0; i < width_parts; ++i)
+int parse_options(int argc, char **argv, render_options *opts)
+{
+    opts->accel = "bvh";
+    opts->simd = NULL;
+    opts->packet_width = 1;
+    opts->packet_height = 1;
+    opts->thread_count = 8;
+    opts->scheduler = THREAD_POOL_SCHEDULER_FIFO;
+    opts->queue = THREAD_POOL_QUEUE_LOCKED;
+    opts->affinity = THREAD_POOL_AFFINITY_NONE;
+    opts->affinity_cpus_len = 0;
+    opts->tile_width = 32;
+    opts->tile_height = 32;
+    opts->pixel_format = PIXEL_FORMAT_FLOAT;
+    opts->dispatch = "counter";
+    opts->output = "out.tga";
+    opts->format = IMAGE_FORMAT_TGA;
+    opts->output_mmap = 0;
+    const char *format = NULL;
+    opts->integrator = scene_create(NULL, 0, NULL, 0).integrator;
+    opts->occluder_cache = 0;
+    opts->stats = 0;
+    opts->trace = NULL;
+    opts->band_height = 0;
+    opts->band_window = 4;
+    opts->animation = NULL;
+    opts->listen = NULL;
+    opts->connect = NULL;
+    opts->scene = NULL;
+    opts->export_path = NULL;
+    opts->preview = NULL;
+    // The image center unless --focus is given, known once --resolution is read
+    int focus_set = 0;
+    opts->camera_position = vector_create(0.f, 0.f, 0.f);
+    opts->look_at = vector_create(0.f, 0.f, -1.f);
+    opts->fov = 1.f;
+    opts->tile_order = CURVE_ROW_MAJOR;
+    opts->pixel_order = CURVE_ROW_MAJOR;
+
+    for (int i = 1; i < argc; ++i)
     {
-        for (size_t j = 0; j < height_parts; ++j)
+        if (strcmp(argv[i], "--accel") == 0 && i + 1 < argc)
+            opts->accel = argv[++i];
+        else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc)
+            opts->simd = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            opts->thread_count = strtoul(argv[++i], NULL, 10);
+            if (opts->thread_count == 0)
+            {
+                printf("Invalid thread count %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--scheduler") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "fifo") == 0)
+                opts->scheduler = THREAD_POOL_SCHEDULER_FIFO;
+            else if (strcmp(argv[i], "ws") == 0)
+                opts->scheduler = THREAD_POOL_SCHEDULER_WORK_STEALING;
+            else
+            {
+                printf("Unknown scheduler %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "locked") == 0)
+                opts->queue = THREAD_POOL_QUEUE_LOCKED;
+            else if (strcmp(argv[i], "ring") == 0)
+                opts->queue = THREAD_POOL_QUEUE_RING;
+            else
+            {
+                printf("Unknown queue %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--affinity") == 0 && i + 1 < argc)
+        {
+            if (parse_affinity(argv[++i], opts) != 0)
+            {
+                printf("Unknown affinity %s, expected none, compact, scatter or a CPU list such as 0,2,4\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--pixel") == 0 && i + 1 < argc)
+        {
+            if (pixel_format_parse(argv[++i], &opts->pixel_format) != 0)
+            {
+                printf("Unknown pixel format %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--dispatch") == 0 && i + 1 < argc)
+            opts->dispatch = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            opts->output = argv[++i];
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+            format = argv[++i];
+        else if (strcmp(argv[i], "--mmap") == 0)
+            opts->output_mmap = 1;
+        else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc)
+            opts->integrator.max_depth = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--min-throughput") == 0 && i + 1 < argc)
+            opts->integrator.min_throughput = strtof(argv[++i], NULL);
+        else if (strcmp(argv[i], "--roulette") == 0 && i + 1 < argc)
+            opts->integrator.roulette_depth = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--occluder-cache") == 0)
+            opts->occluder_cache = 1;
+        else if (strcmp(argv[i], "--stats") == 0)
+            opts->stats = 1;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            opts->trace = argv[++i];
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc)
+            opts->band_height = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+        {
+            opts->band_window = strtoul(argv[++i], NULL, 10);
+            if (opts->band_window == 0)
+            {
+                printf("Invalid band window %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+            opts->listen = argv[++i];
+        else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+            opts->connect = argv[++i];
+        else if (strcmp(argv[i], "--animation") == 0 && i + 1 < argc)
+            opts->animation = argv[++i];
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+            opts->scene = argv[++i];
+        else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc)
+            opts->export_path = argv[++i];
+        else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc)
+            opts->preview = argv[++i];
+        else if (strcmp(argv[i], "--focus") == 0 && i + 1 < argc)
+        {
+            // Pixel the preview mode renders outward from, the image center by default
+            char rest[2];
+            if (sscanf(argv[++i], "%zu,%zu%1s", &opts->focus_x, &opts->focus_y, rest) != 2)
+            {
+                printf("Invalid focus point %s\n", argv[i]);
+                return -1;
+            }
+            focus_set = 1;
+        }
+        else if (strcmp(argv[i], "--resolution") == 0 && i + 1 < argc)
+        {
+            char rest[2];
+            if (sscanf(argv[++i], "%zux%zu%1s", &width, &height, rest) != 2 || width == 0 || height == 0)
+            {
+                printf("Invalid resolution %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if ((strcmp(argv[i], "--camera") == 0 || strcmp(argv[i], "--look-at") == 0) && i + 1 < argc)
+        {
+            vec3 *point = strcmp(argv[i], "--camera") == 0 ? &opts->camera_position : &opts->look_at;
+            float x, y, z;
+            char rest[2];
+            if (sscanf(argv[++i], "%f,%f,%f%1s", &x, &y, &z, rest) != 3)
+            {
+                printf("Invalid point %s, expected x,y,z\n", argv[i]);
+                return -1;
+            }
+            *point = vector_create(x, y, z);
+        }
+        else if (strcmp(argv[i], "--fov") == 0 && i + 1 < argc)
+        {
+            // Degrees on the command line, the default is 1 radian
+            float degrees = strtof(argv[++i], NULL);
+            if (!(degrees > 0.f && degrees < 180.f))
+            {
+                printf("Invalid field of view %s\n", argv[i]);
+                return -1;
+            }
+            opts->fov = degrees * (float)M_PI / 180.f;
+        }
+        else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc)
+        {
+            // 32 for square tiles or WxH, 960x1080 reproduces the old fixed 4x2 split
+            int parsed = sscanf(argv[++i], "%zux%zu", &opts->tile_width, &opts->tile_height);
+            if (parsed == 1)
+                opts->tile_height = opts->tile_width;
+            if (parsed < 1 || opts->tile_width == 0 || opts->tile_height == 0)
+            {
+                printf("Invalid tile size %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--packet") == 0 && i + 1 < argc)
+        {
+            // 2x2, 4x4, 8x1 or 1x1
+            if (sscanf(argv[++i], "%zux%zu", &opts->packet_width, &opts->packet_height) != 2 ||
+                opts->packet_width == 0 || opts->packet_height == 0 ||
+                opts->packet_width * opts->packet_height > RAY_PACKET_MAX)
+            {
+                printf("Invalid packet size %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--order") == 0 && i + 1 < argc)
         {
-            render_thread_args *args = (render_thread_args *)malloc(sizeof(render_thread_args));
-            if (args == NULL)
+            // hilbert for tiles and pixels alike, or hilbert,row for the tiles only
+            char tile_order[16], pixel_order[16];
+            int parsed = sscanf(argv[++i], "%15[^,],%15s", tile_order, pixel_order);
+            if (parsed < 1 || curve_order_parse(tile_order, &opts->tile_order) != 0 ||
+                curve_order_parse(parsed == 2 ? pixel_order : tile_order, &opts->pixel_order) != 0)
             {
-                printf("Error allocate memory for render thread args");
-                return;
+                printf("Unknown order %s\n", argv[i]);
+                return -1;
             }
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (strcmp(opts->accel, "bvh") != 0 && strcmp(opts->accel, "soa") != 0 && strcmp(opts->accel, "linear") != 0)
+    {
+        printf("Unknown acceleration structure %s\n", opts->accel);
+        return -1;
+    }
 
-            args->width_part_idx = i;
-            args->height_part_idx = j;
-            args->orig = &camera_pos;
-            args->spheres = spheres;
-            args->spheres_len = spheres_len;
-            args->lights = lights;
-            args->lights_len = lights_len;
+    if (strcmp(opts->dispatch, "counter") != 0 && strcmp(opts->dispatch, "pool") != 0)
+    {
+        printf("Unknown tile dispatch %s\n", opts->dispatch);
+        return -1;
+    }
 
-            add_task_thread_pool(pool, render_thread, args);
-        }
+    // Without --format the extension of the output file decides, anything unknown stays TGA
+    if (format != NULL && image_format_parse(format, &opts->format) != 0)
+    {
+        printf("Unknown output format %s\n", format);
+        return -1;
     }
+    if (format == NULL)
+        image_format_parse(opts->output, &opts->format);
 
-    wait_thread_pool(pool);
-    FILE *out = fopen("out.tga", "w");
-    char header[18] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                       (char)(width % 256), (char)(width / 256),
-                       (char)(height % 256), (char)(height / 256),
-                       (char)(3 * 8), 0x20};
-    fwrite(&header, 18, 1, out);
-    // FILE *out = fopen("out.ppm", "w");
-    // fprintf(out, "P6 %d %d 255 ", width, height);
-
-    for (size_t i = 0; i < height * width; ++i)
-    {
-        vec3 *frame = &framebuffer[i];
-        float max = MAX(frame->x, MAX(frame->y, frame->z));
-        if (max > 1)
-            *frame = vector_multiplication(*frame, (1. / max));
-
-        fprintf(out, "%c%c%c",
-                (char)(255.f * (MAX(0.f, MIN(1.f, frame->x)))),
-                (char)(255.f * (MAX(0.f, MIN(1.f, frame->y)))),
-                (char)(255.f * (MAX(0.f, MIN(1.f, frame->z)))));
-    }
-    fclose(out);
-    free(framebuffer);
+#ifndef RT_STATS
+    if (opts->stats || opts->trace != NULL)
+    {
+        printf("--stats and --trace need a build with -DRT_STATS=ON\n");
+        return -1;
+    }
+#endif
+
+    if (opts->output_mmap && opts->format == IMAGE_FORMAT_QOI)
+    {
+        printf("QOI output can not be mapped\n");
+        return -1;
+    }
+
+    if ((opts->listen != NULL || opts->connect != NULL) &&
+        (opts->listen != NULL) + (opts->connect != NULL) + (opts->animation != NULL) + !!opts->band_height + opts->output_mmap > 1)
+    {
+        printf("--listen and --connect can not be combined with each other, --animation, --stream or --mmap\n");
+        return -1;
+    }
+
+    if (opts->animation != NULL && (opts->output_mmap || opts->band_height))
+    {
+        printf("--mmap and --stream can not be combined with --animation\n");
+        return -1;
+    }
+
+    if (opts->animation != NULL && !output_pattern_valid(opts->output))
+    {
+        printf("--animation needs an output pattern with one frame number such as frame_%%04d.tga\n");
+        return -1;
+    }
+
+    if (opts->output_mmap && opts->band_height)
+    {
+        printf("--mmap and --stream can not be combined\n");
+        return -1;
+    }
+
+    if (!focus_set)
+    {
+        opts->focus_x = width / 2;
+        opts->focus_y = height / 2;
+    }
+    if (opts->focus_x >= width || opts->focus_y >= height)
+    {
+        printf("Focus point %zu,%zu is outside the %zux%zu image\n", opts->focus_x, opts->focus_y, width, height);
+        return -1;
+    }
+
+    if (opts->preview != NULL && (opts->listen != NULL || opts->connect != NULL || opts->animation != NULL || opts->band_height))
+    {
+        printf("--preview can not be combined with --listen, --connect, --animation or --stream\n");
+        return -1;
+    }
+
+    return 0;
 }
 
-int main()
+// The scene rendered when no --scene is given, examples/scenes/default.scene holds the same one
+int default_scene(scene_file *file)
 {
+    memset(file, 0, sizeof(scene_file));
+
     material green = material_create(vector_create(0.f, 0.5f, 0.f), vector_create(0.6f, 0.3f, 0.1f), 50.);
     material white = material_create(vector_create(1.f, 1.f, 1.f), vector_create(0.6f, 0.6f, 0.f), 20.);
     material mirror = material_create(vector_create(1.f, 1.f, 1.f), vector_create(0.0f, 10.f, 0.8f), 1425.);
@@ -135,7 +1859,7 @@ int main()
     if (spheres == NULL)
     {
         printf("Error allocate memory for spheres");
-        return 0;
+        return -1;
     }
     spheres[0] = sphere_create(vector_create(-5.f, -1.f, -12.f), 2.f, mirror);
     spheres[1] = sphere_create(vector_create(1.5f, -0.5f, -18.f), 2.f, white);
@@ -147,22 +1871,125 @@ int main()
     {
         free(spheres);
         printf("Error allocate memory for lights");
-        return 0;
+        return -1;
     }
     lights[0] = light_create(vector_create(-20, 20, 20), 1.5);
     lights[1] = light_create(vector_create(30, 50, -25), 1.8);
 
-    thread_pool_t pool = create_thread_pool(8);
+    file->spheres = spheres;
+    file->spheres_len = 4;
+    file->lights = lights;
+    file->lights_len = 2;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    render_options opts;
+    if (parse_options(argc, argv, &opts) != 0)
+        return 1;
+
+    if (opts.listen != NULL)
+    {
+        coordinate(&opts);
+        return 0;
+    }
+
+    // Workers take the scene and render settings from the coordinator
+    char scene_path[4096];
+    int coordinator_fd = -1;
+    if (opts.connect != NULL && (coordinator_fd = join_coordinator(&opts, scene_path, sizeof(scene_path))) < 0)
+        return 0;
+
+    scene_file file;
+    if (opts.scene != NULL ? scene_file_load(&file, opts.scene) != 0 : default_scene(&file) != 0)
+    {
+        if (opts.scene != NULL && file.error_line)
+            printf("Error in scene %s, line %zu\n", opts.scene, file.error_line);
+        else
+            printf("Error loading scene %s\n", opts.scene != NULL ? opts.scene : "");
+        return 0;
+    }
+
+    animation anim;
+    if (opts.animation != NULL && animation_load(&anim, opts.animation, file.spheres_len) != 0)
+    {
+        if (anim.error_line)
+            printf("Error in animation %s, line %zu\n", opts.animation, anim.error_line);
+        else
+            printf("Error loading animation %s\n", opts.animation);
+        scene_file_close(&file);
+        return 0;
+    }
+
+    scene sc = scene_create(file.spheres, file.spheres_len, file.lights, file.lights_len);
+    sc.integrator = opts.integrator;
+    sc.occluder_cache = opts.occluder_cache;
+
+    bvh *tree = NULL;
+    sphere_soa *soa = NULL;
+    if (strcmp(opts.accel, "bvh") == 0)
+    {
+        // A BVH stored in a binary scene is used in place
+        if (file.has_bvh)
+            sc.bvh = &file.tree;
+        else
+            sc.bvh = tree = bvh_create(file.spheres, file.spheres_len);
+    }
+    else if (strcmp(opts.accel, "soa") == 0)
+    {
+        soa = sphere_soa_create(file.spheres, file.spheres_len);
+        if (soa != NULL && opts.simd != NULL && sphere_soa_set_kernel(soa, opts.simd) != 0)
+            printf("SIMD kernel %s is not supported, using %s\n", opts.simd, soa->kernel_name);
+        sc.soa = soa;
+    }
+
+    if (strcmp(opts.accel, "linear") != 0 && sc.bvh == NULL && sc.soa == NULL)
+    {
+        if (opts.animation != NULL)
+            animation_close(&anim);
+        scene_file_close(&file);
+        printf("Error building acceleration structure");
+        return 0;
+    }
+
+    if (opts.export_path != NULL)
+    {
+        if (scene_file_write_binary(opts.export_path, file.spheres, file.spheres_len, file.lights, file.lights_len, sc.bvh) != 0)
+            printf("Error writing scene %s\n", opts.export_path);
+        if (opts.animation != NULL)
+            animation_close(&anim);
+        bvh_destroy(tree);
+        sphere_soa_destroy(soa);
+        scene_file_close(&file);
+        return 0;
+    }
+
+    thread_pool_config pool_config;
+    init_thread_pool_config(&pool_config, opts.thread_count);
+    pool_config.scheduler = opts.scheduler;
+    pool_config.queue = opts.queue;
+    pool_config.affinity = opts.affinity;
+    pool_config.cpus = opts.affinity_cpus;
+    pool_config.cpus_len = opts.affinity_cpus_len;
+
+    thread_pool_t pool = create_thread_pool_with_config(&pool_config);
     if (pool == NULL)
     {
         printf("Error creating thread pool");
         return 0;
     }
 
-    render(pool, spheres, 4, lights, 2);
+    if (coordinator_fd >= 0)
+        serve_tiles(pool, &sc, &opts, coordinator_fd);
+    else
+        render(pool, &sc, opts.animation != NULL ? &anim : NULL, &opts);
 
-    free(spheres);
-    free(lights);
+    if (opts.animation != NULL)
+        animation_close(&anim);
+    bvh_destroy(tree);
+    sphere_soa_destroy(soa);
+    scene_file_close(&file);
     destroy_thread_pool(pool);
 
     return 0;
@@ -0,0 +1,154 @@
+#include "net.h"
+#include "stdio.h"
+#include "string.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Splits "tcp:<host>:<port>" at the last colon, so the host part may not contain one itself
+static int net_resolve(const char *address, struct addrinfo **result)
+{
+    char host[256];
+    const char *port = strrchr(address, ':');
+    if (port == NULL || (size_t)(port - address) >= sizeof(host))
+        return -1;
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    return getaddrinfo(host[0] ? host : NULL, port + 1, &hints, result) == 0 ? 0 : -1;
+}
+
+static int net_unix_address(const char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int net_open(const char *address, int server)
+{
+    int fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr;
+        if (net_unix_address(address + 5, &addr) != 0 || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return -1;
+
+        if (server)
+            unlink(addr.sun_path);
+        if ((server ? bind(fd, (struct sockaddr *)&addr, sizeof(addr)) : connect(fd, (struct sockaddr *)&addr, sizeof(addr))) != 0 ||
+            (server && listen(fd, SOMAXCONN) != 0))
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo *info;
+    if (strncmp(address, "tcp:", 4) != 0 || net_resolve(address + 4, &info) != 0)
+        return -1;
+
+    for (struct addrinfo *ai = info; ai != NULL && fd < 0; ai = ai->ai_next)
+    {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+
+        int one = 1;
+        if (server)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if ((server ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen)) != 0 ||
+            (server && listen(fd, SOMAXCONN) != 0))
+        {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        // Tile requests are tiny and latency bound
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    freeaddrinfo(info);
+    return fd;
+}
+
+int net_listen(const char *address)
+{
+    return net_open(address, 1);
+}
+
+int net_accept(int listen_fd)
+{
+    return accept(listen_fd, NULL, NULL);
+}
+
+int net_connect(const char *address)
+{
+    return net_open(address, 0);
+}
+
+void net_unlink(const char *address)
+{
+    if (strncmp(address, "unix:", 5) == 0)
+        unlink(address + 5);
+}
+
+static int net_send_all(int fd, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    while (size)
+    {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return -1;
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+
+int net_send(int fd, net_message_type type, unsigned int value, const void *payload, size_t size)
+{
+    net_header header;
+    header.magic = NET_MAGIC;
+    header.type = type;
+    header.value = value;
+    header.reserved = 0;
+    header.size = size;
+
+    if (net_send_all(fd, &header, sizeof(header)) != 0)
+        return -1;
+    return size ? net_send_all(fd, payload, size) : 0;
+}
+
+int net_recv(int fd, void *data, size_t size)
+{
+    unsigned char *bytes = (unsigned char *)data;
+    while (size)
+    {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received <= 0)
+            return -1;
+        bytes += received;
+        size -= (size_t)received;
+    }
+    return 0;
+}
+
+int net_recv_header(int fd, net_header *header)
+{
+    if (net_recv(fd, header, sizeof(*header)) != 0)
+        return -1;
+    return header->magic == NET_MAGIC ? 0 : -1;
+}
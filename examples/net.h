@@ -0,0 +1,92 @@
+#ifndef NET_H
+#define NET_H
+#include "stddef.h"
+
+// Messages are sent as raw structs, coordinator and workers have to be the same build
+#define NET_MAGIC 0x31544e52u
+#define NET_VERSION 3
+
+typedef enum net_message_type
+{
+    // Worker to coordinator, value is the number of tiles it wants in flight
+    NET_MESSAGE_HELLO = 1,
+    // Coordinator to worker, net_job followed by the scene path
+    NET_MESSAGE_JOB,
+    // Coordinator to worker, value is the tile to render
+    NET_MESSAGE_TILE,
+    // Worker to coordinator, value is the tile, followed by its 8-bit RGB rows
+    NET_MESSAGE_RESULT,
+    // Coordinator to worker, nothing left to render
+    NET_MESSAGE_DONE,
+} net_message_type;
+
+typedef struct net_header
+{
+    unsigned int magic;
+    unsigned int type;
+    unsigned int value;
+    unsigned int reserved;
+    unsigned long long size;
+} net_header;
+
+// Everything a worker needs to render tiles exactly like the coordinator's own process would
+typedef struct net_job
+{
+    unsigned int version;
+    unsigned int width;
+    unsigned int height;
+    float camera[3];
+    float look_at[3];
+    // Vertical, in radians
+    float fov;
+    unsigned int tile_width;
+    unsigned int tile_height;
+    unsigned int packet_width;
+    unsigned int packet_height;
+    // curve_order of the pixels inside a tile, tiles are handed out by the coordinator
+    unsigned int pixel_order;
+    unsigned int max_depth;
+    unsigned int roulette_depth;
+    float min_throughput;
+    int occluder_cache;
+    char accel[8];
+    // Empty for the built-in scene, otherwise a path every worker can open, binary scenes are mapped
+    // so workers on one machine share their pages
+    unsigned int scene_len;
+} net_job;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Listens on "unix:<path>" or "tcp:<host>:<port>", a stale socket file is replaced
+    /// @return socket, -1 on failure
+    int net_listen(const char *address);
+
+    /// @brief Waits for the next connection on a listening socket
+    /// @return socket, -1 on failure
+    int net_accept(int listen_fd);
+
+    /// @brief Connects to an address in the format of net_listen
+    /// @return socket, -1 on failure
+    int net_connect(const char *address);
+
+    /// @brief Removes the socket file of a unix address, nothing for tcp
+    void net_unlink(const char *address);
+
+    /// @brief Sends a header and its payload, never raises SIGPIPE
+    /// @return 0 on success, -1 if the peer is gone
+    int net_send(int fd, net_message_type type, unsigned int value, const void *payload, size_t size);
+
+    /// @brief Reads the next header and checks its magic
+    /// @return 0 on success, -1 on a closed connection or a malformed header
+    int net_recv_header(int fd, net_header *header);
+
+    /// @brief Reads exactly size bytes
+    /// @return 0 on success, -1 otherwise
+    int net_recv(int fd, void *data, size_t size);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
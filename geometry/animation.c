@@ -0,0 +1,131 @@
+#include "animation.h"
+#include "text_reader.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+static void animation_init(animation *anim)
+{
+    anim->frames = NULL;
+    anim->frames_len = 0;
+    anim->moves = NULL;
+    anim->moves_len = 0;
+    anim->error_line = 0;
+}
+
+int animation_load(animation *anim, const char *path, size_t spheres_len)
+{
+    animation_init(anim);
+
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+        return -1;
+
+    size_t frames_capacity = 0, moves_capacity = 0;
+    text_statement statement;
+    statement.line_number = 0;
+    int result = 0;
+
+    while (result == 0 && text_reader_next(in, &statement))
+    {
+        const char *keyword = statement.keyword;
+        const char *args = statement.args;
+        int consumed = 0;
+
+        if (strcmp(keyword, "frame") == 0)
+        {
+            animation_frame *frames = NULL;
+            if (!text_reader_at_end(args) ||
+                (frames = (animation_frame *)text_reader_grow(anim->frames, &frames_capacity, anim->frames_len, sizeof(animation_frame))) == NULL)
+            {
+                result = -1;
+                break;
+            }
+            anim->frames = frames;
+
+            animation_frame *frame = &anim->frames[anim->frames_len++];
+            frame->camera = vector_create(0.f, 0.f, 0.f);
+            frame->has_look_at = 0;
+            frame->moves_begin = anim->moves_len;
+            frame->moves_len = 0;
+        }
+        else if (strcmp(keyword, "camera") == 0)
+        {
+            vec3 position;
+            if (anim->frames_len == 0 ||
+                sscanf(args, "%f %f %f%n", &position.x, &position.y, &position.z, &consumed) != 3 ||
+                !text_reader_at_end(args + consumed))
+            {
+                result = -1;
+                break;
+            }
+            anim->frames[anim->frames_len - 1].camera = vector_create(position.x, position.y, position.z);
+        }
+        else if (strcmp(keyword, "look_at") == 0)
+        {
+            vec3 target;
+            if (anim->frames_len == 0 ||
+                sscanf(args, "%f %f %f%n", &target.x, &target.y, &target.z, &consumed) != 3 ||
+                !text_reader_at_end(args + consumed))
+            {
+                result = -1;
+                break;
+            }
+            anim->frames[anim->frames_len - 1].look_at = vector_create(target.x, target.y, target.z);
+            anim->frames[anim->frames_len - 1].has_look_at = 1;
+        }
+        else if (strcmp(keyword, "move") == 0)
+        {
+            size_t index;
+            vec3 offset;
+            animation_move *moves = NULL;
+            if (anim->frames_len == 0 ||
+                sscanf(args, "%zu %f %f %f%n", &index, &offset.x, &offset.y, &offset.z, &consumed) != 4 ||
+                !text_reader_at_end(args + consumed) || index >= spheres_len ||
+                (moves = (animation_move *)text_reader_grow(anim->moves, &moves_capacity, anim->moves_len, sizeof(animation_move))) == NULL)
+            {
+                result = -1;
+                break;
+            }
+            anim->moves = moves;
+            anim->moves[anim->moves_len].sphere = index;
+            anim->moves[anim->moves_len].offset = vector_create(offset.x, offset.y, offset.z);
+            anim->moves_len++;
+            anim->frames[anim->frames_len - 1].moves_len++;
+        }
+        else
+        {
+            result = -1;
+        }
+    }
+
+    fclose(in);
+
+    // A file without frames is an error too, but not one on a particular line
+    if (result != 0 || anim->frames_len == 0)
+    {
+        animation_close(anim);
+        anim->error_line = result != 0 ? statement.line_number : 0;
+        return -1;
+    }
+    return 0;
+}
+
+void animation_apply(const animation *anim, size_t frame, const sphere *base, size_t spheres_len, sphere *out)
+{
+    const animation_frame *f = &anim->frames[frame];
+
+    memcpy(out, base, spheres_len * sizeof(sphere));
+    for (size_t i = f->moves_begin; i < f->moves_begin + f->moves_len; ++i)
+    {
+        const animation_move *move = &anim->moves[i];
+        out[move->sphere].center = vector_addition(base[move->sphere].center, move->offset);
+    }
+}
+
+void animation_close(animation *anim)
+{
+    free(anim->frames);
+    free(anim->moves);
+    animation_init(anim);
+}
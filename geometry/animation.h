@@ -0,0 +1,61 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+#include "render.h"
+
+// Sphere moved by offset from its position in the scene
+typedef struct animation_move
+{
+    size_t sphere;
+    vec3 offset;
+} animation_move;
+
+typedef struct animation_frame
+{
+    vec3 camera;
+    // Point the camera looks at, only set if has_look_at
+    vec3 look_at;
+    int has_look_at;
+    // Range of this frame in animation.moves
+    size_t moves_begin;
+    size_t moves_len;
+} animation_frame;
+
+typedef struct animation
+{
+    animation_frame *frames;
+    size_t frames_len;
+    animation_move *moves;
+    size_t moves_len;
+    // Line of the first error, 0 if the file could not be read at all
+    size_t error_line;
+} animation;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Loads per-frame camera positions and sphere offsets
+    ///
+    /// One statement per line, # starts a comment:
+    ///     frame                       starts the next frame
+    ///     camera <x> <y> <z>          camera position of the frame, 0 0 0 if not given
+    ///     look_at <x> <y> <z>         point the camera of the frame looks at, if not given the
+    ///                                 view direction stays the one of the render
+    ///     move <sphere> <x> <y> <z>   offset of a sphere from its position in the scene
+    ///
+    /// Every frame starts from the scene as loaded, spheres without a move stay where they are.
+    ///
+    /// @param spheres_len number of spheres in the scene, moves of other indices are errors
+    /// @return 0 on success, -1 otherwise
+    int animation_load(animation *anim, const char *path, size_t spheres_len);
+
+    /// @brief Writes the spheres as they are in the given frame
+    /// @param base spheres of the scene, out receives spheres_len of them
+    void animation_apply(const animation *anim, size_t frame, const sphere *base, size_t spheres_len, sphere *out);
+
+    void animation_close(animation *anim);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,488 @@
+#include "bvh.h"
+#include "stats.h"
+#include "math.h"
+#include "float.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_TRAVERSAL_COST 1.f
+#define BVH_INTERSECT_COST 1.f
+#define BVH_NO_HIT ((size_t)-1)
+
+typedef struct bvh_bounds
+{
+    vec3 min;
+    vec3 max;
+} bvh_bounds;
+
+typedef struct bvh_bin
+{
+    bvh_bounds bounds;
+    size_t count;
+} bvh_bin;
+
+typedef struct bvh_build_item
+{
+    unsigned int node;
+    size_t begin;
+    size_t end;
+    size_t depth;
+} bvh_build_item;
+
+typedef struct bvh_stack_item
+{
+    unsigned int node;
+    float tnear;
+} bvh_stack_item;
+
+static float vector_axis(vec3 v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static bvh_bounds bounds_empty(void)
+{
+    bvh_bounds b;
+    b.min = vector_create(FLT_MAX, FLT_MAX, FLT_MAX);
+    b.max = vector_create(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    return b;
+}
+
+static void bounds_grow(bvh_bounds *b, vec3 min, vec3 max)
+{
+    b->min = vector_create(fminf(b->min.x, min.x), fminf(b->min.y, min.y), fminf(b->min.z, min.z));
+    b->max = vector_create(fmaxf(b->max.x, max.x), fmaxf(b->max.y, max.y), fmaxf(b->max.z, max.z));
+}
+
+static float bounds_area(const bvh_bounds *b)
+{
+    if (b->min.x > b->max.x)
+        return 0.f;
+
+    vec3 e = vector_diff(b->max, b->min);
+    return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+static bvh_bounds sphere_bounds(const sphere *s)
+{
+    // Slightly inflated so that rounding in the slab test never culls a sphere hit
+    float r = s->radius * (1.f + 1e-5f) + 1e-6f;
+    bvh_bounds b;
+    b.min = vector_diff(s->center, vector_create(r, r, r));
+    b.max = vector_addition(s->center, vector_create(r, r, r));
+    return b;
+}
+
+static size_t centroid_bin(float c, float c_min, float scale)
+{
+    size_t bin = (size_t)((c - c_min) * scale);
+    return bin < BVH_BINS ? bin : BVH_BINS - 1;
+}
+
+static bvh_bounds centroid_bounds(const bvh *tree, const vec3 *centroids, const bvh_build_item *item)
+{
+    bvh_bounds bounds = bounds_empty();
+    for (size_t i = item->begin; i < item->end; ++i)
+    {
+        vec3 c = centroids[tree->indices[i]];
+        bounds_grow(&bounds, c, c);
+    }
+    return bounds;
+}
+
+static int bvh_find_split(const bvh *tree, const bvh_bounds *prim_bounds, const vec3 *centroids,
+                          const bvh_build_item *item, const bvh_bounds *node_bounds,
+                          int *split_axis, size_t *split_bin, float *split_cost)
+{
+    bvh_bounds c_bounds = centroid_bounds(tree, centroids, item);
+
+    float parent_area = bounds_area(node_bounds);
+    int found = 0;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float c_min = vector_axis(c_bounds.min, axis);
+        float extent = vector_axis(c_bounds.max, axis) - c_min;
+        if (extent <= 0.f)
+            continue;
+
+        float scale = BVH_BINS / extent;
+        bvh_bin bins[BVH_BINS];
+        for (size_t b = 0; b < BVH_BINS; ++b)
+        {
+            bins[b].bounds = bounds_empty();
+            bins[b].count = 0;
+        }
+
+        for (size_t i = item->begin; i < item->end; ++i)
+        {
+            unsigned int idx = tree->indices[i];
+            bvh_bin *bin = &bins[centroid_bin(vector_axis(centroids[idx], axis), c_min, scale)];
+            bounds_grow(&bin->bounds, prim_bounds[idx].min, prim_bounds[idx].max);
+            bin->count++;
+        }
+
+        // Sweep from the right to get the cost of every right side, then from the left
+        float right_area[BVH_BINS];
+        size_t right_count[BVH_BINS];
+        bvh_bounds acc = bounds_empty();
+        size_t count = 0;
+        for (size_t b = BVH_BINS - 1; b > 0; --b)
+        {
+            bounds_grow(&acc, bins[b].bounds.min, bins[b].bounds.max);
+            count += bins[b].count;
+            right_area[b] = bounds_area(&acc);
+            right_count[b] = count;
+        }
+
+        acc = bounds_empty();
+        count = 0;
+        for (size_t b = 1; b < BVH_BINS; ++b)
+        {
+            bounds_grow(&acc, bins[b - 1].bounds.min, bins[b - 1].bounds.max);
+            count += bins[b - 1].count;
+
+            if (count == 0 || right_count[b] == 0)
+                continue;
+
+            float cost = BVH_TRAVERSAL_COST +
+                         BVH_INTERSECT_COST * (bounds_area(&acc) * count + right_area[b] * right_count[b]) / parent_area;
+            if (!found || cost < *split_cost)
+            {
+                found = 1;
+                *split_axis = axis;
+                *split_bin = b;
+                *split_cost = cost;
+            }
+        }
+    }
+
+    return found;
+}
+
+// Moves the primitives whose centroid falls left of split_bin to the front, returns the first right one
+static size_t bvh_partition(bvh *tree, const vec3 *centroids, const bvh_build_item *item, int axis, size_t split_bin)
+{
+    bvh_bounds c_bounds = centroid_bounds(tree, centroids, item);
+    float c_min = vector_axis(c_bounds.min, axis);
+    float scale = BVH_BINS / (vector_axis(c_bounds.max, axis) - c_min);
+
+    size_t left = item->begin, right = item->end;
+    while (left < right)
+    {
+        unsigned int idx = tree->indices[left];
+        if (centroid_bin(vector_axis(centroids[idx], axis), c_min, scale) < split_bin)
+        {
+            ++left;
+        }
+        else
+        {
+            tree->indices[left] = tree->indices[--right];
+            tree->indices[right] = idx;
+        }
+    }
+    return left;
+}
+
+bvh *bvh_create(const sphere *spheres, size_t spheres_len)
+{
+    bvh *tree = (bvh *)malloc(sizeof(bvh));
+    if (tree == NULL)
+        return NULL;
+
+    tree->nodes_len = 0;
+    tree->indices_len = spheres_len;
+    tree->nodes = (bvh_node *)malloc((spheres_len ? 2 * spheres_len - 1 : 1) * sizeof(bvh_node));
+    tree->indices = (unsigned int *)malloc((spheres_len ? spheres_len : 1) * sizeof(unsigned int));
+
+    bvh_bounds *prim_bounds = (bvh_bounds *)malloc((spheres_len ? spheres_len : 1) * sizeof(bvh_bounds));
+    vec3 *centroids = (vec3 *)malloc((spheres_len ? spheres_len : 1) * sizeof(vec3));
+
+    if (tree->nodes == NULL || tree->indices == NULL || prim_bounds == NULL || centroids == NULL)
+    {
+        free(prim_bounds);
+        free(centroids);
+        bvh_destroy(tree);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < spheres_len; ++i)
+    {
+        tree->indices[i] = (unsigned int)i;
+        prim_bounds[i] = sphere_bounds(&spheres[i]);
+        centroids[i] = spheres[i].center;
+    }
+
+    if (spheres_len == 0)
+    {
+        free(prim_bounds);
+        free(centroids);
+        return tree;
+    }
+
+    // The stack holds at most one pending sibling per level, so it never outgrows the depth limit
+    bvh_build_item stack[BVH_MAX_DEPTH + 1];
+    size_t stack_len = 0;
+
+    stack[stack_len].node = 0;
+    stack[stack_len].begin = 0;
+    stack[stack_len].end = spheres_len;
+    stack[stack_len].depth = 1;
+    stack_len++;
+    tree->nodes_len = 1;
+
+    while (stack_len)
+    {
+        bvh_build_item item = stack[--stack_len];
+        bvh_node *node = &tree->nodes[item.node];
+        size_t count = item.end - item.begin;
+
+        bvh_bounds node_bounds = bounds_empty();
+        for (size_t i = item.begin; i < item.end; ++i)
+        {
+            unsigned int idx = tree->indices[i];
+            bounds_grow(&node_bounds, prim_bounds[idx].min, prim_bounds[idx].max);
+        }
+        node->bounds_min = node_bounds.min;
+        node->bounds_max = node_bounds.max;
+        node->first = (unsigned int)item.begin;
+        node->count = (unsigned int)count;
+
+        if (count <= 1 || item.depth >= BVH_MAX_DEPTH)
+            continue;
+
+        int axis = 0;
+        size_t bin = 0;
+        float cost;
+        if (!bvh_find_split(tree, prim_bounds, centroids, &item, &node_bounds, &axis, &bin, &cost))
+            continue;
+
+        if (count <= BVH_MAX_LEAF_SIZE && cost >= BVH_INTERSECT_COST * count)
+            continue;
+
+        size_t middle = bvh_partition(tree, centroids, &item, axis, bin);
+
+        unsigned int left = (unsigned int)tree->nodes_len;
+        tree->nodes_len += 2;
+        node->first = left;
+        node->count = 0;
+
+        bvh_build_item right_item = {left + 1, middle, item.end, item.depth + 1};
+        bvh_build_item left_item = {left, item.begin, middle, item.depth + 1};
+        stack[stack_len++] = right_item;
+        stack[stack_len++] = left_item;
+    }
+
+    free(prim_bounds);
+    free(centroids);
+    return tree;
+}
+
+void bvh_destroy(bvh *tree)
+{
+    if (tree == NULL)
+        return;
+
+    free(tree->nodes);
+    free(tree->indices);
+    free(tree);
+}
+
+bvh *bvh_copy(const bvh *tree)
+{
+    bvh *copy = (bvh *)malloc(sizeof(bvh));
+    if (copy == NULL)
+        return NULL;
+
+    copy->nodes_len = tree->nodes_len;
+    copy->indices_len = tree->indices_len;
+    copy->nodes = (bvh_node *)malloc((tree->nodes_len ? tree->nodes_len : 1) * sizeof(bvh_node));
+    copy->indices = (unsigned int *)malloc((tree->indices_len ? tree->indices_len : 1) * sizeof(unsigned int));
+    if (copy->nodes == NULL || copy->indices == NULL)
+    {
+        bvh_destroy(copy);
+        return NULL;
+    }
+
+    memcpy(copy->nodes, tree->nodes, tree->nodes_len * sizeof(bvh_node));
+    memcpy(copy->indices, tree->indices, tree->indices_len * sizeof(unsigned int));
+    return copy;
+}
+
+void bvh_refit(bvh *tree, const sphere *spheres)
+{
+    // Children are always stored after their parent, so a backward pass sees them first
+    for (size_t i = tree->nodes_len; i-- > 0;)
+    {
+        bvh_node *node = &tree->nodes[i];
+        bvh_bounds bounds = bounds_empty();
+
+        if (node->count)
+        {
+            for (unsigned int j = node->first; j < node->first + node->count; ++j)
+            {
+                bvh_bounds prim = sphere_bounds(&spheres[tree->indices[j]]);
+                bounds_grow(&bounds, prim.min, prim.max);
+            }
+        }
+        else
+        {
+            bounds_grow(&bounds, tree->nodes[node->first].bounds_min, tree->nodes[node->first].bounds_max);
+            bounds_grow(&bounds, tree->nodes[node->first + 1].bounds_min, tree->nodes[node->first + 1].bounds_max);
+        }
+
+        node->bounds_min = bounds.min;
+        node->bounds_max = bounds.max;
+    }
+}
+
+static int bvh_ray_box(const bvh_node *node, vec3 orig, vec3 inv_dir, float tmax, float *tnear)
+{
+    RT_STATS_ADD(RT_COUNTER_NODE_TESTS, 1);
+    float t0 = 0.f, t1 = tmax;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float o = vector_axis(orig, axis);
+        float inv = vector_axis(inv_dir, axis);
+        float ta = (vector_axis(node->bounds_min, axis) - o) * inv;
+        float tb = (vector_axis(node->bounds_max, axis) - o) * inv;
+        if (ta > tb)
+        {
+            float tmp = ta;
+            ta = tb;
+            tb = tmp;
+        }
+        // NaN slabs (origin on the plane of an axis-parallel ray) fail both tests and are ignored
+        if (ta > t0)
+            t0 = ta;
+        if (tb < t1)
+            t1 = tb;
+    }
+
+    *tnear = t0;
+    return t0 <= t1;
+}
+
+int bvh_intersect(const bvh *tree, const sphere *spheres, vec3 orig, vec3 dir,
+                  vec3 *hit, vec3 *normal, material *material)
+{
+    if (tree == NULL || tree->nodes_len == 0)
+        return 0;
+
+    vec3 inv_dir = vector_create(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+    float spheres_dist = FLT_MAX;
+    size_t nearest = BVH_NO_HIT;
+
+    bvh_stack_item stack[BVH_MAX_DEPTH];
+    size_t stack_len = 0;
+
+    float tnear;
+    if (!bvh_ray_box(&tree->nodes[0], orig, inv_dir, spheres_dist, &tnear))
+        return 0;
+
+    stack[stack_len].node = 0;
+    stack[stack_len].tnear = tnear;
+    stack_len++;
+
+    while (stack_len)
+    {
+        bvh_stack_item item = stack[--stack_len];
+        // Ties are kept so that the lowest sphere index wins, as in the linear loop
+        if (item.tnear > spheres_dist)
+            continue;
+
+        const bvh_node *node = &tree->nodes[item.node];
+        if (node->count)
+        {
+            for (unsigned int i = node->first; i < node->first + node->count; ++i)
+            {
+                unsigned int idx = tree->indices[i];
+                float dist_i;
+                if (sphere_ray_intersect(spheres[idx], orig, dir, &dist_i) &&
+                    (dist_i < spheres_dist || (dist_i == spheres_dist && idx < nearest)))
+                {
+                    spheres_dist = dist_i;
+                    nearest = idx;
+                }
+            }
+            continue;
+        }
+
+        float t_left, t_right;
+        int hit_left = bvh_ray_box(&tree->nodes[node->first], orig, inv_dir, spheres_dist, &t_left);
+        int hit_right = bvh_ray_box(&tree->nodes[node->first + 1], orig, inv_dir, spheres_dist, &t_right);
+
+        // Push the far child first so the near one is visited next
+        if (hit_left && hit_right)
+        {
+            int left_first = t_left <= t_right;
+            stack[stack_len].node = left_first ? node->first + 1 : node->first;
+            stack[stack_len].tnear = left_first ? t_right : t_left;
+            stack_len++;
+            stack[stack_len].node = left_first ? node->first : node->first + 1;
+            stack[stack_len].tnear = left_first ? t_left : t_right;
+            stack_len++;
+        }
+        else if (hit_left || hit_right)
+        {
+            stack[stack_len].node = hit_left ? node->first : node->first + 1;
+            stack[stack_len].tnear = hit_left ? t_left : t_right;
+            stack_len++;
+        }
+    }
+
+    if (nearest == BVH_NO_HIT)
+        return 0;
+
+    *hit = vector_addition(orig, vector_multiplication(dir, spheres_dist));
+    *normal = vector_normalize(vector_diff(*hit, spheres[nearest].center));
+    *material = spheres[nearest].mat;
+
+    return spheres_dist < 1000;
+}
+
+int bvh_occluded(const bvh *tree, const sphere *spheres, vec3 orig, vec3 dir, float tmax, size_t *occluder)
+{
+    if (tree == NULL || tree->nodes_len == 0)
+        return 0;
+
+    vec3 inv_dir = vector_create(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+
+    // Any blocker will do, so children are visited in tree order without sorting
+    unsigned int stack[BVH_MAX_DEPTH];
+    size_t stack_len = 0;
+    stack[stack_len++] = 0;
+
+    while (stack_len)
+    {
+        const bvh_node *node = &tree->nodes[stack[--stack_len]];
+
+        float tnear;
+        if (!bvh_ray_box(node, orig, inv_dir, tmax, &tnear))
+            continue;
+
+        if (node->count == 0)
+        {
+            stack[stack_len++] = node->first + 1;
+            stack[stack_len++] = node->first;
+            continue;
+        }
+
+        for (unsigned int i = node->first; i < node->first + node->count; ++i)
+        {
+            unsigned int idx = tree->indices[i];
+            float dist_i;
+            if (sphere_ray_intersect(spheres[idx], orig, dir, &dist_i) && dist_i < tmax)
+            {
+                if (occluder != NULL)
+                    *occluder = idx;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
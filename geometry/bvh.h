@@ -0,0 +1,61 @@
+#ifndef BVH_H
+#define BVH_H
+#include "render.h"
+
+// Traversal uses a fixed-size stack, so the builder never produces a deeper tree
+#define BVH_MAX_DEPTH 64
+
+typedef struct bvh_node
+{
+    vec3 bounds_min;
+    vec3 bounds_max;
+    // Inner node: index of the left child, the right child is first + 1
+    // Leaf: index of the first primitive in bvh.indices
+    unsigned int first;
+    // Number of primitives in a leaf, 0 for inner nodes
+    unsigned int count;
+} bvh_node;
+
+typedef struct bvh
+{
+    bvh_node *nodes;
+    size_t nodes_len;
+    unsigned int *indices;
+    size_t indices_len;
+} bvh;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Builds a bounding volume hierarchy over the spheres using binned SAH
+    ///
+    /// @param spheres array of spheres, must outlive the tree
+    /// @param spheres_len number of spheres
+    ///
+    /// @return Returns a pointer to the tree. If an error occurred during creation, it returns NULL
+    bvh *bvh_create(const sphere *spheres, size_t spheres_len);
+
+    void bvh_destroy(bvh *tree);
+
+    /// @brief Copies the tree into freshly allocated arrays, also works for trees in a mapped scene file
+    /// @return Returns the copy, NULL if memory runs out
+    bvh *bvh_copy(const bvh *tree);
+
+    /// @brief Recomputes the node bounds after spheres moved, the topology stays as it was built
+    ///
+    /// Much cheaper than a rebuild, but traversal slows down as spheres drift away from where the
+    /// tree was built. The spheres must be the array the tree was built over, in the same order.
+    void bvh_refit(bvh *tree, const sphere *spheres);
+
+    /// @brief Finds the nearest sphere hit by the ray, same contract as scene_intersect
+    int bvh_intersect(const bvh *tree, const sphere *spheres, vec3 orig, vec3 dir,
+                      vec3 *hit, vec3 *normal, material *material);
+
+    /// @brief Checks whether any sphere is hit closer than tmax, same contract as scene_occluded
+    int bvh_occluded(const bvh *tree, const sphere *spheres, vec3 orig, vec3 dir, float tmax, size_t *occluder);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+#include "camera.h"
+#include "stdlib.h"
+
+static vec3 cross_product(vec3 lhs, vec3 rhs)
+{
+    return vector_create(lhs.y * rhs.z - lhs.z * rhs.y,
+                         lhs.z * rhs.x - lhs.x * rhs.z,
+                         lhs.x * rhs.y - lhs.y * rhs.x);
+}
+
+int camera_look_at(camera *cam, vec3 position, vec3 look_at, vec3 up)
+{
+    vec3 view = vector_diff(look_at, position);
+    if (vector_scalar_product(view, view) == 0.f)
+        return -1;
+
+    vec3 forward = vector_normalize(view);
+    vec3 right = cross_product(forward, up);
+    if (vector_scalar_product(right, right) == 0.f)
+        return -1;
+
+    cam->position = position;
+    cam->forward = forward;
+    cam->right = vector_normalize(right);
+    cam->up = cross_product(cam->right, forward);
+    return 0;
+}
+
+int camera_init(camera *cam, size_t width, size_t height, vec3 position, vec3 look_at, vec3 up, float fov)
+{
+    cam->col_offsets = NULL;
+    cam->row_offsets = NULL;
+
+    if (width == 0 || height == 0 || !(fov > 0.f && fov < M_PI) || camera_look_at(cam, position, look_at, up) != 0)
+        return -1;
+
+    cam->width = width;
+    cam->height = height;
+    cam->fov = fov;
+    cam->col_offsets = (float *)malloc(width * sizeof(float));
+    cam->row_offsets = (float *)malloc(height * sizeof(float));
+    if (cam->col_offsets == NULL || cam->row_offsets == NULL)
+    {
+        camera_close(cam);
+        return -1;
+    }
+
+    // Evaluated in double like the per-pixel formula this replaces, so the default camera renders the same image
+    double half_height = tan(fov / 2.);
+    for (size_t x = 0; x < width; ++x)
+        cam->col_offsets[x] = (2 * (x + 0.5) / (float)width - 1) * half_height * width / (float)height;
+    for (size_t y = 0; y < height; ++y)
+        cam->row_offsets[y] = -(2 * (y + 0.5) / (float)height - 1) * half_height;
+    return 0;
+}
+
+vec3 camera_ray_dir(const camera *cam, size_t x, size_t y)
+{
+    vec3 dir;
+    camera_row_dirs(cam, x, y, 1, &dir.x, &dir.y, &dir.z);
+    return dir;
+}
+
+void camera_row_dirs(const camera *cam, size_t x, size_t y, size_t count, float *dir_x, float *dir_y, float *dir_z)
+{
+    // The part every pixel of the row shares
+    float row = cam->row_offsets[y];
+    float base_x = row * cam->up.x + cam->forward.x;
+    float base_y = row * cam->up.y + cam->forward.y;
+    float base_z = row * cam->up.z + cam->forward.z;
+    float right_x = cam->right.x;
+    float right_y = cam->right.y;
+    float right_z = cam->right.z;
+    const float *cols = cam->col_offsets + x;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        float dx = cols[i] * right_x + base_x;
+        float dy = cols[i] * right_y + base_y;
+        float dz = cols[i] * right_z + base_z;
+        // Same operations in the same order as vector_normalize
+        float scale = vector_rsqrt(dx * dx + dy * dy + dz * dz);
+        dir_x[i] = dx * scale;
+        dir_y[i] = dy * scale;
+        dir_z[i] = dz * scale;
+    }
+}
+
+void camera_pixel_dirs(const camera *cam, const size_t *x, const size_t *y, size_t count,
+                       float *dir_x, float *dir_y, float *dir_z)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        // The operations of camera_row_dirs, so a pixel gets the same direction either way
+        float row = cam->row_offsets[y[i]];
+        float col = cam->col_offsets[x[i]];
+        float dx = col * cam->right.x + (row * cam->up.x + cam->forward.x);
+        float dy = col * cam->right.y + (row * cam->up.y + cam->forward.y);
+        float dz = col * cam->right.z + (row * cam->up.z + cam->forward.z);
+        float scale = vector_rsqrt(dx * dx + dy * dy + dz * dz);
+        dir_x[i] = dx * scale;
+        dir_y[i] = dy * scale;
+        dir_z[i] = dz * scale;
+    }
+}
+
+void camera_close(camera *cam)
+{
+    free(cam->col_offsets);
+    free(cam->row_offsets);
+    cam->col_offsets = NULL;
+    cam->row_offsets = NULL;
+}
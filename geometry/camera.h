@@ -0,0 +1,66 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+#include "vector.h"
+#include "stddef.h"
+
+// Pinhole camera. The ray through pixel (x, y) points along
+//     forward + col_offsets[x] * right + row_offsets[y] * up
+// before normalization, the offsets are the pixel centers on an image plane at distance 1.
+typedef struct camera
+{
+    size_t width;
+    size_t height;
+    vec3 position;
+    // Orthonormal basis, forward points at the look-at point and up is the up direction of the image
+    vec3 right;
+    vec3 up;
+    vec3 forward;
+    // Vertical field of view in radians
+    float fov;
+    float *col_offsets;
+    float *row_offsets;
+} camera;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Sets up a camera at position looking at look_at
+    ///
+    /// The default camera of the example, at the origin looking at (0, 0, -1) with up (0, 1, 0),
+    /// gives exactly the directions the former fixed camera computed per pixel.
+    ///
+    /// @param up rough up direction, anything not parallel to the view direction
+    /// @param fov vertical field of view in radians, in (0, pi)
+    /// @return 0 on success, -1 if the view direction or the up direction is degenerate or memory ran out
+    int camera_init(camera *cam, size_t width, size_t height, vec3 position, vec3 look_at, vec3 up, float fov);
+
+    /// @brief Moves and turns an initialized camera, the image size and field of view stay
+    ///
+    /// The offsets are not touched, so copies of a camera can each look somewhere else while
+    /// sharing the offsets of the one camera_init set up.
+    ///
+    /// @return 0 on success, -1 if the view direction or the up direction is degenerate, cam is unchanged then
+    int camera_look_at(camera *cam, vec3 position, vec3 look_at, vec3 up);
+
+    /// @brief Normalized direction of the ray through the center of pixel (x, y)
+    vec3 camera_ray_dir(const camera *cam, size_t x, size_t y);
+
+    /// @brief Normalized directions of the rays through pixels x to x + count - 1 of row y
+    ///
+    /// Components are written to separate arrays, as ray packets and SIMD kernels take them. Per pixel
+    /// this is one multiply-add per component and the normalization, with no dependency between pixels.
+    void camera_row_dirs(const camera *cam, size_t x, size_t y, size_t count, float *dir_x, float *dir_y, float *dir_z);
+
+    /// @brief Normalized directions of the rays through pixels (x[i], y[i]) for i below count
+    ///
+    /// For pixels visited in an order other than row by row, gives the same directions as camera_row_dirs.
+    void camera_pixel_dirs(const camera *cam, const size_t *x, const size_t *y, size_t count,
+                           float *dir_x, float *dir_y, float *dir_z);
+
+    void camera_close(camera *cam);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,102 @@
+#include "curve.h"
+#include "string.h"
+
+int curve_order_parse(const char *name, curve_order *order)
+{
+    if (strcmp(name, "row") == 0)
+        *order = CURVE_ROW_MAJOR;
+    else if (strcmp(name, "morton") == 0)
+        *order = CURVE_MORTON;
+    else if (strcmp(name, "hilbert") == 0)
+        *order = CURVE_HILBERT;
+    else
+        return -1;
+    return 0;
+}
+
+const char *curve_order_name(curve_order order)
+{
+    switch (order)
+    {
+    case CURVE_MORTON:
+        return "morton";
+    case CURVE_HILBERT:
+        return "hilbert";
+    default:
+        return "row";
+    }
+}
+
+// Even bits of d are x, odd bits are y
+static void morton_cell(size_t d, size_t *x, size_t *y)
+{
+    *x = 0;
+    *y = 0;
+    for (size_t bit = 0; d; ++bit, d >>= 2)
+    {
+        *x |= (d & 1) << bit;
+        *y |= ((d >> 1) & 1) << bit;
+    }
+}
+
+// Cell d of the Hilbert curve through a side x side square, side a power of two. Builds the
+// position up from the smallest quadrant, rotating what is below whenever the curve turns.
+static void hilbert_cell(size_t side, size_t d, size_t *x, size_t *y)
+{
+    *x = 0;
+    *y = 0;
+    for (size_t s = 1; s < side; s *= 2, d /= 4)
+    {
+        size_t rx = 1 & (d / 2);
+        size_t ry = 1 & (d ^ rx);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                *x = s - 1 - *x;
+                *y = s - 1 - *y;
+            }
+            size_t t = *x;
+            *x = *y;
+            *y = t;
+        }
+        *x += s * rx;
+        *y += s * ry;
+    }
+}
+
+void curve_order_fill(curve_order order, size_t cols, size_t rows, size_t *cells)
+{
+    if (order == CURVE_ROW_MAJOR)
+    {
+        for (size_t i = 0; i < cols * rows; ++i)
+            cells[i] = i;
+        return;
+    }
+
+    size_t short_side = cols < rows ? cols : rows;
+    size_t long_side = cols < rows ? rows : cols;
+    size_t side = 1;
+    while (side < short_side)
+        side *= 2;
+
+    size_t len = 0;
+    for (size_t block = 0; block * side < long_side && short_side; ++block)
+    {
+        for (size_t d = 0; d < side * side; ++d)
+        {
+            size_t x, y;
+            if (order == CURVE_MORTON)
+                morton_cell(d, &x, &y);
+            else
+                hilbert_cell(side, d, &x, &y);
+
+            if (cols >= rows)
+                x += block * side;
+            else
+                y += block * side;
+            if (x < cols && y < rows)
+                cells[len++] = y * cols + x;
+        }
+    }
+}
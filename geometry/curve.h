@@ -0,0 +1,37 @@
+#ifndef CURVE_H
+#define CURVE_H
+#include "stddef.h"
+
+// Order in which the cells of a 2D grid, such as the tiles of a frame or the pixels of a tile, are visited
+typedef enum curve_order
+{
+    // Row by row, left to right
+    CURVE_ROW_MAJOR,
+    // Z-order, interleaved x and y bits
+    CURVE_MORTON,
+    // Hilbert curve, consecutive cells are always neighbours
+    CURVE_HILBERT,
+} curve_order;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Parses "row", "morton" or "hilbert"
+    /// @return 0 on success, -1 if the name is unknown
+    int curve_order_parse(const char *name, curve_order *order);
+
+    const char *curve_order_name(curve_order order);
+
+    /// @brief Writes the cells of a cols x rows grid in the order the curve visits them
+    ///
+    /// Cells are written as row-major indices y * cols + x, so cells ends up a permutation of
+    /// 0 to cols * rows - 1. Grids of any size work, the curve runs over the smallest power of two
+    /// square covering the short side and skips the cells outside the grid. Grids much longer than
+    /// wide are a row of such squares, one after the other.
+    void curve_order_fill(curve_order order, size_t cols, size_t rows, size_t *cells);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,294 @@
+#include "image.h"
+#include "render.h"
+#include "stdlib.h"
+#include "string.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define IMAGE_HEADER_MAX 64
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_RUN_MAX 62
+
+int image_format_parse(const char *name, image_format *format)
+{
+    const char *ext = strrchr(name, '.');
+    if (ext != NULL)
+        name = ext + 1;
+
+    if (strcmp(name, "tga") == 0)
+        *format = IMAGE_FORMAT_TGA;
+    else if (strcmp(name, "ppm") == 0)
+        *format = IMAGE_FORMAT_PPM;
+    else if (strcmp(name, "qoi") == 0)
+        *format = IMAGE_FORMAT_QOI;
+    else
+        return -1;
+    return 0;
+}
+
+void image_tonemap(const vec3 *pixels, size_t count, unsigned char *rgb)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        vec3 color = pixels[i];
+        float max = MAX(color.x, MAX(color.y, color.z));
+        if (max > 1)
+            color = vector_multiplication(color, (1. / max));
+
+        rgb[3 * i + 0] = (unsigned char)(255.f * (MAX(0.f, MIN(1.f, color.x))));
+        rgb[3 * i + 1] = (unsigned char)(255.f * (MAX(0.f, MIN(1.f, color.y))));
+        rgb[3 * i + 2] = (unsigned char)(255.f * (MAX(0.f, MIN(1.f, color.z))));
+    }
+}
+
+static void put_be32(unsigned char *out, size_t value)
+{
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+// Returns the header length, 0 if the image does not fit the format
+static size_t image_header(image_format format, size_t width, size_t height, unsigned char *out)
+{
+    switch (format)
+    {
+    case IMAGE_FORMAT_TGA:
+    {
+        if (width > 0xffff || height > 0xffff)
+            return 0;
+
+        // Uncompressed true color, origin in the top left corner
+        const unsigned char header[18] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          (unsigned char)(width & 0xff), (unsigned char)(width >> 8),
+                                          (unsigned char)(height & 0xff), (unsigned char)(height >> 8),
+                                          24, 0x20};
+        memcpy(out, header, sizeof(header));
+        return sizeof(header);
+    }
+    case IMAGE_FORMAT_PPM:
+    {
+        int len = snprintf((char *)out, IMAGE_HEADER_MAX, "P6\n%zu %zu\n255\n", width, height);
+        return len > 0 && len < IMAGE_HEADER_MAX ? (size_t)len : 0;
+    }
+    case IMAGE_FORMAT_QOI:
+        if (width > 0xffffffff || height > 0xffffffff)
+            return 0;
+
+        memcpy(out, "qoif", 4);
+        put_be32(out + 4, width);
+        put_be32(out + 8, height);
+        out[12] = 3;
+        out[13] = 0;
+        return 14;
+    }
+    return 0;
+}
+
+static int image_writer_flush(image_writer *writer)
+{
+    if (writer->buffer_len && fwrite(writer->buffer, 1, writer->buffer_len, writer->out) != writer->buffer_len)
+        return -1;
+    writer->buffer_len = 0;
+    return 0;
+}
+
+image_writer *image_writer_open(const char *path, image_format format, size_t width, size_t height)
+{
+    unsigned char header[IMAGE_HEADER_MAX];
+    size_t header_len = image_header(format, width, height, header);
+    if (header_len == 0)
+        return NULL;
+
+    image_writer *writer = (image_writer *)malloc(sizeof(image_writer));
+    if (writer == NULL)
+        return NULL;
+
+    writer->out = fopen(path, "wb");
+    if (writer->out == NULL)
+    {
+        free(writer);
+        return NULL;
+    }
+
+    writer->format = format;
+    writer->width = width;
+    writer->height = height;
+    writer->rows_written = 0;
+
+    memset(writer->qoi_index, 0, sizeof(writer->qoi_index));
+    writer->qoi_prev[0] = 0;
+    writer->qoi_prev[1] = 0;
+    writer->qoi_prev[2] = 0;
+    writer->qoi_run = 0;
+
+    memcpy(writer->buffer, header, header_len);
+    writer->buffer_len = header_len;
+    return writer;
+}
+
+static void qoi_emit(image_writer *writer, unsigned char byte)
+{
+    writer->buffer[writer->buffer_len++] = byte;
+}
+
+// The alpha channel is always 255, it is part of the index hash and of every slot
+static int qoi_encode(image_writer *writer, const unsigned char *rgb, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, rgb += 3)
+    {
+        // The longest op is 4 bytes, a pending run adds one more
+        if (writer->buffer_len + 5 > sizeof(writer->buffer) && image_writer_flush(writer) != 0)
+            return -1;
+
+        unsigned char *prev = writer->qoi_prev;
+        if (rgb[0] == prev[0] && rgb[1] == prev[1] && rgb[2] == prev[2])
+        {
+            if (++writer->qoi_run == QOI_RUN_MAX)
+            {
+                qoi_emit(writer, (unsigned char)(QOI_OP_RUN | (writer->qoi_run - 1)));
+                writer->qoi_run = 0;
+            }
+            continue;
+        }
+
+        if (writer->qoi_run)
+        {
+            qoi_emit(writer, (unsigned char)(QOI_OP_RUN | (writer->qoi_run - 1)));
+            writer->qoi_run = 0;
+        }
+
+        unsigned hash = (rgb[0] * 3u + rgb[1] * 5u + rgb[2] * 7u + 255u * 11u) % 64;
+        unsigned char *slot = writer->qoi_index[hash];
+        if (slot[0] == rgb[0] && slot[1] == rgb[1] && slot[2] == rgb[2] && slot[3] == 255)
+        {
+            qoi_emit(writer, (unsigned char)(QOI_OP_INDEX | hash));
+        }
+        else
+        {
+            memcpy(slot, rgb, 3);
+            slot[3] = 255;
+
+            signed char dr = (signed char)(rgb[0] - prev[0]);
+            signed char dg = (signed char)(rgb[1] - prev[1]);
+            signed char db = (signed char)(rgb[2] - prev[2]);
+            signed char dr_dg = (signed char)(dr - dg);
+            signed char db_dg = (signed char)(db - dg);
+
+            if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+            {
+                qoi_emit(writer, (unsigned char)(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            }
+            else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8)
+            {
+                qoi_emit(writer, (unsigned char)(QOI_OP_LUMA | (dg + 32)));
+                qoi_emit(writer, (unsigned char)((dr_dg + 8) << 4 | (db_dg + 8)));
+            }
+            else
+            {
+                qoi_emit(writer, QOI_OP_RGB);
+                qoi_emit(writer, rgb[0]);
+                qoi_emit(writer, rgb[1]);
+                qoi_emit(writer, rgb[2]);
+            }
+        }
+
+        memcpy(prev, rgb, 3);
+    }
+    return 0;
+}
+
+int image_writer_write_rows(image_writer *writer, const unsigned char *rgb, size_t rows)
+{
+    if (rows > writer->height - writer->rows_written)
+        return -1;
+
+    size_t bytes = rows * writer->width * 3;
+    writer->rows_written += rows;
+
+    if (writer->format == IMAGE_FORMAT_QOI)
+        return qoi_encode(writer, rgb, rows * writer->width);
+
+    // Raw formats go straight to the file, only small writes are gathered in the buffer
+    if (writer->buffer_len + bytes <= sizeof(writer->buffer))
+    {
+        memcpy(writer->buffer + writer->buffer_len, rgb, bytes);
+        writer->buffer_len += bytes;
+        return 0;
+    }
+
+    if (image_writer_flush(writer) != 0)
+        return -1;
+    return fwrite(rgb, 1, bytes, writer->out) == bytes ? 0 : -1;
+}
+
+int image_writer_close(image_writer *writer)
+{
+    int result = writer->rows_written == writer->height ? 0 : -1;
+
+    if (writer->format == IMAGE_FORMAT_QOI)
+    {
+        static const unsigned char end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+        if (writer->buffer_len + 1 + sizeof(end_marker) > sizeof(writer->buffer) && image_writer_flush(writer) != 0)
+            result = -1;
+        if (writer->qoi_run)
+            qoi_emit(writer, (unsigned char)(QOI_OP_RUN | (writer->qoi_run - 1)));
+        memcpy(writer->buffer + writer->buffer_len, end_marker, sizeof(end_marker));
+        writer->buffer_len += sizeof(end_marker);
+    }
+
+    if (image_writer_flush(writer) != 0)
+        result = -1;
+    if (fclose(writer->out) != 0)
+        result = -1;
+
+    free(writer);
+    return result;
+}
+
+int image_map_create(image_mapping *mapping, const char *path, image_format format, size_t width, size_t height)
+{
+    if (format == IMAGE_FORMAT_QOI)
+        return -1;
+
+    unsigned char header[IMAGE_HEADER_MAX];
+    size_t header_len = image_header(format, width, height, header);
+    if (header_len == 0)
+        return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    size_t size = header_len + width * height * 3;
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return -1;
+
+    memcpy(addr, header, header_len);
+    mapping->addr = addr;
+    mapping->size = size;
+    mapping->pixels = (unsigned char *)addr + header_len;
+    return 0;
+}
+
+int image_map_close(image_mapping *mapping)
+{
+    return munmap(mapping->addr, mapping->size);
+}
@@ -0,0 +1,76 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+#include "vector.h"
+#include "stdio.h"
+
+typedef enum image_format
+{
+    IMAGE_FORMAT_TGA,
+    IMAGE_FORMAT_PPM,
+    IMAGE_FORMAT_QOI,
+} image_format;
+
+// Streaming encoder, rows are written top to bottom as 8-bit RGB
+typedef struct image_writer
+{
+    FILE *out;
+    image_format format;
+    size_t width;
+    size_t height;
+    size_t rows_written;
+
+    // QOI encoder state carried across calls
+    unsigned char qoi_index[64][4];
+    unsigned char qoi_prev[3];
+    size_t qoi_run;
+    size_t buffer_len;
+    unsigned char buffer[1 << 16];
+} image_writer;
+
+// Output file mapped in memory, pixels points right past the header
+typedef struct image_mapping
+{
+    void *addr;
+    size_t size;
+    unsigned char *pixels;
+} image_mapping;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Parses "tga", "ppm" or "qoi", or picks the format from a file extension
+    /// @return 0 on success, -1 if the name is unknown
+    int image_format_parse(const char *name, image_format *format);
+
+    /// @brief Converts HDR pixels to 8-bit RGB
+    ///
+    /// Colors brighter than 1 are scaled down by their largest component, then every component is
+    /// clamped to [0, 1]. Pixels are independent, so any range of them can be converted in parallel.
+    void image_tonemap(const vec3 *pixels, size_t count, unsigned char *rgb);
+
+    image_writer *image_writer_open(const char *path, image_format format, size_t width, size_t height);
+
+    /// @brief Appends rows of width * 3 bytes each
+    /// @return 0 on success, -1 on a write error or when more rows than the image height are written
+    int image_writer_write_rows(image_writer *writer, const unsigned char *rgb, size_t rows);
+
+    /// @brief Finishes the file and frees the writer
+    /// @return 0 on success, -1 if the file could not be completed
+    int image_writer_close(image_writer *writer);
+
+    /// @brief Creates the file at its final size, writes the header and maps it for writing
+    ///
+    /// Only formats with a fixed layout (TGA, PPM) can be mapped.
+    ///
+    /// @return 0 on success, -1 otherwise
+    int image_map_create(image_mapping *mapping, const char *path, image_format format, size_t width, size_t height);
+
+    /// @brief Unmaps the file, the kernel writes the pages back
+    /// @return 0 on success, -1 otherwise
+    int image_map_close(image_mapping *mapping);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
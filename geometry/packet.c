@@ -0,0 +1,204 @@
+#include "packet.h"
+#include "bvh.h"
+#include "stats.h"
+#include "math.h"
+#include "float.h"
+#include "stddef.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#define PACKET_GROUPS (RAY_PACKET_MAX / 4)
+#define PACKET_NO_HIT 0x7fffffff
+
+// Four rays of a packet in SIMD lanes
+typedef struct packet_group
+{
+    __m128 dir_x, dir_y, dir_z;
+    __m128 inv_x, inv_y, inv_z;
+    __m128 dist;
+    __m128i nearest;
+    __m128 active;
+} packet_group;
+
+static __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// Same operations as sphere_ray_intersect; with a shared origin the center offset is a scalar
+static void packet_sphere_intersect(packet_group *g, const sphere *s, int idx, vec3 orig)
+{
+    RT_STATS_ADD(RT_COUNTER_SPHERE_TESTS, __builtin_popcount(_mm_movemask_ps(g->active)));
+    vec3 diff = vector_diff(s->center, orig);
+    __m128 len2 = _mm_set1_ps(vector_scalar_product(diff, diff));
+    __m128 r2 = _mm_set1_ps(s->radius * s->radius);
+
+    __m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(diff.x), g->dir_x),
+                                       _mm_mul_ps(_mm_set1_ps(diff.y), g->dir_y)),
+                            _mm_mul_ps(_mm_set1_ps(diff.z), g->dir_z));
+    __m128 d2 = _mm_sub_ps(len2, _mm_mul_ps(tca, tca));
+    __m128 thc = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+
+    __m128 t0 = _mm_sub_ps(tca, thc);
+    __m128 t = select_ps(_mm_cmplt_ps(t0, _mm_setzero_ps()), _mm_add_ps(tca, thc), t0);
+
+    __m128i idx_v = _mm_set1_epi32(idx);
+    __m128 tie = _mm_and_ps(_mm_cmpeq_ps(t, g->dist), _mm_castsi128_ps(_mm_cmplt_epi32(idx_v, g->nearest)));
+    __m128 closer = _mm_or_ps(_mm_cmplt_ps(t, g->dist), tie);
+    __m128 miss = _mm_or_ps(_mm_cmpgt_ps(d2, r2), _mm_cmplt_ps(t, _mm_setzero_ps()));
+    __m128 update = _mm_and_ps(g->active, _mm_andnot_ps(miss, closer));
+
+    g->dist = select_ps(update, t, g->dist);
+    g->nearest = _mm_castps_si128(select_ps(update, _mm_castsi128_ps(idx_v), _mm_castsi128_ps(g->nearest)));
+}
+
+// Slab test for the active lanes, a NaN slab never culls
+static int packet_box_intersect(const packet_group *g, const bvh_node *node, vec3 orig)
+{
+    RT_STATS_ADD(RT_COUNTER_NODE_TESTS, __builtin_popcount(_mm_movemask_ps(g->active)));
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = g->dist;
+    const __m128 inf = _mm_set1_ps(INFINITY);
+
+    const float lo[3] = {node->bounds_min.x - orig.x, node->bounds_min.y - orig.y, node->bounds_min.z - orig.z};
+    const float hi[3] = {node->bounds_max.x - orig.x, node->bounds_max.y - orig.y, node->bounds_max.z - orig.z};
+    const __m128 inv[3] = {g->inv_x, g->inv_y, g->inv_z};
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        __m128 ta = _mm_mul_ps(_mm_set1_ps(lo[axis]), inv[axis]);
+        __m128 tb = _mm_mul_ps(_mm_set1_ps(hi[axis]), inv[axis]);
+        __m128 ordered = _mm_cmpord_ps(ta, tb);
+        t0 = _mm_max_ps(t0, select_ps(ordered, _mm_min_ps(ta, tb), _mm_sub_ps(_mm_setzero_ps(), inf)));
+        t1 = _mm_min_ps(t1, select_ps(ordered, _mm_max_ps(ta, tb), inf));
+    }
+
+    return _mm_movemask_ps(_mm_and_ps(g->active, _mm_cmple_ps(t0, t1)));
+}
+
+static float box_center_dist2(const bvh_node *node, vec3 orig)
+{
+    vec3 c = vector_diff(vector_multiplication(vector_addition(node->bounds_min, node->bounds_max), 0.5f), orig);
+    return vector_scalar_product(c, c);
+}
+
+static void packet_traverse_bvh(const bvh *tree, const sphere *spheres, vec3 orig, packet_group *groups, size_t groups_len)
+{
+    if (tree->nodes_len == 0)
+        return;
+
+    unsigned int stack[BVH_MAX_DEPTH];
+    size_t stack_len = 0;
+    stack[stack_len++] = 0;
+
+    while (stack_len)
+    {
+        const bvh_node *node = &tree->nodes[stack[--stack_len]];
+
+        int masks[PACKET_GROUPS];
+        int any = 0;
+        for (size_t g = 0; g < groups_len; ++g)
+        {
+            masks[g] = packet_box_intersect(&groups[g], node, orig);
+            any |= masks[g];
+        }
+        if (!any)
+            continue;
+
+        if (node->count)
+        {
+            for (unsigned int i = node->first; i < node->first + node->count; ++i)
+            {
+                unsigned int idx = tree->indices[i];
+                for (size_t g = 0; g < groups_len; ++g)
+                {
+                    if (masks[g])
+                        packet_sphere_intersect(&groups[g], &spheres[idx], (int)idx, orig);
+                }
+            }
+            continue;
+        }
+
+        // All rays start at the same point, so the child closer to it is the closer one for the whole packet
+        unsigned int left = node->first;
+        int left_first = box_center_dist2(&tree->nodes[left], orig) <= box_center_dist2(&tree->nodes[left + 1], orig);
+        stack[stack_len++] = left_first ? left + 1 : left;
+        stack[stack_len++] = left_first ? left : left + 1;
+    }
+}
+
+void cast_packet(const ray_packet *packet, vec3 background_color, const scene *sc, vec3 *colors)
+{
+    packet_group groups[PACKET_GROUPS];
+    size_t groups_len = (packet->len + 3) / 4;
+
+    RT_STATS_ADD(RT_COUNTER_PRIMARY_RAYS, packet->len);
+
+    for (size_t g = 0; g < groups_len; ++g)
+    {
+        packet_group *group = &groups[g];
+        group->dir_x = _mm_load_ps(packet->dir_x + 4 * g);
+        group->dir_y = _mm_load_ps(packet->dir_y + 4 * g);
+        group->dir_z = _mm_load_ps(packet->dir_z + 4 * g);
+        group->inv_x = _mm_div_ps(_mm_set1_ps(1.f), group->dir_x);
+        group->inv_y = _mm_div_ps(_mm_set1_ps(1.f), group->dir_y);
+        group->inv_z = _mm_div_ps(_mm_set1_ps(1.f), group->dir_z);
+        group->dist = _mm_set1_ps(FLT_MAX);
+        group->nearest = _mm_set1_epi32(PACKET_NO_HIT);
+
+        // Lanes past the end of a partial packet stay inactive
+        __m128i lane = _mm_add_epi32(_mm_set1_epi32((int)(4 * g)), _mm_setr_epi32(0, 1, 2, 3));
+        group->active = _mm_castsi128_ps(_mm_cmplt_epi32(lane, _mm_set1_epi32((int)packet->len)));
+    }
+
+    if (sc->bvh != NULL)
+    {
+        packet_traverse_bvh(sc->bvh, sc->spheres, packet->orig, groups, groups_len);
+    }
+    else
+    {
+        for (size_t i = 0; i < sc->spheres_len; ++i)
+        {
+            for (size_t g = 0; g < groups_len; ++g)
+                packet_sphere_intersect(&groups[g], &sc->spheres[i], (int)i, packet->orig);
+        }
+    }
+
+    float dist[RAY_PACKET_MAX] __attribute__((aligned(16)));
+    int nearest[RAY_PACKET_MAX] __attribute__((aligned(16)));
+    for (size_t g = 0; g < groups_len; ++g)
+    {
+        _mm_store_ps(dist + 4 * g, groups[g].dist);
+        _mm_store_si128((__m128i *)(nearest + 4 * g), groups[g].nearest);
+    }
+
+    for (size_t i = 0; i < packet->len; ++i)
+    {
+        if (nearest[i] == PACKET_NO_HIT || !(dist[i] < 1000))
+        {
+            colors[i] = background_color;
+            continue;
+        }
+
+        const sphere *s = &sc->spheres[nearest[i]];
+        vec3 dir = vector_create(packet->dir_x[i], packet->dir_y[i], packet->dir_z[i]);
+        vec3 point = vector_addition(packet->orig, vector_multiplication(dir, dist[i]));
+        vec3 normal = vector_normalize(vector_diff(point, s->center));
+        colors[i] = shade_hit(dir, point, normal, s->mat, background_color, sc, 0);
+    }
+}
+
+#else
+
+// Without SIMD every ray of the packet is traced on its own
+void cast_packet(const ray_packet *packet, vec3 background_color, const scene *sc, vec3 *colors)
+{
+    for (size_t i = 0; i < packet->len; ++i)
+    {
+        vec3 dir = vector_create(packet->dir_x[i], packet->dir_y[i], packet->dir_z[i]);
+        colors[i] = cast_ray(packet->orig, dir, background_color, sc, 0);
+    }
+}
+
+#endif
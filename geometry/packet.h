@@ -0,0 +1,37 @@
+#ifndef PACKET_H
+#define PACKET_H
+#include "render.h"
+
+// Enough for 2x2, 8x1 and 4x4 bundles of camera rays
+#define RAY_PACKET_MAX 16
+
+typedef struct ray_packet
+{
+    // Camera rays of a packet share their origin
+    vec3 orig;
+    float dir_x[RAY_PACKET_MAX] __attribute__((aligned(16)));
+    float dir_y[RAY_PACKET_MAX] __attribute__((aligned(16)));
+    float dir_z[RAY_PACKET_MAX] __attribute__((aligned(16)));
+    size_t len;
+} ray_packet;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Traces the primary rays of a packet together, four rays per SIMD lane group
+    ///
+    /// Nodes and spheres are fetched once per packet and tested against every ray that is still
+    /// active. Reflection and shadow rays diverge after the first hit and are traced one by one
+    /// through shade_hit. The colors match cast_ray for every ray.
+    ///
+    /// @param packet rays to trace, len <= RAY_PACKET_MAX
+    /// @param background_color color of rays that hit nothing
+    /// @param sc scene to trace against
+    /// @param colors receives packet->len colors
+    void cast_packet(const ray_packet *packet, vec3 background_color, const scene *sc, vec3 *colors);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
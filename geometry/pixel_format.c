@@ -0,0 +1,433 @@
+#include "pixel_format.h"
+#include "image.h"
+#include "render.h"
+#include "string.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_FORMAT_X86 1
+#include <immintrin.h>
+#else
+#define PIXEL_FORMAT_X86 0
+#endif
+
+#define HALF_MAX 65504.f
+#define RGB9E5_MAX 65408.f
+#define RGBE_MAX 1e38f
+// Colors are converted in chunks of this many pixels where a temporary is needed
+#define PIXEL_FORMAT_CHUNK 256
+
+// The SIMD kernels repeat the scalar code operation by operation, so every path gives the same bits.
+// Exponents are read from the float bits rather than with frexp/ldexp, which have no SIMD form.
+
+static unsigned int float_bits(float f)
+{
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static float bits_float(unsigned int bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Same as MIN(MAX(c, 0), max) with the operand order of maxps/minps, so NaN ends up as 0
+static float clamp_component(float c, float max)
+{
+    c = c > 0.f ? c : 0.f;
+    return c < max ? c : max;
+}
+
+// Round to nearest even, the same as the F16C conversion
+static unsigned short float_to_half(float f)
+{
+    unsigned int bits = float_bits(clamp_component(f, HALF_MAX));
+
+    // Below the smallest normal half the float adder does the rounding
+    if (bits < (113u << 23))
+        return (unsigned short)(float_bits(bits_float(bits) + 0.5f) - (126u << 23));
+
+    unsigned int mantissa_odd = (bits >> 13) & 1;
+    bits += (unsigned int)(-112 * (1 << 23)) + 0xfff + mantissa_odd;
+    return (unsigned short)(bits >> 13);
+}
+
+static float half_to_float(unsigned short half)
+{
+    unsigned int sign = (unsigned int)(half & 0x8000) << 16;
+    unsigned int exponent = (half >> 10) & 0x1f;
+    unsigned int mantissa = half & 0x3ff;
+
+    if (exponent == 0)
+    {
+        float value = mantissa * (1.f / 16777216.f);
+        return sign ? -value : value;
+    }
+    if (exponent == 0x1f)
+        return bits_float(sign | 0x7f800000 | (mantissa << 13));
+    return bits_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+static unsigned int rgb9e5_encode(vec3 color)
+{
+    float r = clamp_component(color.x, RGB9E5_MAX);
+    float g = clamp_component(color.y, RGB9E5_MAX);
+    float b = clamp_component(color.z, RGB9E5_MAX);
+    float max = MAX(r, MAX(g, b));
+
+    // floor(log2(max)), -127 for 0 and denormals
+    int exponent = (int)(float_bits(max) >> 23) - 127;
+    int shared = MAX(exponent, -16);
+    shared += 16;
+
+    float scale = bits_float((unsigned int)(151 - shared) << 23);
+    if ((unsigned int)(max * scale + 0.5f) == 512)
+    {
+        ++shared;
+        scale = bits_float((unsigned int)(151 - shared) << 23);
+    }
+
+    return (unsigned int)(r * scale + 0.5f) | (unsigned int)(g * scale + 0.5f) << 9 |
+           (unsigned int)(b * scale + 0.5f) << 18 | (unsigned int)shared << 27;
+}
+
+static vec3 rgb9e5_decode(unsigned int pixel)
+{
+    float scale = bits_float(((pixel >> 27) + 103) << 23);
+    return vector_create((pixel & 0x1ff) * scale, ((pixel >> 9) & 0x1ff) * scale, ((pixel >> 18) & 0x1ff) * scale);
+}
+
+// Byte order r, g, b, e as in Radiance .hdr files. Colors below 2^-106 (about 1e-32) are stored as 0.
+static void rgbe_encode(vec3 color, unsigned char *pixel)
+{
+    float r = clamp_component(color.x, RGBE_MAX);
+    float g = clamp_component(color.y, RGBE_MAX);
+    float b = clamp_component(color.z, RGBE_MAX);
+    float max = MAX(r, MAX(g, b));
+
+    unsigned int exponent = float_bits(max) >> 23;
+    if (exponent < 21)
+    {
+        memset(pixel, 0, 4);
+        return;
+    }
+
+    // frexp(max) = m * 2^(exponent - 126), the mantissas are c * 256 / 2^(exponent - 126)
+    float scale = bits_float((261 - exponent) << 23);
+    pixel[0] = (unsigned char)(r * scale);
+    pixel[1] = (unsigned char)(g * scale);
+    pixel[2] = (unsigned char)(b * scale);
+    pixel[3] = (unsigned char)(exponent + 2);
+}
+
+static vec3 rgbe_decode(const unsigned char *pixel)
+{
+    // The encoder never writes exponents below 23, anything under 10 would need a denormal scale
+    if (pixel[3] < 10)
+        return vector_create(0.f, 0.f, 0.f);
+
+    float scale = bits_float((unsigned int)(pixel[3] - 9) << 23);
+    return vector_create((pixel[0] + 0.5f) * scale, (pixel[1] + 0.5f) * scale, (pixel[2] + 0.5f) * scale);
+}
+
+#if PIXEL_FORMAT_X86
+__attribute__((target("avx,f16c"))) static void half_encode_f16c(const float *values, size_t count, unsigned short *half)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 max = _mm256_set1_ps(HALF_MAX);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(values + i), zero), max);
+        _mm_storeu_si128((__m128i *)(half + i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < count; ++i)
+        half[i] = float_to_half(values[i]);
+}
+
+__attribute__((target("avx,f16c"))) static void half_decode_f16c(const unsigned short *half, size_t count, float *values)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(values + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(half + i))));
+    for (; i < count; ++i)
+        values[i] = half_to_float(half[i]);
+}
+
+// SSE2 has no signed 32-bit max
+__attribute__((target("sse2"))) static inline __m128i max_epi32_sse(__m128i a, __m128i b)
+{
+    __m128i greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(greater, a), _mm_andnot_si128(greater, b));
+}
+
+// Four pixels at a time, components are gathered from the vec3 fields so any vec3 layout works
+__attribute__((target("sse2"))) static size_t rgb9e5_encode_sse(const vec3 *colors, size_t count, unsigned int *pixels)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 limit = _mm_set1_ps(RGB9E5_MAX);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i mantissa_max = _mm_set1_epi32(512);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const vec3 *c = colors + i;
+        __m128 r = _mm_min_ps(_mm_max_ps(_mm_setr_ps(c[0].x, c[1].x, c[2].x, c[3].x), zero), limit);
+        __m128 g = _mm_min_ps(_mm_max_ps(_mm_setr_ps(c[0].y, c[1].y, c[2].y, c[3].y), zero), limit);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_setr_ps(c[0].z, c[1].z, c[2].z, c[3].z), zero), limit);
+        __m128 max = _mm_max_ps(r, _mm_max_ps(g, b));
+
+        __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(max), 23), _mm_set1_epi32(127));
+        __m128i shared = _mm_add_epi32(max_epi32_sse(exponent, _mm_set1_epi32(-16)), _mm_set1_epi32(16));
+
+        __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(151), shared), 23));
+        __m128i max_mantissa = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(max, scale), half));
+        // Subtracting the all-ones compare mask adds 1 where the largest mantissa rounded up to 512
+        shared = _mm_sub_epi32(shared, _mm_cmpeq_epi32(max_mantissa, mantissa_max));
+        scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(151), shared), 23));
+
+        __m128i packed = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r, scale), half));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(g, scale), half)), 9));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half)), 18));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(shared, 27));
+        _mm_storeu_si128((__m128i *)(pixels + i), packed);
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) static size_t rgb9e5_decode_sse(const unsigned int *pixels, size_t count, vec3 *colors)
+{
+    const __m128i mask = _mm_set1_epi32(0x1ff);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i packed = _mm_loadu_si128((const __m128i *)(pixels + i));
+        __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_srli_epi32(packed, 27), _mm_set1_epi32(103)), 23));
+
+        float r[4], g[4], b[4];
+        _mm_storeu_ps(r, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(packed, mask)), scale));
+        _mm_storeu_ps(g, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(packed, 9), mask)), scale));
+        _mm_storeu_ps(b, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(packed, 18), mask)), scale));
+        for (int lane = 0; lane < 4; ++lane)
+            colors[i + lane] = vector_create(r[lane], g[lane], b[lane]);
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) static size_t rgbe_encode_sse(const vec3 *colors, size_t count, unsigned char *pixels)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 limit = _mm_set1_ps(RGBE_MAX);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const vec3 *c = colors + i;
+        __m128 r = _mm_min_ps(_mm_max_ps(_mm_setr_ps(c[0].x, c[1].x, c[2].x, c[3].x), zero), limit);
+        __m128 g = _mm_min_ps(_mm_max_ps(_mm_setr_ps(c[0].y, c[1].y, c[2].y, c[3].y), zero), limit);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_setr_ps(c[0].z, c[1].z, c[2].z, c[3].z), zero), limit);
+        __m128 max = _mm_max_ps(r, _mm_max_ps(g, b));
+
+        __m128i exponent = _mm_srli_epi32(_mm_castps_si128(max), 23);
+        __m128i tiny = _mm_cmplt_epi32(exponent, _mm_set1_epi32(21));
+        __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(261), exponent), 23));
+
+        // Little endian, so r lands in the first byte of every pixel
+        __m128i packed = _mm_cvttps_epi32(_mm_mul_ps(r, scale));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(g, scale)), 8));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(b, scale)), 16));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_add_epi32(exponent, _mm_set1_epi32(2)), 24));
+        _mm_storeu_si128((__m128i *)(pixels + 4 * i), _mm_andnot_si128(tiny, packed));
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) static size_t rgbe_decode_sse(const unsigned char *pixels, size_t count, vec3 *colors)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i packed = _mm_loadu_si128((const __m128i *)(pixels + 4 * i));
+        __m128i exponent = _mm_srli_epi32(packed, 24);
+        __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(exponent, _mm_set1_epi32(9)));
+        __m128 scale = _mm_and_ps(valid, _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(exponent, _mm_set1_epi32(9)), 23)));
+
+        float r[4], g[4], b[4];
+        _mm_storeu_ps(r, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_and_si128(packed, mask)), half), scale));
+        _mm_storeu_ps(g, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(packed, 8), mask)), half), scale));
+        _mm_storeu_ps(b, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(packed, 16), mask)), half), scale));
+        for (int lane = 0; lane < 4; ++lane)
+            colors[i + lane] = vector_create(r[lane], g[lane], b[lane]);
+    }
+    return i;
+}
+#endif
+
+// vec3 is three packed floats unless VECTOR_SSE pads it to 16 bytes
+#define VEC3_PACKED (sizeof(vec3) == 3 * sizeof(float))
+
+static void half_encode(const vec3 *colors, size_t count, unsigned short *half)
+{
+#if PIXEL_FORMAT_X86
+    if (VEC3_PACKED && __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx"))
+    {
+        half_encode_f16c((const float *)colors, 3 * count, half);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i)
+    {
+        half[3 * i + 0] = float_to_half(colors[i].x);
+        half[3 * i + 1] = float_to_half(colors[i].y);
+        half[3 * i + 2] = float_to_half(colors[i].z);
+    }
+}
+
+static void half_decode(const unsigned short *half, size_t count, vec3 *colors)
+{
+#if PIXEL_FORMAT_X86
+    if (VEC3_PACKED && __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx"))
+    {
+        half_decode_f16c(half, 3 * count, (float *)colors);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i)
+        colors[i] = vector_create(half_to_float(half[3 * i + 0]), half_to_float(half[3 * i + 1]), half_to_float(half[3 * i + 2]));
+}
+
+int pixel_format_parse(const char *name, pixel_format *format)
+{
+    if (strcmp(name, "float") == 0)
+        *format = PIXEL_FORMAT_FLOAT;
+    else if (strcmp(name, "half") == 0)
+        *format = PIXEL_FORMAT_HALF;
+    else if (strcmp(name, "rgbe") == 0)
+        *format = PIXEL_FORMAT_RGBE;
+    else if (strcmp(name, "rgb9e5") == 0)
+        *format = PIXEL_FORMAT_RGB9E5;
+    else if (strcmp(name, "rgb8") == 0)
+        *format = PIXEL_FORMAT_RGB8;
+    else
+        return -1;
+    return 0;
+}
+
+size_t pixel_format_size(pixel_format format)
+{
+    switch (format)
+    {
+    case PIXEL_FORMAT_FLOAT:
+        return sizeof(vec3);
+    case PIXEL_FORMAT_HALF:
+        return 3 * sizeof(unsigned short);
+    case PIXEL_FORMAT_RGBE:
+    case PIXEL_FORMAT_RGB9E5:
+        return 4;
+    case PIXEL_FORMAT_RGB8:
+        return 3;
+    }
+    return 0;
+}
+
+void pixel_format_encode(pixel_format format, const vec3 *colors, size_t count, void *pixels)
+{
+    size_t i = 0;
+
+    switch (format)
+    {
+    case PIXEL_FORMAT_FLOAT:
+        memcpy(pixels, colors, count * sizeof(vec3));
+        break;
+    case PIXEL_FORMAT_HALF:
+        half_encode(colors, count, (unsigned short *)pixels);
+        break;
+    case PIXEL_FORMAT_RGBE:
+#if PIXEL_FORMAT_X86
+        if (__builtin_cpu_supports("sse2"))
+            i = rgbe_encode_sse(colors, count, (unsigned char *)pixels);
+#endif
+        for (; i < count; ++i)
+            rgbe_encode(colors[i], (unsigned char *)pixels + 4 * i);
+        break;
+    case PIXEL_FORMAT_RGB9E5:
+#if PIXEL_FORMAT_X86
+        if (__builtin_cpu_supports("sse2"))
+            i = rgb9e5_encode_sse(colors, count, (unsigned int *)pixels);
+#endif
+        for (; i < count; ++i)
+            ((unsigned int *)pixels)[i] = rgb9e5_encode(colors[i]);
+        break;
+    case PIXEL_FORMAT_RGB8:
+        image_tonemap(colors, count, (unsigned char *)pixels);
+        break;
+    }
+}
+
+void pixel_format_decode(pixel_format format, const void *pixels, size_t count, vec3 *colors)
+{
+    size_t i = 0;
+    const unsigned char *bytes = (const unsigned char *)pixels;
+
+    switch (format)
+    {
+    case PIXEL_FORMAT_FLOAT:
+        memcpy(colors, pixels, count * sizeof(vec3));
+        break;
+    case PIXEL_FORMAT_HALF:
+        half_decode((const unsigned short *)pixels, count, colors);
+        break;
+    case PIXEL_FORMAT_RGBE:
+#if PIXEL_FORMAT_X86
+        if (__builtin_cpu_supports("sse2"))
+            i = rgbe_decode_sse(bytes, count, colors);
+#endif
+        for (; i < count; ++i)
+            colors[i] = rgbe_decode(bytes + 4 * i);
+        break;
+    case PIXEL_FORMAT_RGB9E5:
+#if PIXEL_FORMAT_X86
+        if (__builtin_cpu_supports("sse2"))
+            i = rgb9e5_decode_sse((const unsigned int *)pixels, count, colors);
+#endif
+        for (; i < count; ++i)
+            colors[i] = rgb9e5_decode(((const unsigned int *)pixels)[i]);
+        break;
+    case PIXEL_FORMAT_RGB8:
+        for (; i < count; ++i)
+            colors[i] = vector_create(bytes[3 * i] / 255.f, bytes[3 * i + 1] / 255.f, bytes[3 * i + 2] / 255.f);
+        break;
+    }
+}
+
+void pixel_format_tonemap(pixel_format format, const void *pixels, size_t count, unsigned char *rgb)
+{
+    if (format == PIXEL_FORMAT_FLOAT)
+    {
+        image_tonemap((const vec3 *)pixels, count, rgb);
+        return;
+    }
+    if (format == PIXEL_FORMAT_RGB8)
+    {
+        memcpy(rgb, pixels, 3 * count);
+        return;
+    }
+
+    // Decoded a chunk at a time so the temporary colors stay in cache
+    size_t size = pixel_format_size(format);
+    vec3 colors[PIXEL_FORMAT_CHUNK];
+    for (size_t i = 0; i < count; i += PIXEL_FORMAT_CHUNK)
+    {
+        size_t len = MIN(PIXEL_FORMAT_CHUNK, count - i);
+        pixel_format_decode(format, (const unsigned char *)pixels + i * size, len, colors);
+        image_tonemap(colors, len, rgb + 3 * i);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef PIXEL_FORMAT_H
+#define PIXEL_FORMAT_H
+#include "vector.h"
+#include "stddef.h"
+
+// How a framebuffer stores one pixel
+typedef enum pixel_format
+{
+    // vec3 as is, 12 bytes (16 with VECTOR_SSE), exact
+    PIXEL_FORMAT_FLOAT,
+    // Three IEEE half floats, 6 bytes, about 3 significant digits up to 65504
+    PIXEL_FORMAT_HALF,
+    // Radiance RGBE, 8-bit mantissas with a shared exponent, 4 bytes
+    PIXEL_FORMAT_RGBE,
+    // 9-bit mantissas with a shared 5-bit exponent, 4 bytes, covers [0, 65408]
+    PIXEL_FORMAT_RGB9E5,
+    // Tonemapped 8-bit RGB, 3 bytes, the HDR values are gone
+    PIXEL_FORMAT_RGB8,
+} pixel_format;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Parses "float", "half", "rgbe", "rgb9e5" or "rgb8"
+    /// @return 0 on success, -1 if the name is unknown
+    int pixel_format_parse(const char *name, pixel_format *format);
+
+    /// @brief Bytes per pixel, pixels are packed without padding
+    size_t pixel_format_size(pixel_format format);
+
+    /// @brief Converts colors to the format, negative and NaN components become 0
+    ///
+    /// Components above the largest value of the format are clamped to it. RGB8 is tonemapped with
+    /// image_tonemap. Uses SSE2 and F16C when the CPU has them, the result is the same either way.
+    void pixel_format_encode(pixel_format format, const vec3 *colors, size_t count, void *pixels);
+
+    /// @brief Converts pixels back to colors, RGB8 pixels come back in [0, 1]
+    void pixel_format_decode(pixel_format format, const void *pixels, size_t count, vec3 *colors);
+
+    /// @brief Converts pixels to 8-bit RGB the way image_tonemap converts colors, RGB8 pixels are copied
+    void pixel_format_tonemap(pixel_format format, const void *pixels, size_t count, unsigned char *rgb);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,12 @@
 #include "render.h"
+#include "bvh.h"
+#include "sphere_soa.h"
+#include "stats.h"
 #include "math.h"
 #include "float.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "string.h"
 
 sphere sphere_create(vec3 center, float radius, material mat)
 {
@@ -28,6 +34,22 @@ material material_create(vec3 color, vec3 albedo, float specular_exponent)
     return mat;
 }
 
+scene scene_create(sphere *spheres, size_t spheres_len, light *lights, size_t lights_len)
+{
+    scene sc;
+    sc.spheres = spheres;
+    sc.spheres_len = spheres_len;
+    sc.lights = lights;
+    sc.lights_len = lights_len;
+    sc.bvh = NULL;
+    sc.soa = NULL;
+    sc.integrator.max_depth = 4;
+    sc.integrator.min_throughput = 0.f;
+    sc.integrator.roulette_depth = 0;
+    sc.occluder_cache = 0;
+    return sc;
+}
+
 vec3 reflect(vec3 I, vec3 N)
 {
     return vector_diff(I,
@@ -38,6 +60,8 @@ vec3 reflect(vec3 I, vec3 N)
 
 int sphere_ray_intersect(sphere s, vec3 orig, vec3 dir, float *dist)
 {
+    RT_STATS_ADD(RT_COUNTER_SPHERE_TESTS, 1);
+
     vec3 diff = vector_diff(s.center, orig);
 
     float tca = vector_scalar_product(diff, dir);
@@ -80,52 +104,210 @@ int scene_intersect(vec3 orig, vec3 dir,
     return spheres_dist < 1000;
 }
 
-vec3 cast_ray(vec3 orig, vec3 dir, vec3 background_color,
-              sphere *spheres, size_t spheres_len,
-              light *lights, size_t lights_len, size_t depth)
+int scene_ray_intersect(const scene *sc, vec3 orig, vec3 dir, vec3 *hit, vec3 *normal, material *material)
 {
-    vec3 point, normal;
-    material mat;
+    if (sc->bvh != NULL)
+        return bvh_intersect(sc->bvh, sc->spheres, orig, dir, hit, normal, material);
 
-    if (depth > 4 || !scene_intersect(orig, dir, spheres, spheres_len, &point, &normal, &mat))
+    if (sc->soa != NULL)
     {
-        return background_color;
+        float spheres_dist;
+        size_t nearest = sphere_soa_intersect(sc->soa, orig, dir, &spheres_dist);
+        if (nearest == SPHERE_SOA_NO_HIT)
+            return 0;
+
+        *hit = vector_addition(orig, vector_multiplication(dir, spheres_dist));
+        *normal = vector_normalize(vector_diff(*hit, sc->spheres[nearest].center));
+        *material = sc->spheres[nearest].mat;
+        return spheres_dist < 1000;
+    }
+
+    return scene_intersect(orig, dir, sc->spheres, sc->spheres_len, hit, normal, material);
+}
+
+int scene_occluded(const scene *sc, vec3 orig, vec3 dir, float tmax, size_t *occluder)
+{
+    // scene_ray_intersect does not report anything past this distance either
+    tmax = MIN(tmax, 1000.f);
+
+    float dist;
+    if (occluder != NULL && *occluder < sc->spheres_len &&
+        sphere_ray_intersect(sc->spheres[*occluder], orig, dir, &dist) && dist < tmax)
+        return 1;
+
+    if (sc->bvh != NULL)
+        return bvh_occluded(sc->bvh, sc->spheres, orig, dir, tmax, occluder);
+
+    if (sc->soa != NULL)
+    {
+        size_t blocker = sphere_soa_occluded(sc->soa, orig, dir, tmax);
+        if (blocker == SPHERE_SOA_NO_HIT)
+            return 0;
+
+        if (occluder != NULL)
+            *occluder = blocker;
+        return 1;
     }
 
-    vec3 reflect_dir = vector_normalize(reflect(dir, normal));
-    vec3 reflect_orig = vector_scalar_product(reflect_dir, normal) < 0.f ? vector_diff(point, vector_multiplication(normal, 1e-3))
-                                                                         : vector_addition(point, vector_multiplication(normal, 1e-3));
-    vec3 reflect_color = cast_ray(reflect_orig, reflect_dir, background_color,
-                                  spheres, spheres_len, lights, lights_len, depth + 1);
+    for (size_t i = 0; i < sc->spheres_len; ++i)
+    {
+        if (sphere_ray_intersect(sc->spheres[i], orig, dir, &dist) && dist < tmax)
+        {
+            if (occluder != NULL)
+                *occluder = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Sphere that last blocked each light, a blocker tends to shadow the neighbouring pixels too
+static __thread size_t last_occluder[RENDER_OCCLUDER_CACHE];
+
+// One bounce of a path: the light gathered at the hit and the weight of everything reflected into it
+typedef struct path_vertex
+{
+    vec3 local_color;
+    float weight;
+} path_vertex;
+
+// Deterministic uniform number in [0, 1) from the bits of the ray, the same ray always gets the same value
+static float path_random(vec3 dir, size_t depth)
+{
+    uint32_t bits[3];
+    memcpy(bits, &dir, sizeof(bits));
+
+    uint32_t h = (uint32_t)depth * 0x9e3779b9u;
+    for (int i = 0; i < 3; ++i)
+    {
+        h ^= bits[i] * 0x85ebca6bu;
+        h = (h << 13) | (h >> 19);
+        h = h * 5u + 0xe6546b64u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return (float)(h >> 8) * (1.f / 16777216.f);
+}
+
+static vec3 offset_origin(vec3 point, vec3 dir, vec3 normal)
+{
+    return vector_scalar_product(dir, normal) < 0.f ? vector_diff(point, vector_multiplication(normal, 1e-3))
+                                                    : vector_addition(point, vector_multiplication(normal, 1e-3));
+}
 
+// Diffuse and specular light from every visible light source
+static vec3 direct_light(vec3 dir, vec3 point, vec3 normal, const material *mat, const scene *sc)
+{
     float diffuse_light_intensity = 0.f, specular_light_intensity = 0.f;
 
-    for (size_t i = 0; i < lights_len; ++i)
+    for (size_t i = 0; i < sc->lights_len; ++i)
     {
-        vec3 light_dir = vector_normalize(vector_diff(lights[i].position, point));
+        vec3 light_dir = vector_normalize(vector_diff(sc->lights[i].position, point));
 
-        float light_distanse = vector_norm(vector_diff(lights[i].position, point));
+        float light_distanse = vector_norm(vector_diff(sc->lights[i].position, point));
 
-        vec3 shadow_orig = vector_scalar_product(light_dir, normal) < 0.f ? vector_diff(point, vector_multiplication(normal, 1e-3))
-                                                                          : vector_addition(point, vector_multiplication(normal, 1e-3));
+        vec3 shadow_orig = offset_origin(point, light_dir, normal);
 
-        vec3 shadow_point, shadow_normal;
-        material tmp;
-        if (scene_intersect(shadow_orig, light_dir, spheres, spheres_len, &shadow_point, &shadow_normal, &tmp) &&
-            vector_norm(vector_diff(shadow_point, shadow_orig)) < light_distanse)
+        RT_STATS_ADD(RT_COUNTER_SHADOW_RAYS, 1);
+        size_t *occluder = sc->occluder_cache && i < RENDER_OCCLUDER_CACHE ? &last_occluder[i] : NULL;
+        if (scene_occluded(sc, shadow_orig, light_dir, light_distanse, occluder))
             continue;
 
         float angle_light_to_normal = vector_scalar_product(light_dir, normal);
-        diffuse_light_intensity += lights[i].intensity * MAX(angle_light_to_normal, 0.f);
+        diffuse_light_intensity += sc->lights[i].intensity * MAX(angle_light_to_normal, 0.f);
         float reflect_angle = vector_scalar_product(reflect(light_dir, normal), dir);
-        specular_light_intensity += powf(MAX(reflect_angle, 0.f), mat.specular_exponent) * lights[i].intensity;
+        specular_light_intensity += powf(MAX(reflect_angle, 0.f), mat->specular_exponent) * sc->lights[i].intensity;
+    }
+
+    return vector_addition(vector_multiplication(
+                               vector_multiplication(mat->diffuse_color, diffuse_light_intensity), mat->albedo.x),
+                           vector_multiplication(
+                               vector_multiplication(vector_create(1., 1., 1.), specular_light_intensity),
+                               mat->albedo.y));
+}
+
+// Walks the reflection path from a known hit, then folds it back from the last bounce,
+// each color being local_color + weight * (color of the next bounce)
+static vec3 trace_path(vec3 dir, vec3 point, vec3 normal, material mat, vec3 background_color, const scene *sc, size_t depth)
+{
+    const integrator_settings *settings = &sc->integrator;
+    size_t max_depth = MIN(settings->max_depth, RENDER_MAX_DEPTH - 1);
+
+    path_vertex stack[RENDER_MAX_DEPTH];
+    size_t stack_len = 0;
+    float throughput = 1.f;
+    vec3 color = background_color;
+
+    for (;;)
+    {
+        path_vertex *vertex = &stack[stack_len++];
+        vertex->local_color = direct_light(dir, point, normal, &mat, sc);
+        vertex->weight = mat.albedo.z;
+
+        if (depth + 1 > max_depth)
+            break;
+
+        // Nothing the reflection ray finds can show up in the pixel
+        float next_throughput = throughput * vertex->weight;
+        if (!(next_throughput > settings->min_throughput))
+        {
+            color = vector_create(0.f, 0.f, 0.f);
+            break;
+        }
+
+        vec3 reflect_dir = vector_normalize(reflect(dir, normal));
+        vec3 reflect_orig = offset_origin(point, reflect_dir, normal);
+
+        if (settings->roulette_depth && depth + 1 >= settings->roulette_depth)
+        {
+            float survive = MIN(1.f, next_throughput);
+            if (path_random(reflect_dir, depth + 1) >= survive)
+            {
+                color = vector_create(0.f, 0.f, 0.f);
+                break;
+            }
+            vertex->weight /= survive;
+            next_throughput /= survive;
+        }
+
+        RT_STATS_ADD(RT_COUNTER_REFLECTION_RAYS, 1);
+        if (!scene_ray_intersect(sc, reflect_orig, reflect_dir, &point, &normal, &mat))
+            break;
+
+        dir = reflect_dir;
+        throughput = next_throughput;
+        ++depth;
+    }
+
+    while (stack_len)
+    {
+        const path_vertex *vertex = &stack[--stack_len];
+        color = vector_addition(vertex->local_color, vector_multiplication(color, vertex->weight));
+    }
+
+    return color;
+}
+
+vec3 cast_ray(vec3 orig, vec3 dir, vec3 background_color, const scene *sc, size_t depth)
+{
+    vec3 point, normal;
+    material mat;
+
+    RT_STATS_ADD(depth == 0 ? RT_COUNTER_PRIMARY_RAYS : RT_COUNTER_REFLECTION_RAYS, 1);
+    if (depth > sc->integrator.max_depth || !scene_ray_intersect(sc, orig, dir, &point, &normal, &mat))
+    {
+        return background_color;
     }
 
-    return vector_addition(vector_addition(
-                               vector_multiplication(
-                                   vector_multiplication(mat.diffuse_color, diffuse_light_intensity), mat.albedo.x),
-                               vector_multiplication(
-                                   vector_multiplication(vector_create(1., 1., 1.), specular_light_intensity),
-                                   mat.albedo.y)),
-                           vector_multiplication(reflect_color, mat.albedo.z));
+    return trace_path(dir, point, normal, mat, background_color, sc, depth);
+}
+
+vec3 shade_hit(vec3 dir, vec3 point, vec3 normal, material mat, vec3 background_color, const scene *sc, size_t depth)
+{
+    return trace_path(dir, point, normal, mat, background_color, sc, depth);
 }
@@ -26,6 +26,39 @@ typedef struct light
     float intensity;
 } light;
 
+struct bvh;
+struct sphere_soa;
+
+// Size of the bounce stack, deeper settings are clamped to it
+#define RENDER_MAX_DEPTH 16
+
+// Lights past this index are not covered by the per-thread occluder cache
+#define RENDER_OCCLUDER_CACHE 16
+
+typedef struct integrator_settings
+{
+    // Last reflection bounce that is traced, deeper rays see the background
+    size_t max_depth;
+    // A path stops once its throughput is at or below this, 0 only skips bounces that carry no weight
+    float min_throughput;
+    // Russian roulette on reflection rays from this bounce on, 0 disables it
+    size_t roulette_depth;
+} integrator_settings;
+
+typedef struct scene
+{
+    sphere *spheres;
+    size_t spheres_len;
+    light *lights;
+    size_t lights_len;
+    // Optional acceleration structures over spheres, both NULL tests every sphere
+    const struct bvh *bvh;
+    const struct sphere_soa *soa;
+    integrator_settings integrator;
+    // Shadow rays test the sphere that last blocked the same light on this thread first
+    int occluder_cache;
+} scene;
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -40,13 +73,29 @@ extern "C"
 
     material material_create(vec3 color, vec3 albedo, float specular_exponent);
 
+    scene scene_create(sphere *spheres, size_t spheres_len, light *lights, size_t lights_len);
+
     vec3 reflect(vec3 I, vec3 N);
 
     int sphere_ray_intersect(sphere s, vec3 orig, vec3 dir, float *dist);
 
     int scene_intersect(vec3 orig, vec3 dir, sphere *spheres, size_t spheres_len, vec3 *hit, vec3 *normal, material *material);
 
-    vec3 cast_ray(vec3 orig, vec3 dir, vec3 background_color, sphere *spheres, size_t spheres_len, light *lights, size_t lights_len, size_t depth);
+    int scene_ray_intersect(const scene *sc, vec3 orig, vec3 dir, vec3 *hit, vec3 *normal, material *material);
+
+    /// @brief Checks whether any sphere blocks the ray closer than tmax, without building a hit record
+    ///
+    /// @param occluder optional, on input a sphere index to test first (out of range values are
+    /// ignored), on output the index of the blocker when one is found
+    ///
+    /// @return 1 as soon as a blocker is found, 0 otherwise
+    int scene_occluded(const scene *sc, vec3 orig, vec3 dir, float tmax, size_t *occluder);
+
+    // Follows the reflection path iteratively and folds the colors back from its last bounce
+    vec3 cast_ray(vec3 orig, vec3 dir, vec3 background_color, const scene *sc, size_t depth);
+
+    // Shading of a hit found by scene_ray_intersect, traces the reflection path and shadow rays
+    vec3 shade_hit(vec3 dir, vec3 point, vec3 normal, material mat, vec3 background_color, const scene *sc, size_t depth);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,281 @@
+#include "scene_file.h"
+#include "text_reader.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SCENE_FILE_BYTE_ORDER 0x01020304u
+#define SCENE_FILE_NAME_MAX 64
+
+typedef struct named_material
+{
+    char name[SCENE_FILE_NAME_MAX];
+    material mat;
+} named_material;
+
+static void scene_file_init(scene_file *file)
+{
+    file->spheres = NULL;
+    file->spheres_len = 0;
+    file->lights = NULL;
+    file->lights_len = 0;
+    file->tree.nodes = NULL;
+    file->tree.nodes_len = 0;
+    file->tree.indices = NULL;
+    file->tree.indices_len = 0;
+    file->has_bvh = 0;
+    file->mapping = NULL;
+    file->mapping_size = 0;
+    file->error_line = 0;
+}
+
+static int load_text(scene_file *file, FILE *in)
+{
+    named_material *materials = NULL;
+    size_t materials_len = 0, materials_capacity = 0;
+    size_t spheres_capacity = 0, lights_capacity = 0;
+
+    text_statement statement;
+    statement.line_number = 0;
+    int result = 0;
+
+    while (result == 0 && text_reader_next(in, &statement))
+    {
+        const char *keyword = statement.keyword;
+        const char *args = statement.args;
+        int consumed = 0;
+
+        if (strcmp(keyword, "material") == 0)
+        {
+            named_material m;
+            vec3 color, albedo;
+            float specular;
+            named_material *grown = NULL;
+            if (sscanf(args, "%63s %f %f %f %f %f %f %f%n", m.name, &color.x, &color.y, &color.z,
+                       &albedo.x, &albedo.y, &albedo.z, &specular, &consumed) != 8 ||
+                !text_reader_at_end(args + consumed) ||
+                (grown = (named_material *)text_reader_grow(materials, &materials_capacity, materials_len, sizeof(named_material))) == NULL)
+            {
+                result = -1;
+                break;
+            }
+            materials = grown;
+            m.mat = material_create(vector_create(color.x, color.y, color.z), vector_create(albedo.x, albedo.y, albedo.z), specular);
+            materials[materials_len++] = m;
+        }
+        else if (strcmp(keyword, "sphere") == 0)
+        {
+            vec3 center;
+            float radius;
+            char name[SCENE_FILE_NAME_MAX];
+            if (sscanf(args, "%f %f %f %f %63s%n", &center.x, &center.y, &center.z, &radius, name, &consumed) != 5 ||
+                !text_reader_at_end(args + consumed))
+            {
+                result = -1;
+                break;
+            }
+
+            // Later definitions of a name win, so search from the back
+            const named_material *found = NULL;
+            for (size_t i = materials_len; i-- > 0 && found == NULL;)
+            {
+                if (strcmp(materials[i].name, name) == 0)
+                    found = &materials[i];
+            }
+
+            sphere *spheres = found != NULL ? (sphere *)text_reader_grow(file->spheres, &spheres_capacity, file->spheres_len, sizeof(sphere)) : NULL;
+            if (spheres == NULL)
+            {
+                result = -1;
+                break;
+            }
+            file->spheres = spheres;
+            file->spheres[file->spheres_len++] = sphere_create(vector_create(center.x, center.y, center.z), radius, found->mat);
+        }
+        else if (strcmp(keyword, "light") == 0)
+        {
+            vec3 position;
+            float intensity;
+            light *lights = NULL;
+            if (sscanf(args, "%f %f %f %f%n", &position.x, &position.y, &position.z, &intensity, &consumed) != 4 ||
+                !text_reader_at_end(args + consumed) ||
+                (lights = (light *)text_reader_grow(file->lights, &lights_capacity, file->lights_len, sizeof(light))) == NULL)
+            {
+                result = -1;
+                break;
+            }
+            file->lights = lights;
+            file->lights[file->lights_len++] = light_create(vector_create(position.x, position.y, position.z), intensity);
+        }
+        else
+        {
+            result = -1;
+        }
+    }
+
+    if (result != 0)
+        file->error_line = statement.line_number;
+
+    free(materials);
+    return result;
+}
+
+static int range_ok(unsigned long long offset, unsigned long long len, size_t item_size, size_t file_size)
+{
+    if (offset % SCENE_FILE_ALIGNMENT != 0 || offset > file_size)
+        return 0;
+    return len <= (file_size - offset) / item_size;
+}
+
+// Node contents are not checked, walking them would touch every page; binary files are trusted
+static int map_binary(scene_file *file, int fd, size_t size)
+{
+    // Private so the arrays stay writable, pages are only copied once a process writes to them
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    const scene_file_header *header = (const scene_file_header *)mapping;
+    if (header->version != SCENE_FILE_VERSION || header->byte_order != SCENE_FILE_BYTE_ORDER ||
+        header->sphere_size != sizeof(sphere) || header->light_size != sizeof(light) ||
+        header->node_size != sizeof(bvh_node) ||
+        !range_ok(header->spheres_offset, header->spheres_len, sizeof(sphere), size) ||
+        !range_ok(header->lights_offset, header->lights_len, sizeof(light), size) ||
+        !range_ok(header->nodes_offset, header->nodes_len, sizeof(bvh_node), size) ||
+        !range_ok(header->indices_offset, header->indices_len, sizeof(unsigned int), size) ||
+        (header->nodes_len && (header->indices_len != header->spheres_len || header->nodes_len > (header->spheres_len ? 2 * header->spheres_len - 1 : 1))))
+    {
+        munmap(mapping, size);
+        return -1;
+    }
+
+    unsigned char *base = (unsigned char *)mapping;
+    file->mapping = mapping;
+    file->mapping_size = size;
+    file->spheres = (sphere *)(base + header->spheres_offset);
+    file->spheres_len = header->spheres_len;
+    file->lights = (light *)(base + header->lights_offset);
+    file->lights_len = header->lights_len;
+
+    if (header->nodes_len)
+    {
+        file->tree.nodes = (bvh_node *)(base + header->nodes_offset);
+        file->tree.nodes_len = header->nodes_len;
+        file->tree.indices = (unsigned int *)(base + header->indices_offset);
+        file->tree.indices_len = header->indices_len;
+        file->has_bvh = 1;
+    }
+    return 0;
+}
+
+int scene_file_load(scene_file *file, const char *path)
+{
+    scene_file_init(file);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    char magic[sizeof(SCENE_FILE_MAGIC)];
+    int binary = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(scene_file_header) &&
+                 pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+                 memcmp(magic, SCENE_FILE_MAGIC, sizeof(magic)) == 0;
+
+    if (binary)
+    {
+        int result = map_binary(file, fd, (size_t)st.st_size);
+        close(fd);
+        return result;
+    }
+
+    FILE *in = fdopen(fd, "r");
+    if (in == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    int result = load_text(file, in);
+    fclose(in);
+    if (result != 0)
+    {
+        size_t error_line = file->error_line;
+        scene_file_close(file);
+        file->error_line = error_line;
+        return -1;
+    }
+    return 0;
+}
+
+static int write_array(FILE *out, const void *data, size_t size, unsigned long long offset)
+{
+    static const unsigned char zeros[SCENE_FILE_ALIGNMENT] = {0};
+
+    long position = ftell(out);
+    if (position < 0 || (unsigned long long)position > offset ||
+        fwrite(zeros, 1, offset - position, out) != offset - position)
+        return -1;
+    return size == 0 || fwrite(data, 1, size, out) == size ? 0 : -1;
+}
+
+static unsigned long long align_offset(unsigned long long offset)
+{
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+int scene_file_write_binary(const char *path, const sphere *spheres, size_t spheres_len,
+                            const light *lights, size_t lights_len, const bvh *tree)
+{
+    scene_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC));
+    header.version = SCENE_FILE_VERSION;
+    header.byte_order = SCENE_FILE_BYTE_ORDER;
+    header.sphere_size = sizeof(sphere);
+    header.light_size = sizeof(light);
+    header.node_size = sizeof(bvh_node);
+
+    header.spheres_offset = align_offset(sizeof(header));
+    header.spheres_len = spheres_len;
+    header.lights_offset = align_offset(header.spheres_offset + spheres_len * sizeof(sphere));
+    header.lights_len = lights_len;
+    header.nodes_offset = align_offset(header.lights_offset + lights_len * sizeof(light));
+    header.nodes_len = tree != NULL ? tree->nodes_len : 0;
+    header.indices_offset = align_offset(header.nodes_offset + header.nodes_len * sizeof(bvh_node));
+    header.indices_len = tree != NULL ? tree->indices_len : 0;
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+        return -1;
+
+    int result = 0;
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        write_array(out, spheres, spheres_len * sizeof(sphere), header.spheres_offset) != 0 ||
+        write_array(out, lights, lights_len * sizeof(light), header.lights_offset) != 0 ||
+        (tree != NULL && write_array(out, tree->nodes, tree->nodes_len * sizeof(bvh_node), header.nodes_offset) != 0) ||
+        (tree != NULL && write_array(out, tree->indices, tree->indices_len * sizeof(unsigned int), header.indices_offset) != 0))
+        result = -1;
+
+    if (fclose(out) != 0)
+        result = -1;
+    return result;
+}
+
+void scene_file_close(scene_file *file)
+{
+    if (file->mapping != NULL)
+    {
+        munmap(file->mapping, file->mapping_size);
+    }
+    else
+    {
+        free(file->spheres);
+        free(file->lights);
+    }
+    scene_file_init(file);
+}
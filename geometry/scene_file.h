@@ -0,0 +1,79 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+#include "render.h"
+#include "bvh.h"
+
+#define SCENE_FILE_MAGIC "RTSCENE"
+#define SCENE_FILE_VERSION 1
+// Every array in a binary file starts on this boundary
+#define SCENE_FILE_ALIGNMENT 64
+
+// Binary layout: this header, then the arrays at the given offsets. Arrays are stored exactly as
+// they are in memory, so a file only opens in a build with the same struct sizes and byte order.
+typedef struct scene_file_header
+{
+    char magic[8];
+    unsigned int version;
+    // 0x01020304 as written by the producing machine
+    unsigned int byte_order;
+    unsigned int sphere_size;
+    unsigned int light_size;
+    unsigned int node_size;
+    unsigned int reserved;
+    unsigned long long spheres_offset;
+    unsigned long long spheres_len;
+    unsigned long long lights_offset;
+    unsigned long long lights_len;
+    // Optional prebuilt BVH, nodes_len is 0 without one
+    unsigned long long nodes_offset;
+    unsigned long long nodes_len;
+    unsigned long long indices_offset;
+    unsigned long long indices_len;
+} scene_file_header;
+
+typedef struct scene_file
+{
+    sphere *spheres;
+    size_t spheres_len;
+    light *lights;
+    size_t lights_len;
+    // Points into the mapping when the binary file carries a BVH, never pass it to bvh_destroy
+    bvh tree;
+    int has_bvh;
+
+    // Binary files: the private mapping the arrays live in, NULL for text files
+    void *mapping;
+    size_t mapping_size;
+    // Text files: line of the first error, 0 if the file could not be read at all
+    size_t error_line;
+} scene_file;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Loads a scene, binary files are recognized by their magic, anything else is parsed as text
+    ///
+    /// The text format has one statement per line, # starts a comment:
+    ///     material <name> <r> <g> <b> <albedo x> <albedo y> <albedo z> <specular exponent>
+    ///     sphere <x> <y> <z> <radius> <material name>
+    ///     light <x> <y> <z> <intensity>
+    ///
+    /// Binary files are mapped copy-on-write and used in place. Nothing is parsed or copied, pages
+    /// are read on first touch and shared by every process mapping the same file.
+    ///
+    /// @return 0 on success, -1 otherwise
+    int scene_file_load(scene_file *file, const char *path);
+
+    /// @brief Writes spheres, lights and optionally a BVH built over them as a binary scene
+    /// @param tree BVH to store, NULL stores none
+    /// @return 0 on success, -1 otherwise
+    int scene_file_write_binary(const char *path, const sphere *spheres, size_t spheres_len,
+                                const light *lights, size_t lights_len, const bvh *tree);
+
+    void scene_file_close(scene_file *file);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
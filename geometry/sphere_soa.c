@@ -0,0 +1,356 @@
+#include "sphere_soa.h"
+#include "stats.h"
+#include "math.h"
+#include "float.h"
+#include "stdlib.h"
+#include "string.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPHERE_SOA_X86 1
+#include <immintrin.h>
+#else
+#define SPHERE_SOA_X86 0
+#endif
+
+// The kernels mirror sphere_ray_intersect operation by operation (no FMA), so every
+// variant returns bit-identical distances and the same nearest sphere on ties.
+
+static size_t sphere_soa_intersect_scalar(const sphere_soa *soa, vec3 orig, vec3 dir, float *dist)
+{
+    float spheres_dist = FLT_MAX;
+    size_t nearest = SPHERE_SOA_NO_HIT;
+
+    for (size_t i = 0; i < soa->len; ++i)
+    {
+        float dx = soa->center_x[i] - orig.x;
+        float dy = soa->center_y[i] - orig.y;
+        float dz = soa->center_z[i] - orig.z;
+
+        float tca = dx * dir.x + dy * dir.y + dz * dir.z;
+        float d2 = (dx * dx + dy * dy + dz * dz) - (tca * tca);
+
+        if (d2 > soa->radius2[i])
+            continue;
+
+        float thc = sqrtf(soa->radius2[i] - d2);
+        float dist_i = tca - thc;
+
+        if (dist_i < 0)
+            dist_i = tca + thc;
+
+        if (dist_i < 0)
+            continue;
+
+        if (dist_i < spheres_dist)
+        {
+            spheres_dist = dist_i;
+            nearest = i;
+        }
+    }
+
+    *dist = spheres_dist;
+    return nearest;
+}
+
+static size_t sphere_soa_occluded_scalar(const sphere_soa *soa, vec3 orig, vec3 dir, float tmax)
+{
+    for (size_t i = 0; i < soa->len; ++i)
+    {
+        float dx = soa->center_x[i] - orig.x;
+        float dy = soa->center_y[i] - orig.y;
+        float dz = soa->center_z[i] - orig.z;
+
+        float tca = dx * dir.x + dy * dir.y + dz * dir.z;
+        float d2 = (dx * dx + dy * dy + dz * dz) - (tca * tca);
+
+        if (d2 > soa->radius2[i])
+            continue;
+
+        float thc = sqrtf(soa->radius2[i] - d2);
+        float dist_i = tca - thc;
+
+        if (dist_i < 0)
+            dist_i = tca + thc;
+
+        if (dist_i >= 0 && dist_i < tmax)
+            return i;
+    }
+
+    return SPHERE_SOA_NO_HIT;
+}
+
+#if SPHERE_SOA_X86
+// Picks the nearest lane, the lowest sphere index wins on equal distances
+static size_t sphere_soa_reduce(const float *lane_dist, const int *lane_idx, size_t lanes, float *dist)
+{
+    float spheres_dist = FLT_MAX;
+    size_t nearest = SPHERE_SOA_NO_HIT;
+
+    for (size_t l = 0; l < lanes; ++l)
+    {
+        if (lane_idx[l] < 0)
+            continue;
+
+        if (lane_dist[l] < spheres_dist || (lane_dist[l] == spheres_dist && (size_t)lane_idx[l] < nearest))
+        {
+            spheres_dist = lane_dist[l];
+            nearest = (size_t)lane_idx[l];
+        }
+    }
+
+    *dist = spheres_dist;
+    return nearest;
+}
+
+__attribute__((target("sse2"))) static size_t sphere_soa_intersect_sse(const sphere_soa *soa, vec3 orig, vec3 dir, float *dist)
+{
+    const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+    const __m128 rx = _mm_set1_ps(dir.x), ry = _mm_set1_ps(dir.y), rz = _mm_set1_ps(dir.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i step = _mm_set1_epi32(4);
+
+    __m128 best = _mm_set1_ps(FLT_MAX);
+    __m128i best_idx = _mm_set1_epi32(-1);
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+
+    for (size_t i = 0; i < soa->capacity; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_load_ps(soa->center_x + i), ox);
+        __m128 dy = _mm_sub_ps(_mm_load_ps(soa->center_y + i), oy);
+        __m128 dz = _mm_sub_ps(_mm_load_ps(soa->center_z + i), oz);
+        __m128 r2 = _mm_load_ps(soa->radius2 + i);
+
+        __m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, rx), _mm_mul_ps(dy, ry)), _mm_mul_ps(dz, rz));
+        __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 d2 = _mm_sub_ps(len2, _mm_mul_ps(tca, tca));
+
+        __m128 thc = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+        __m128 t0 = _mm_sub_ps(tca, thc);
+        __m128 t1 = _mm_add_ps(tca, thc);
+        __m128 use_far = _mm_cmplt_ps(t0, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(use_far, t1), _mm_andnot_ps(use_far, t0));
+
+        __m128 miss = _mm_or_ps(_mm_cmpgt_ps(d2, r2), _mm_cmplt_ps(t, zero));
+        __m128 hit = _mm_andnot_ps(miss, _mm_cmplt_ps(t, best));
+        __m128i hit_i = _mm_castps_si128(hit);
+
+        best = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, best));
+        best_idx = _mm_or_si128(_mm_and_si128(hit_i, idx), _mm_andnot_si128(hit_i, best_idx));
+        idx = _mm_add_epi32(idx, step);
+    }
+
+    float lane_dist[4];
+    int lane_idx[4];
+    _mm_storeu_ps(lane_dist, best);
+    _mm_storeu_si128((__m128i *)lane_idx, best_idx);
+    return sphere_soa_reduce(lane_dist, lane_idx, 4, dist);
+}
+
+__attribute__((target("sse2"))) static size_t sphere_soa_occluded_sse(const sphere_soa *soa, vec3 orig, vec3 dir, float tmax)
+{
+    const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+    const __m128 rx = _mm_set1_ps(dir.x), ry = _mm_set1_ps(dir.y), rz = _mm_set1_ps(dir.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 limit = _mm_set1_ps(tmax);
+
+    for (size_t i = 0; i < soa->capacity; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_load_ps(soa->center_x + i), ox);
+        __m128 dy = _mm_sub_ps(_mm_load_ps(soa->center_y + i), oy);
+        __m128 dz = _mm_sub_ps(_mm_load_ps(soa->center_z + i), oz);
+        __m128 r2 = _mm_load_ps(soa->radius2 + i);
+
+        __m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, rx), _mm_mul_ps(dy, ry)), _mm_mul_ps(dz, rz));
+        __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 d2 = _mm_sub_ps(len2, _mm_mul_ps(tca, tca));
+
+        __m128 thc = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+        __m128 t0 = _mm_sub_ps(tca, thc);
+        __m128 t1 = _mm_add_ps(tca, thc);
+        __m128 use_far = _mm_cmplt_ps(t0, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(use_far, t1), _mm_andnot_ps(use_far, t0));
+
+        __m128 miss = _mm_or_ps(_mm_cmpgt_ps(d2, r2), _mm_cmplt_ps(t, zero));
+        int mask = _mm_movemask_ps(_mm_andnot_ps(miss, _mm_cmplt_ps(t, limit)));
+        if (mask)
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+
+    return SPHERE_SOA_NO_HIT;
+}
+
+__attribute__((target("avx2"))) static size_t sphere_soa_intersect_avx2(const sphere_soa *soa, vec3 orig, vec3 dir, float *dist)
+{
+    const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+    const __m256 rx = _mm256_set1_ps(dir.x), ry = _mm256_set1_ps(dir.y), rz = _mm256_set1_ps(dir.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256i step = _mm256_set1_epi32(8);
+
+    __m256 best = _mm256_set1_ps(FLT_MAX);
+    __m256i best_idx = _mm256_set1_epi32(-1);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (size_t i = 0; i < soa->capacity; i += 8)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_load_ps(soa->center_x + i), ox);
+        __m256 dy = _mm256_sub_ps(_mm256_load_ps(soa->center_y + i), oy);
+        __m256 dz = _mm256_sub_ps(_mm256_load_ps(soa->center_z + i), oz);
+        __m256 r2 = _mm256_load_ps(soa->radius2 + i);
+
+        __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, rx), _mm256_mul_ps(dy, ry)), _mm256_mul_ps(dz, rz));
+        __m256 len2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        __m256 d2 = _mm256_sub_ps(len2, _mm256_mul_ps(tca, tca));
+
+        __m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+        __m256 t0 = _mm256_sub_ps(tca, thc);
+        __m256 t1 = _mm256_add_ps(tca, thc);
+        __m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+
+        __m256 miss = _mm256_or_ps(_mm256_cmp_ps(d2, r2, _CMP_GT_OQ), _mm256_cmp_ps(t, zero, _CMP_LT_OQ));
+        __m256 hit = _mm256_andnot_ps(miss, _mm256_cmp_ps(t, best, _CMP_LT_OQ));
+
+        best = _mm256_blendv_ps(best, t, hit);
+        best_idx = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_idx), _mm256_castsi256_ps(idx), hit));
+        idx = _mm256_add_epi32(idx, step);
+    }
+
+    float lane_dist[8];
+    int lane_idx[8];
+    _mm256_storeu_ps(lane_dist, best);
+    _mm256_storeu_si256((__m256i *)lane_idx, best_idx);
+    return sphere_soa_reduce(lane_dist, lane_idx, 8, dist);
+}
+
+__attribute__((target("avx2"))) static size_t sphere_soa_occluded_avx2(const sphere_soa *soa, vec3 orig, vec3 dir, float tmax)
+{
+    const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+    const __m256 rx = _mm256_set1_ps(dir.x), ry = _mm256_set1_ps(dir.y), rz = _mm256_set1_ps(dir.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 limit = _mm256_set1_ps(tmax);
+
+    for (size_t i = 0; i < soa->capacity; i += 8)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_load_ps(soa->center_x + i), ox);
+        __m256 dy = _mm256_sub_ps(_mm256_load_ps(soa->center_y + i), oy);
+        __m256 dz = _mm256_sub_ps(_mm256_load_ps(soa->center_z + i), oz);
+        __m256 r2 = _mm256_load_ps(soa->radius2 + i);
+
+        __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, rx), _mm256_mul_ps(dy, ry)), _mm256_mul_ps(dz, rz));
+        __m256 len2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        __m256 d2 = _mm256_sub_ps(len2, _mm256_mul_ps(tca, tca));
+
+        __m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+        __m256 t0 = _mm256_sub_ps(tca, thc);
+        __m256 t1 = _mm256_add_ps(tca, thc);
+        __m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+
+        __m256 miss = _mm256_or_ps(_mm256_cmp_ps(d2, r2, _CMP_GT_OQ), _mm256_cmp_ps(t, zero, _CMP_LT_OQ));
+        int mask = _mm256_movemask_ps(_mm256_andnot_ps(miss, _mm256_cmp_ps(t, limit, _CMP_LT_OQ)));
+        if (mask)
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+
+    return SPHERE_SOA_NO_HIT;
+}
+#endif
+
+int sphere_soa_set_kernel(sphere_soa *soa, const char *name)
+{
+    if (strcmp(name, "scalar") == 0)
+    {
+        soa->kernel = sphere_soa_intersect_scalar;
+        soa->occluded_kernel = sphere_soa_occluded_scalar;
+        soa->kernel_name = "scalar";
+        return 0;
+    }
+#if SPHERE_SOA_X86
+    if (strcmp(name, "sse") == 0 && __builtin_cpu_supports("sse2"))
+    {
+        soa->kernel = sphere_soa_intersect_sse;
+        soa->occluded_kernel = sphere_soa_occluded_sse;
+        soa->kernel_name = "sse";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        soa->kernel = sphere_soa_intersect_avx2;
+        soa->occluded_kernel = sphere_soa_occluded_avx2;
+        soa->kernel_name = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+void sphere_soa_update(sphere_soa *soa, const sphere *spheres)
+{
+    for (size_t i = 0; i < soa->len; ++i)
+    {
+        soa->center_x[i] = spheres[i].center.x;
+        soa->center_y[i] = spheres[i].center.y;
+        soa->center_z[i] = spheres[i].center.z;
+        soa->radius2[i] = spheres[i].radius * spheres[i].radius;
+    }
+}
+
+sphere_soa *sphere_soa_create(const sphere *spheres, size_t spheres_len)
+{
+    sphere_soa *soa = (sphere_soa *)malloc(sizeof(sphere_soa));
+    if (soa == NULL)
+        return NULL;
+
+    soa->len = spheres_len;
+    soa->capacity = (spheres_len + SPHERE_SOA_WIDTH - 1) / SPHERE_SOA_WIDTH * SPHERE_SOA_WIDTH;
+    if (soa->capacity == 0)
+        soa->capacity = SPHERE_SOA_WIDTH;
+
+    // One block for all four arrays, each one starts on an aligned boundary since capacity is a multiple of 8 floats
+    float *data = (float *)aligned_alloc(SPHERE_SOA_ALIGNMENT, 4 * soa->capacity * sizeof(float));
+    if (data == NULL)
+    {
+        free(soa);
+        return NULL;
+    }
+
+    soa->center_x = data;
+    soa->center_y = data + soa->capacity;
+    soa->center_z = data + 2 * soa->capacity;
+    soa->radius2 = data + 3 * soa->capacity;
+
+    sphere_soa_update(soa, spheres);
+    for (size_t i = spheres_len; i < soa->capacity; ++i)
+    {
+        soa->center_x[i] = 0.f;
+        soa->center_y[i] = 0.f;
+        soa->center_z[i] = 0.f;
+        soa->radius2[i] = -FLT_MAX;
+    }
+
+    if (sphere_soa_set_kernel(soa, "avx2") != 0 && sphere_soa_set_kernel(soa, "sse") != 0)
+        sphere_soa_set_kernel(soa, "scalar");
+
+    return soa;
+}
+
+void sphere_soa_destroy(sphere_soa *soa)
+{
+    if (soa == NULL)
+        return;
+
+    free(soa->center_x);
+    free(soa);
+}
+
+size_t sphere_soa_intersect(const sphere_soa *soa, vec3 orig, vec3 dir, float *dist)
+{
+    RT_STATS_ADD(RT_COUNTER_SPHERE_TESTS, soa->len);
+    return soa->kernel(soa, orig, dir, dist);
+}
+
+size_t sphere_soa_occluded(const sphere_soa *soa, vec3 orig, vec3 dir, float tmax)
+{
+    size_t blocker = soa->occluded_kernel(soa, orig, dir, tmax);
+    // The kernels stop at the block holding the blocker, counting up to it is close enough
+    RT_STATS_ADD(RT_COUNTER_SPHERE_TESTS, blocker == SPHERE_SOA_NO_HIT ? soa->len : blocker + 1);
+    return blocker;
+}
@@ -0,0 +1,61 @@
+#ifndef SPHERE_SOA_H
+#define SPHERE_SOA_H
+#include "render.h"
+
+// Arrays are padded to a multiple of the widest kernel, padded lanes never report a hit
+#define SPHERE_SOA_WIDTH 8
+#define SPHERE_SOA_ALIGNMENT 32
+#define SPHERE_SOA_NO_HIT ((size_t)-1)
+
+struct sphere_soa;
+
+typedef size_t (*sphere_soa_kernel_fn)(const struct sphere_soa *soa, vec3 orig, vec3 dir, float *dist);
+typedef size_t (*sphere_soa_occluded_fn)(const struct sphere_soa *soa, vec3 orig, vec3 dir, float tmax);
+
+typedef struct sphere_soa
+{
+    float *center_x;
+    float *center_y;
+    float *center_z;
+    float *radius2;
+    size_t len;
+    size_t capacity;
+    // Chosen once at creation from the features of the running CPU
+    sphere_soa_kernel_fn kernel;
+    sphere_soa_occluded_fn occluded_kernel;
+    const char *kernel_name;
+} sphere_soa;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Copies the geometry of the spheres into aligned structure-of-arrays storage
+    ///
+    /// @param spheres array of spheres, materials stay in the original array
+    /// @param spheres_len number of spheres
+    ///
+    /// @return Returns a pointer to the storage. If an error occurred during creation, it returns NULL
+    sphere_soa *sphere_soa_create(const sphere *spheres, size_t spheres_len);
+
+    void sphere_soa_destroy(sphere_soa *soa);
+
+    /// @brief Copies moved or resized spheres into the arrays, spheres_len must match the one given at creation
+    void sphere_soa_update(sphere_soa *soa, const sphere *spheres);
+
+    /// @brief Forces a specific kernel: "scalar", "sse" or "avx2"
+    /// @return 0 on success, -1 if the kernel is unknown or not supported by this CPU
+    int sphere_soa_set_kernel(sphere_soa *soa, const char *name);
+
+    /// @brief Tests the ray against every sphere
+    /// @return index of the nearest sphere hit, SPHERE_SOA_NO_HIT otherwise
+    size_t sphere_soa_intersect(const sphere_soa *soa, vec3 orig, vec3 dir, float *dist);
+
+    /// @brief Stops at the first sphere hit closer than tmax
+    /// @return index of that sphere, SPHERE_SOA_NO_HIT if nothing blocks the ray
+    size_t sphere_soa_occluded(const sphere_soa *soa, vec3 orig, vec3 dir, float tmax);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,225 @@
+#include "stats.h"
+#include "stdlib.h"
+#include "string.h"
+#include <pthread.h>
+#include <time.h>
+
+#define RT_STATS_MAX_THREADS 256
+#define RT_STATS_MAX_CATEGORIES 8
+
+__thread rt_stats_thread *rt_stats_current = NULL;
+
+// Slots outlive their threads, so totals can be read after a pool is destroyed
+static rt_stats_thread *threads[RT_STATS_MAX_THREADS];
+static size_t threads_len = 0;
+static pthread_mutex_t threads_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Threads past RT_STATS_MAX_THREADS share this slot, their counts are approximate
+static rt_stats_thread overflow;
+
+static const char *const counter_names[RT_COUNTER_COUNT] = {
+    "primary rays",
+    "reflection rays",
+    "shadow rays",
+    "sphere tests",
+    "node tests",
+};
+
+rt_stats_thread *rt_stats_register(void)
+{
+    rt_stats_thread *slot = (rt_stats_thread *)aligned_alloc(64, sizeof(rt_stats_thread));
+
+    pthread_mutex_lock(&threads_mtx);
+    if (slot == NULL || threads_len == RT_STATS_MAX_THREADS)
+    {
+        free(slot);
+        slot = &overflow;
+    }
+    else
+    {
+        memset(slot, 0, sizeof(rt_stats_thread));
+        slot->index = threads_len;
+        threads[threads_len++] = slot;
+    }
+    pthread_mutex_unlock(&threads_mtx);
+
+    rt_stats_current = slot;
+    return slot;
+}
+
+unsigned long long rt_stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+void rt_stats_record(const char *category, size_t id, unsigned long long start_ns, unsigned long long end_ns,
+                     unsigned long long wait_ns)
+{
+    rt_stats_thread *slot = rt_stats_local();
+    if (slot == &overflow)
+        return;
+
+    if (slot->spans_len == slot->spans_capacity)
+    {
+        size_t capacity = slot->spans_capacity ? 2 * slot->spans_capacity : 1024;
+        rt_stats_span *spans = (rt_stats_span *)realloc(slot->spans, capacity * sizeof(rt_stats_span));
+        if (spans == NULL)
+            return;
+        slot->spans = spans;
+        slot->spans_capacity = capacity;
+    }
+
+    rt_stats_span *span = &slot->spans[slot->spans_len++];
+    span->category = category;
+    span->id = id;
+    span->start_ns = start_ns;
+    span->end_ns = end_ns;
+    span->wait_ns = wait_ns;
+}
+
+void rt_stats_reset(void)
+{
+    pthread_mutex_lock(&threads_mtx);
+    for (size_t i = 0; i < threads_len; ++i)
+    {
+        memset(threads[i]->counters, 0, sizeof(threads[i]->counters));
+        threads[i]->spans_len = 0;
+    }
+    memset(overflow.counters, 0, sizeof(overflow.counters));
+    pthread_mutex_unlock(&threads_mtx);
+}
+
+void rt_stats_collect(rt_stats_totals *totals)
+{
+    memset(totals, 0, sizeof(rt_stats_totals));
+
+    pthread_mutex_lock(&threads_mtx);
+    for (size_t i = 0; i < threads_len; ++i)
+    {
+        for (int c = 0; c < RT_COUNTER_COUNT; ++c)
+            totals->counters[c] += threads[i]->counters[c];
+    }
+    for (int c = 0; c < RT_COUNTER_COUNT; ++c)
+        totals->counters[c] += overflow.counters[c];
+    totals->threads = threads_len;
+    pthread_mutex_unlock(&threads_mtx);
+}
+
+typedef struct span_summary
+{
+    const char *category;
+    size_t count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long total_wait_ns;
+    unsigned long long max_wait_ns;
+} span_summary;
+
+void rt_stats_write_summary(FILE *out)
+{
+    rt_stats_totals totals;
+    rt_stats_collect(&totals);
+
+    unsigned long long rays = totals.counters[RT_COUNTER_PRIMARY_RAYS] +
+                              totals.counters[RT_COUNTER_REFLECTION_RAYS] +
+                              totals.counters[RT_COUNTER_SHADOW_RAYS];
+
+    fprintf(out, "threads: %zu\n", totals.threads);
+    for (int c = 0; c < RT_COUNTER_COUNT; ++c)
+        fprintf(out, "%s: %llu\n", counter_names[c], totals.counters[c]);
+    if (rays)
+        fprintf(out, "sphere tests per ray: %.2f\nnode tests per ray: %.2f\n",
+                (double)totals.counters[RT_COUNTER_SPHERE_TESTS] / rays,
+                (double)totals.counters[RT_COUNTER_NODE_TESTS] / rays);
+
+    span_summary summaries[RT_STATS_MAX_CATEGORIES];
+    size_t summaries_len = 0;
+
+    pthread_mutex_lock(&threads_mtx);
+    for (size_t t = 0; t < threads_len; ++t)
+    {
+        for (size_t i = 0; i < threads[t]->spans_len; ++i)
+        {
+            const rt_stats_span *span = &threads[t]->spans[i];
+
+            span_summary *summary = NULL;
+            for (size_t s = 0; s < summaries_len && summary == NULL; ++s)
+            {
+                if (strcmp(summaries[s].category, span->category) == 0)
+                    summary = &summaries[s];
+            }
+            if (summary == NULL)
+            {
+                if (summaries_len == RT_STATS_MAX_CATEGORIES)
+                    continue;
+                summary = &summaries[summaries_len++];
+                memset(summary, 0, sizeof(span_summary));
+                summary->category = span->category;
+            }
+
+            unsigned long long duration = span->end_ns - span->start_ns;
+            summary->count++;
+            summary->total_ns += duration;
+            summary->total_wait_ns += span->wait_ns;
+            if (duration > summary->max_ns)
+                summary->max_ns = duration;
+            if (span->wait_ns > summary->max_wait_ns)
+                summary->max_wait_ns = span->wait_ns;
+        }
+    }
+    pthread_mutex_unlock(&threads_mtx);
+
+    for (size_t s = 0; s < summaries_len; ++s)
+    {
+        const span_summary *summary = &summaries[s];
+        fprintf(out, "%s: %zu, mean %.3f ms, max %.3f ms", summary->category, summary->count,
+                summary->total_ns / 1e6 / summary->count, summary->max_ns / 1e6);
+        if (summary->total_wait_ns)
+            fprintf(out, ", queue wait mean %.3f ms, max %.3f ms",
+                    summary->total_wait_ns / 1e6 / summary->count, summary->max_wait_ns / 1e6);
+        fprintf(out, "\n");
+    }
+}
+
+int rt_stats_write_chrome_trace(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return -1;
+
+    // Timestamps are relative to the earliest span so the viewer starts at 0
+    unsigned long long origin = ~0ull;
+    pthread_mutex_lock(&threads_mtx);
+    for (size_t t = 0; t < threads_len; ++t)
+    {
+        for (size_t i = 0; i < threads[t]->spans_len; ++i)
+        {
+            const rt_stats_span *span = &threads[t]->spans[i];
+            unsigned long long begin = span->start_ns - span->wait_ns;
+            if (begin < origin)
+                origin = begin;
+        }
+    }
+
+    const char *separator = "";
+    fprintf(out, "{\"traceEvents\": [\n");
+    for (size_t t = 0; t < threads_len; ++t)
+    {
+        for (size_t i = 0; i < threads[t]->spans_len; ++i)
+        {
+            const rt_stats_span *span = &threads[t]->spans[i];
+            fprintf(out,
+                    "%s{\"name\": \"%s %zu\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"wait_us\": %.3f}}",
+                    separator, span->category, span->id, span->category, t,
+                    (span->start_ns - origin) / 1e3, (span->end_ns - span->start_ns) / 1e3, span->wait_ns / 1e3);
+            separator = ",\n";
+        }
+    }
+    fprintf(out, "\n]}\n");
+    pthread_mutex_unlock(&threads_mtx);
+
+    return fclose(out) == 0 ? 0 : -1;
+}
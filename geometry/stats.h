@@ -0,0 +1,93 @@
+#ifndef STATS_H
+#define STATS_H
+#include "stddef.h"
+#include "stdio.h"
+
+// Instrumentation is compiled in with -DRT_STATS, otherwise the macros below expand to nothing
+typedef enum rt_counter
+{
+    RT_COUNTER_PRIMARY_RAYS,
+    RT_COUNTER_REFLECTION_RAYS,
+    RT_COUNTER_SHADOW_RAYS,
+    // Ray-sphere tests, SIMD kernels count every lane they evaluate
+    RT_COUNTER_SPHERE_TESTS,
+    // Ray-box tests during BVH traversal
+    RT_COUNTER_NODE_TESTS,
+    RT_COUNTER_COUNT,
+} rt_counter;
+
+// Interval on one thread, CLOCK_MONOTONIC nanoseconds
+typedef struct rt_stats_span
+{
+    // Static string, spans with the same category are summarized together
+    const char *category;
+    size_t id;
+    unsigned long long start_ns;
+    unsigned long long end_ns;
+    // Time spent queued before start_ns, 0 when it does not apply
+    unsigned long long wait_ns;
+} rt_stats_span;
+
+// Owned by one thread, aligned so that no two threads ever write to the same cache line
+typedef struct rt_stats_thread
+{
+    _Alignas(64) unsigned long long counters[RT_COUNTER_COUNT];
+    size_t index;
+    rt_stats_span *spans;
+    size_t spans_len;
+    size_t spans_capacity;
+} rt_stats_thread;
+
+typedef struct rt_stats_totals
+{
+    unsigned long long counters[RT_COUNTER_COUNT];
+    size_t threads;
+} rt_stats_totals;
+
+extern __thread rt_stats_thread *rt_stats_current;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Registers the calling thread on first use
+    rt_stats_thread *rt_stats_register(void);
+
+    static inline rt_stats_thread *rt_stats_local(void)
+    {
+        return rt_stats_current != NULL ? rt_stats_current : rt_stats_register();
+    }
+
+    unsigned long long rt_stats_now_ns(void);
+
+    /// @brief Appends a span to the calling thread's timeline, dropped if memory runs out
+    void rt_stats_record(const char *category, size_t id, unsigned long long start_ns, unsigned long long end_ns,
+                         unsigned long long wait_ns);
+
+    /// @brief Clears counters and spans of every thread, call it while nothing is being recorded
+    void rt_stats_reset(void);
+
+    /// @brief Sums the counters of every thread that recorded something
+    void rt_stats_collect(rt_stats_totals *totals);
+
+    /// @brief Prints ray counts, tests per ray and per-category span timings
+    void rt_stats_write_summary(FILE *out);
+
+    /// @brief Writes every span as a Chrome trace (chrome://tracing, Perfetto), one track per thread
+    /// @return 0 on success, -1 if the file could not be written
+    int rt_stats_write_chrome_trace(const char *path);
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef RT_STATS
+#define RT_STATS_ADD(counter, n) (rt_stats_local()->counters[counter] += (unsigned long long)(n))
+#define RT_STATS_TIME(var) unsigned long long var = rt_stats_now_ns()
+#define RT_STATS_SPAN(category, id, start) rt_stats_record(category, id, start, rt_stats_now_ns(), 0)
+#else
+#define RT_STATS_ADD(counter, n) ((void)0)
+#define RT_STATS_TIME(var) ((void)0)
+#define RT_STATS_SPAN(category, id, start) ((void)0)
+#endif
+
+#endif
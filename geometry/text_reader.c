@@ -0,0 +1,42 @@
+#include "text_reader.h"
+#include "ctype.h"
+#include "stdlib.h"
+#include "string.h"
+
+int text_reader_next(FILE *in, text_statement *statement)
+{
+    while (fgets(statement->line, sizeof(statement->line), in) != NULL)
+    {
+        ++statement->line_number;
+
+        char *comment = strchr(statement->line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        int consumed;
+        if (sscanf(statement->line, "%15s%n", statement->keyword, &consumed) != 1)
+            continue;
+        statement->args = statement->line + consumed;
+        return 1;
+    }
+    return 0;
+}
+
+int text_reader_at_end(const char *rest)
+{
+    while (isspace((unsigned char)*rest))
+        ++rest;
+    return *rest == '\0';
+}
+
+void *text_reader_grow(void *data, size_t *capacity, size_t len, size_t item_size)
+{
+    if (len < *capacity)
+        return data;
+
+    size_t new_capacity = *capacity ? 2 * *capacity : 16;
+    void *new_data = realloc(data, new_capacity * item_size);
+    if (new_data != NULL)
+        *capacity = new_capacity;
+    return new_data;
+}
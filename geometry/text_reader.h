@@ -0,0 +1,40 @@
+#ifndef TEXT_READER_H
+#define TEXT_READER_H
+#include "stdio.h"
+#include "stddef.h"
+
+// Helpers shared by the line based text formats, scene files and animations. Every line is a
+// keyword followed by its arguments, # starts a comment that runs to the end of the line.
+
+#define TEXT_READER_LINE_MAX 512
+#define TEXT_READER_KEYWORD_MAX 16
+
+typedef struct text_statement
+{
+    char line[TEXT_READER_LINE_MAX];
+    char keyword[TEXT_READER_KEYWORD_MAX];
+    // Rest of the line after the keyword
+    const char *args;
+    // 1-based, counts the blank and comment lines skipped too
+    size_t line_number;
+} text_statement;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /// @brief Reads lines until one has a keyword, line_number has to start at 0
+    /// @return 1 when statement holds the next statement, 0 at the end of the file
+    int text_reader_next(FILE *in, text_statement *statement);
+
+    /// @brief Checks that nothing but whitespace is left, pass the position after a %n conversion
+    int text_reader_at_end(const char *rest);
+
+    /// @brief Growable array helper, doubles the capacity when full
+    /// @return the array, reallocated if it was full, NULL if that failed and data is still valid
+    void *text_reader_grow(void *data, size_t *capacity, size_t len, size_t item_size);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,5 +1,28 @@
 #ifndef VECTOR_H
 #define VECTOR_H
+#include "math.h"
+
+// Precision of vector_normalize, picked with -DVECTOR_NORMALIZE_MODE=...
+// EXACT divides by sqrtf, FAST refines the hardware reciprocal square root with one
+// Newton-Raphson step (about 22 bits), APPROX uses the raw estimate (about 12 bits)
+#define VECTOR_NORMALIZE_EXACT 0
+#define VECTOR_NORMALIZE_FAST 1
+#define VECTOR_NORMALIZE_APPROX 2
+
+#ifndef VECTOR_NORMALIZE_MODE
+#define VECTOR_NORMALIZE_MODE VECTOR_NORMALIZE_EXACT
+#endif
+
+// VECTOR_SSE keeps vec3 in a 16-byte SSE register, otherwise the portable scalar code is used
+#if defined(VECTOR_SSE) && defined(__SSE__)
+#define VECTOR_USE_SSE 1
+#else
+#define VECTOR_USE_SSE 0
+#endif
+
+#if VECTOR_USE_SSE || (VECTOR_NORMALIZE_MODE != VECTOR_NORMALIZE_EXACT && defined(__SSE__))
+#include <xmmintrin.h>
+#endif
 
 typedef struct vec2
 {
@@ -7,33 +30,138 @@ typedef struct vec2
     float y;
 } vec2;
 
+#if VECTOR_USE_SSE
+// The fourth lane is padding, it is kept at 0 and never read
+typedef union vec3
+{
+    __m128 v;
+    struct
+    {
+        float x;
+        float y;
+        float z;
+    };
+} vec3;
+#else
 typedef struct vec3
 {
     float x;
     float y;
     float z;
 } vec3;
+#endif
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
-    vec2 vector2_create(float x, float y);
-    vec3 vector_create(float x, float y, float z);
+    static inline vec2 vector2_create(float x, float y)
+    {
+        vec2 vec;
+        vec.x = x;
+        vec.y = y;
+        return vec;
+    }
 
-    vec3 vector_addition(vec3 lhs, vec3 rhs);
+#if VECTOR_USE_SSE
+    static inline vec3 vector_create(float x, float y, float z)
+    {
+        vec3 vec;
+        vec.v = _mm_setr_ps(x, y, z, 0.f);
+        return vec;
+    }
 
-    vec3 vector_diff(vec3 lhs, vec3 rhs);
+    static inline vec3 vector_addition(vec3 lhs, vec3 rhs)
+    {
+        lhs.v = _mm_add_ps(lhs.v, rhs.v);
+        return lhs;
+    }
 
-    float vector_scalar_product(vec3 lhs, vec3 rhs);
+    static inline vec3 vector_diff(vec3 lhs, vec3 rhs)
+    {
+        lhs.v = _mm_sub_ps(lhs.v, rhs.v);
+        return lhs;
+    }
 
-    vec3 vector_multiplication(vec3 lhs, float rhs);
+    // Lanes are summed in the same order as the scalar code, so both give identical results
+    static inline float vector_scalar_product(vec3 lhs, vec3 rhs)
+    {
+        __m128 m = _mm_mul_ps(lhs.v, rhs.v);
+        __m128 xy = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+        return _mm_cvtss_f32(_mm_add_ss(xy, _mm_movehl_ps(m, m)));
+    }
 
-    float vector_norm(vec3 vec);
+    static inline vec3 vector_multiplication(vec3 lhs, float rhs)
+    {
+        lhs.v = _mm_mul_ps(lhs.v, _mm_set1_ps(rhs));
+        return lhs;
+    }
+#else
+    static inline vec3 vector_create(float x, float y, float z)
+    {
+        vec3 vec;
+        vec.x = x;
+        vec.y = y;
+        vec.z = z;
+        return vec;
+    }
 
-    vec3 vector_normalize(vec3 vec);
+    static inline vec3 vector_addition(vec3 lhs, vec3 rhs)
+    {
+        lhs.x = lhs.x + rhs.x;
+        lhs.y = lhs.y + rhs.y;
+        lhs.z = lhs.z + rhs.z;
+        return lhs;
+    }
+
+    static inline vec3 vector_diff(vec3 lhs, vec3 rhs)
+    {
+        lhs.x = lhs.x - rhs.x;
+        lhs.y = lhs.y - rhs.y;
+        lhs.z = lhs.z - rhs.z;
+        return lhs;
+    }
+
+    static inline float vector_scalar_product(vec3 lhs, vec3 rhs)
+    {
+        return (lhs.x * rhs.x) + (lhs.y * rhs.y) + (lhs.z * rhs.z);
+    }
+
+    static inline vec3 vector_multiplication(vec3 lhs, float rhs)
+    {
+        lhs.x = lhs.x * rhs;
+        lhs.y = lhs.y * rhs;
+        lhs.z = lhs.z * rhs;
+        return lhs;
+    }
+#endif
+
+    static inline float vector_norm(vec3 vec)
+    {
+        return sqrtf(vector_scalar_product(vec, vec));
+    }
+
+    // 1 / sqrt(x) in the precision chosen by VECTOR_NORMALIZE_MODE
+    static inline float vector_rsqrt(float x)
+    {
+#if VECTOR_NORMALIZE_MODE != VECTOR_NORMALIZE_EXACT && defined(__SSE__)
+        float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#if VECTOR_NORMALIZE_MODE == VECTOR_NORMALIZE_FAST
+        estimate = estimate * (1.5f - 0.5f * x * estimate * estimate);
+#endif
+        return estimate;
+#else
+        return 1 / sqrtf(x);
+#endif
+    }
+
+    static inline vec3 vector_normalize(vec3 vec)
+    {
+        vec = vector_multiplication(vec, vector_rsqrt(vector_scalar_product(vec, vec)));
+        return vec;
+    }
 
 #ifdef __cplusplus
 }
 #endif // extern "C"
-#endif
\ No newline at end of file
+#endif
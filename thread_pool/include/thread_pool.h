@@ -5,6 +5,104 @@
 struct thread_pool;
 
 typedef struct thread_pool *thread_pool_t;
+
+struct thread_pool_group;
+
+// Set of tasks with its own completion counter, see create_group_thread_pool
+typedef struct thread_pool_group *thread_pool_group_t;
+
+// Largest argument add_task_copy_thread_pool can store inside the task itself
+#define THREAD_POOL_INLINE_ARG_SIZE 64
+
+typedef enum thread_pool_scheduler
+{
+    // Shared queue, tasks of one priority start in submission order
+    THREAD_POOL_SCHEDULER_FIFO,
+    // Chase-Lev deque per worker with random-victim stealing
+    THREAD_POOL_SCHEDULER_WORK_STEALING,
+} thread_pool_scheduler;
+
+// Shared queue of the FIFO scheduler
+typedef enum thread_pool_queue
+{
+    // Linked list behind a mutex, unbounded
+    THREAD_POOL_QUEUE_LOCKED,
+    // Bounded lock-free ring, idle workers park on a futex. Tasks that do not fit go to a locked
+    // overflow list, so submitting never blocks, but they may start after tasks submitted later.
+    THREAD_POOL_QUEUE_RING,
+} thread_pool_queue;
+
+// Where workers run, pinned workers keep their caches and the memory they first touch on one node
+typedef enum thread_pool_affinity
+{
+    // Left to the OS scheduler
+    THREAD_POOL_AFFINITY_NONE,
+    // Worker i on the i-th allowed CPU in node order, fills a node before using the next one
+    THREAD_POOL_AFFINITY_COMPACT,
+    // Workers dealt round-robin over the nodes, spreads memory bandwidth
+    THREAD_POOL_AFFINITY_SCATTER,
+    // Worker i on cpus[i % cpus_len]
+    THREAD_POOL_AFFINITY_LIST,
+} thread_pool_affinity;
+
+// Queued tasks of a higher priority start before those of a lower one, submission order within a level
+typedef enum thread_pool_priority
+{
+    THREAD_POOL_PRIORITY_HIGH,
+    // Every task added without a priority
+    THREAD_POOL_PRIORITY_NORMAL,
+    THREAD_POOL_PRIORITY_LOW,
+    THREAD_POOL_PRIORITY_LEVELS,
+} thread_pool_priority;
+
+typedef struct thread_pool_task
+{
+    void (*function)(void *arg);
+    void *arg;
+} thread_pool_task;
+
+// Called with a half-open index range [begin, end) and the context given to parallel_for_thread_pool
+typedef void (*thread_pool_range_fn)(size_t begin, size_t end, void *ctx);
+
+// Occupancy of the task allocator, node counts are a snapshot
+typedef struct thread_pool_stats
+{
+    size_t task_slabs;
+    size_t task_capacity;
+    // Nodes holding a queued or running task
+    size_t tasks_in_use;
+    // Free nodes on the shared list
+    size_t tasks_free_shared;
+    // Free nodes cached by workers
+    size_t tasks_free_cached;
+} thread_pool_stats;
+
+// Timeline of one task, CLOCK_MONOTONIC nanoseconds
+typedef struct thread_pool_trace_event
+{
+    // Index of the worker that ran the task
+    size_t worker;
+    unsigned long long enqueue_ns;
+    unsigned long long start_ns;
+    unsigned long long end_ns;
+} thread_pool_trace_event;
+
+// Called on the worker right after each task finishes
+typedef void (*thread_pool_trace_fn)(const thread_pool_trace_event *event, void *user);
+
+typedef struct thread_pool_config
+{
+    size_t thread_count;
+    thread_pool_scheduler scheduler;
+    // Only used by the FIFO scheduler
+    thread_pool_queue queue;
+    // Cells of the ring, rounded up to a power of two
+    size_t queue_capacity;
+    thread_pool_affinity affinity;
+    // CPU ids for THREAD_POOL_AFFINITY_LIST, copied when the pool is created
+    const int *cpus;
+    size_t cpus_len;
+} thread_pool_config;
 #ifdef __cplusplus
 extern "C"
 {
@@ -16,18 +114,164 @@ extern "C"
     /// @return Returns a pointer to the thread pool. If an error occurred during creation, it returns NULL
     thread_pool_t create_thread_pool(size_t thread_count);
 
+    /// @brief Fills the config with the defaults used by create_thread_pool
+    ///
+    /// @param config config to initialize
+    /// @param thread_count Number of threads in the thread pool
+    void init_thread_pool_config(thread_pool_config *config, size_t thread_count);
+
+    /// @brief Creates a thread pool with the specified configuration
+    ///
+    /// @param config pool configuration, see init_thread_pool_config
+    ///
+    /// @return Returns a pointer to the thread pool. If an error occurred during creation, including a
+    /// CPU list naming a CPU the process may not run on, it returns NULL
+    thread_pool_t create_thread_pool_with_config(const thread_pool_config *config);
+
     /// @brief Destroys the thread pool and frees the resources allocated for its operation
     ///
+    /// Tasks still queued run before the workers exit, the call returns as soon as they are joined.
+    ///
     /// @param th_pool thread pool for destruction
     void destroy_thread_pool(thread_pool_t th_pool);
 
     /// @brief Add task to the thread pool
+    ///
+    /// With the work-stealing scheduler a task added from inside another task of the same pool
+    /// goes to the local deque of the calling worker, other submissions go to a shared queue.
+    ///
     /// @param th_pool threadpool to which the work will be added
     /// @param function_p pointer to function to add as work
     /// @param arg pointer to an argument
     /// @return 0 on success, -1 otherwise
     int add_task_thread_pool(thread_pool_t th_pool, void (*function_p)(void *), void *arg);
 
+    /// @brief Add task that starts before queued tasks of a lower priority
+    ///
+    /// A task already running is never interrupted. With the work-stealing scheduler only normal
+    /// priority tasks go to the local deque of a worker adding them, the others are queued shared.
+    ///
+    /// @param th_pool threadpool to which the work will be added
+    /// @param function_p pointer to function to add as work
+    /// @param arg pointer to an argument
+    /// @param priority one of the THREAD_POOL_PRIORITY levels
+    /// @return 0 on success, -1 otherwise
+    int add_task_priority_thread_pool(thread_pool_t th_pool, void (*function_p)(void *), void *arg,
+                                      thread_pool_priority priority);
+
+    /// @brief Add task whose argument is copied into the task, so the caller needs no heap block for it
+    /// @param th_pool threadpool to which the work will be added
+    /// @param function_p pointer to function to add as work, receives a pointer to the copy
+    /// @param arg pointer to the argument to copy
+    /// @param arg_size size of the argument, at most THREAD_POOL_INLINE_ARG_SIZE
+    /// @return 0 on success, -1 otherwise
+    int add_task_copy_thread_pool(thread_pool_t th_pool, void (*function_p)(void *), const void *arg, size_t arg_size);
+
+    /// @brief Add several tasks to the thread pool with a single queue lock and wakeup
+    /// @param th_pool threadpool to which the work will be added
+    /// @param tasks array of functions and their arguments, copied before returning
+    /// @param count number of tasks
+    /// @return 0 on success, -1 otherwise (then none of the tasks was added)
+    int add_tasks_thread_pool(thread_pool_t th_pool, const thread_pool_task *tasks, size_t count);
+
+    /// @brief Splits [begin, end) into chunks of grain indices and enqueues one task per chunk
+    ///
+    /// All chunks are enqueued at once, use wait_thread_pool to wait for them.
+    ///
+    /// @param th_pool threadpool to which the work will be added
+    /// @param begin first index
+    /// @param end one past the last index
+    /// @param grain number of indices per task, 0 is treated as 1
+    /// @param function_p called as function_p(chunk_begin, chunk_end, ctx)
+    /// @param ctx context passed to every call
+    /// @return 0 on success, -1 otherwise (then none of the chunks was added)
+    int parallel_for_thread_pool(thread_pool_t th_pool, size_t begin, size_t end, size_t grain,
+                                 thread_pool_range_fn function_p, void *ctx);
+
+    /// @brief Creates a task group, tasks added through it can be waited for apart from the rest of the pool
+    ///
+    /// A group is complete once it is closed, every prerequisite is complete and all of its tasks
+    /// have finished.
+    ///
+    /// @param th_pool pool that runs the tasks of the group
+    /// @return the group, NULL if it could not be allocated
+    thread_pool_group_t create_group_thread_pool(thread_pool_t th_pool);
+
+    /// @brief Adds a task to the group and to its pool
+    /// @return 0 on success, -1 if memory ran out or the group is closed
+    int add_group_task_thread_pool(thread_pool_group_t group, void (*function_p)(void *), void *arg);
+
+    /// @brief parallel_for_thread_pool whose chunks belong to the group
+    /// @return 0 on success, -1 if memory ran out or the group is closed
+    int parallel_for_group_thread_pool(thread_pool_group_t group, size_t begin, size_t end, size_t grain,
+                                       thread_pool_range_fn function_p, void *ctx);
+
+    /// @brief Sets the priority of the tasks the group hands to the pool from now on
+    ///
+    /// Tasks held back by a prerequisite are queued with the priority the group has when they are
+    /// released. Groups start with THREAD_POOL_PRIORITY_NORMAL.
+    void set_group_priority_thread_pool(thread_pool_group_t group, thread_pool_priority priority);
+
+    /// @brief Holds back tasks added to group until prerequisite is complete
+    ///
+    /// Tasks already in the pool are not affected. Edges must not form a cycle, and a prerequisite
+    /// has to be closed at some point for its dependents to run.
+    ///
+    /// @return 0 on success, -1 if memory ran out
+    int add_group_dependency_thread_pool(thread_pool_group_t group, thread_pool_group_t prerequisite);
+
+    /// @brief Declares that no more tasks will be added, the group completes once its tasks are done
+    void close_group_thread_pool(thread_pool_group_t group);
+
+    /// @brief Blocks until every task added to the group so far has finished
+    ///
+    /// The caller runs queued tasks of the pool, of any group, while it waits, so it may be called
+    /// from inside a task without tying up the worker.
+    void wait_group_thread_pool(thread_pool_group_t group);
+
+    /// @brief Closes the group, waits until it is complete and frees it
+    void destroy_group_thread_pool(thread_pool_group_t group);
+
+    /// @brief Reports how many task nodes the pool has allocated and how many are in use
+    ///
+    /// Task nodes are carved from slabs and recycled, so once the slabs cover the peak number of
+    /// queued tasks, adding tasks does no heap allocation.
+    ///
+    /// @param th_pool thread pool to inspect
+    /// @param stats receives the counters
+    void get_stats_thread_pool(thread_pool_t th_pool, thread_pool_stats *stats);
+
+    /// @brief Installs a callback that receives the queue wait and run time of every task
+    ///
+    /// Only available when the library is built with THPOOL_TRACE, otherwise tasks carry no
+    /// timestamps and the call fails. Install it while no tasks are queued.
+    ///
+    /// @param th_pool thread pool to trace
+    /// @param function_p callback, NULL stops tracing
+    /// @param user passed to every call
+    /// @return 0 on success, -1 if tracing is compiled out
+    int set_trace_thread_pool(thread_pool_t th_pool, thread_pool_trace_fn function_p, void *user);
+
+    /// @brief Number of NUMA nodes the workers are grouped by
+    ///
+    /// Workers are only grouped when they are pinned, an unpinned pool or a machine without NUMA
+    /// information reports a single node.
+    ///
+    /// @param th_pool thread pool to inspect
+    size_t get_node_count_thread_pool(thread_pool_t th_pool);
+
+    /// @brief Node of a worker, in [0, get_node_count_thread_pool)
+    /// @param th_pool thread pool to inspect
+    /// @param worker index of the worker, as in thread_pool_trace_event
+    size_t get_worker_node_thread_pool(thread_pool_t th_pool, size_t worker);
+
+    /// @brief Index of the worker running the caller
+    /// @param th_pool thread pool to inspect
+    /// @return worker index, or (size_t)-1 when called from outside the pool
+    size_t get_current_worker_thread_pool(thread_pool_t th_pool);
+
+    /// @brief Blocks until every task added to the pool has finished
+    /// @param th_pool thread pool to wait for
     void wait_thread_pool(thread_pool_t th_pool);
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <dirent.h>
+#include <sched.h>
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define AFFINITY_NODE_DIR "/sys/devices/system/node"
+
+// Adds the allowed CPUs of a cpulist ("0-3,8,10-11") to cpus, returns how many were added
+static size_t affinity_parse_cpulist(FILE *in, const cpu_set_t *allowed, int *cpus, size_t cpus_len)
+{
+    size_t added = 0;
+    int first, last;
+    char separator;
+
+    while (fscanf(in, "%d", &first) == 1)
+    {
+        last = first;
+        if (fscanf(in, "%c", &separator) == 1 && separator == '-')
+        {
+            if (fscanf(in, "%d", &last) != 1)
+                break;
+            if (fscanf(in, "%c", &separator) != 1)
+                separator = '\n';
+        }
+
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, allowed) && cpus_len + added < CPU_SETSIZE)
+                cpus[cpus_len + added++] = cpu;
+        }
+
+        if (separator != ',')
+            break;
+    }
+    return added;
+}
+
+static long affinity_max_node(void)
+{
+    DIR *dir = opendir(AFFINITY_NODE_DIR);
+    if (dir == NULL)
+        return -1;
+
+    long max_node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        long node;
+        char rest;
+        if (sscanf(entry->d_name, "node%ld%c", &node, &rest) == 1 && node > max_node)
+            max_node = node;
+    }
+    closedir(dir);
+    return max_node;
+}
+
+int affinity_topology_init(affinity_topology *topology)
+{
+    topology->nodes_len = 0;
+    topology->node_begin = NULL;
+    topology->cpus = NULL;
+    topology->cpus_len = 0;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return -1;
+
+    long max_node = affinity_max_node();
+    size_t nodes_capacity = max_node >= 0 ? (size_t)max_node + 1 : 1;
+
+    topology->cpus = (int *)malloc(CPU_SETSIZE * sizeof(int));
+    topology->node_begin = (size_t *)malloc((nodes_capacity + 1) * sizeof(size_t));
+    if (topology->cpus == NULL || topology->node_begin == NULL)
+    {
+        affinity_topology_destroy(topology);
+        return -1;
+    }
+
+    for (long node = 0; node <= max_node; ++node)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), AFFINITY_NODE_DIR "/node%ld/cpulist", node);
+        FILE *in = fopen(path, "r");
+        if (in == NULL)
+            continue;
+
+        size_t added = affinity_parse_cpulist(in, &allowed, topology->cpus, topology->cpus_len);
+        fclose(in);
+
+        // Memory-only nodes and nodes outside the allowed set get no workers
+        if (added == 0)
+            continue;
+
+        topology->node_begin[topology->nodes_len++] = topology->cpus_len;
+        topology->cpus_len += added;
+    }
+
+    // No NUMA information, or it did not cover the allowed set: one node with every allowed CPU
+    if (topology->cpus_len != (size_t)CPU_COUNT(&allowed))
+    {
+        topology->nodes_len = 1;
+        topology->node_begin[0] = 0;
+        topology->cpus_len = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                topology->cpus[topology->cpus_len++] = cpu;
+        }
+    }
+
+    topology->node_begin[topology->nodes_len] = topology->cpus_len;
+    return 0;
+}
+
+void affinity_topology_destroy(affinity_topology *topology)
+{
+    free(topology->node_begin);
+    free(topology->cpus);
+    topology->node_begin = NULL;
+    topology->cpus = NULL;
+    topology->nodes_len = 0;
+    topology->cpus_len = 0;
+}
+
+long affinity_cpu_node(const affinity_topology *topology, int cpu)
+{
+    for (size_t node = 0; node < topology->nodes_len; ++node)
+    {
+        for (size_t i = topology->node_begin[node]; i < topology->node_begin[node + 1]; ++i)
+        {
+            if (topology->cpus[i] == cpu)
+                return (long)node;
+        }
+    }
+    return -1;
+}
+
+int affinity_assign(const affinity_topology *topology, const thread_pool_config *config, int *cpu_out)
+{
+    for (size_t i = 0; i < config->thread_count; ++i)
+    {
+        switch (config->affinity)
+        {
+        case THREAD_POOL_AFFINITY_COMPACT:
+            // CPUs are sorted by node, so consecutive workers share a node until it is full
+            cpu_out[i] = topology->cpus[i % topology->cpus_len];
+            break;
+        case THREAD_POOL_AFFINITY_SCATTER:
+        {
+            size_t node = i % topology->nodes_len;
+            size_t node_len = topology->node_begin[node + 1] - topology->node_begin[node];
+            cpu_out[i] = topology->cpus[topology->node_begin[node] + (i / topology->nodes_len) % node_len];
+            break;
+        }
+        case THREAD_POOL_AFFINITY_LIST:
+            if (config->cpus_len == 0 || affinity_cpu_node(topology, config->cpus[i % config->cpus_len]) < 0)
+                return -1;
+            cpu_out[i] = config->cpus[i % config->cpus_len];
+            break;
+        default:
+            cpu_out[i] = -1;
+            break;
+        }
+    }
+    return 0;
+}
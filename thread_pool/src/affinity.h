@@ -0,0 +1,29 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include "thread_pool.h"
+
+// CPUs this process may run on, grouped by NUMA node. Nodes are numbered densely in the order of
+// their sysfs ids, nodes without allowed CPUs are left out. Without sysfs every CPU is on node 0.
+typedef struct affinity_topology
+{
+    size_t nodes_len;
+    // CPUs of node i are cpus[node_begin[i]] .. cpus[node_begin[i + 1] - 1], ascending
+    size_t *node_begin;
+    int *cpus;
+    size_t cpus_len;
+} affinity_topology;
+
+// Returns -1 if the allowed CPU set could not be read or memory ran out
+int affinity_topology_init(affinity_topology *topology);
+
+void affinity_topology_destroy(affinity_topology *topology);
+
+// Dense node of an allowed CPU, -1 for a CPU the process may not use
+long affinity_cpu_node(const affinity_topology *topology, int cpu);
+
+// Picks the CPU of every worker for a policy, cpu_out[i] is -1 for an unpinned worker.
+// Returns -1 if the list policy names a CPU outside the topology.
+int affinity_assign(const affinity_topology *topology, const thread_pool_config *config, int *cpu_out);
+
+#endif
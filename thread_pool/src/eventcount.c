@@ -0,0 +1,47 @@
+#include "eventcount.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void eventcount_init(eventcount *ec)
+{
+    atomic_init(&ec->epoch, 0);
+    atomic_init(&ec->waiters, 0);
+}
+
+unsigned int eventcount_prepare(eventcount *ec)
+{
+    // Sequentially consistent, pairs with the fence in eventcount_notify: either the producer sees
+    // this waiter or the caller's second check sees the producer's item
+    atomic_fetch_add(&ec->waiters, 1);
+    return atomic_load(&ec->epoch);
+}
+
+void eventcount_cancel(eventcount *ec)
+{
+    atomic_fetch_sub(&ec->waiters, 1);
+}
+
+void eventcount_wait(eventcount *ec, unsigned int key)
+{
+    // A woken waiter was already unregistered by its notifier. Only a wait that did not sleep
+    // unregisters itself; a rare spurious wakeup leaves the count too high, which costs a futex call
+    // but never loses a wakeup.
+    if (syscall(SYS_futex, &ec->epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0) != 0)
+        atomic_fetch_sub(&ec->waiters, 1);
+}
+
+void eventcount_notify(eventcount *ec, size_t count)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (count == 0 || atomic_load_explicit(&ec->waiters, memory_order_relaxed) == 0)
+        return;
+
+    atomic_fetch_add(&ec->epoch, 1);
+    // Unregistering the woken waiters here spares the producers' next notifications a futex call
+    // while those workers are still on their way out of the kernel
+    long woken = syscall(SYS_futex, &ec->epoch, FUTEX_WAKE_PRIVATE, count < INT_MAX ? (int)count : INT_MAX, NULL, NULL, 0);
+    if (woken > 0)
+        atomic_fetch_sub(&ec->waiters, (unsigned int)woken);
+}
@@ -0,0 +1,35 @@
+#ifndef EVENTCOUNT_H
+#define EVENTCOUNT_H
+
+#include <stdatomic.h>
+#include "types.h"
+
+// Lets threads sleep until a lock-free structure changes without the producers taking a lock. A
+// consumer registers with eventcount_prepare, checks the structure once more and only then waits,
+// producers bump the epoch and make the futex call only when someone is registered:
+//
+//     key = eventcount_prepare(ec);
+//     if ((item = pop()) != NULL) eventcount_cancel(ec);
+//     else eventcount_wait(ec, key);
+typedef struct eventcount
+{
+    atomic_uint epoch;
+    atomic_uint waiters;
+} eventcount;
+
+void eventcount_init(eventcount *ec);
+
+// Registers the caller as a waiter, returns the key to wait with
+unsigned int eventcount_prepare(eventcount *ec);
+
+// Unregisters a waiter that found work after all
+void eventcount_cancel(eventcount *ec);
+
+// Sleeps unless the epoch moved since eventcount_prepare, unregisters in both cases. May return
+// spuriously, callers check their condition again.
+void eventcount_wait(eventcount *ec, unsigned int key);
+
+// Wakes up to count registered waiters, call after publishing the change they wait for
+void eventcount_notify(eventcount *ec, size_t count);
+
+#endif
@@ -0,0 +1,101 @@
+#include "mpmc_queue.h"
+#include "malloc.h"
+
+int mpmc_queue_init(mpmc_queue *queue, size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+
+    queue->cells = (mpmc_cell *)malloc(size * sizeof(mpmc_cell));
+    if (queue->cells == NULL)
+        return -1;
+
+    for (size_t i = 0; i < size; ++i)
+        atomic_init(&queue->cells[i].sequence, i);
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    return 0;
+}
+
+void mpmc_queue_destroy(mpmc_queue *queue)
+{
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+int mpmc_queue_push(mpmc_queue *queue, void *data)
+{
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    mpmc_cell *cell;
+
+    while (1)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        long diff = (long)(sequence - pos);
+
+        // The cell is free for this lap, claim the position
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        // The consumer of the previous lap has not taken the cell yet
+        else if (diff < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->data = data;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+void *mpmc_queue_pop(mpmc_queue *queue)
+{
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    mpmc_cell *cell;
+
+    while (1)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        long diff = (long)(sequence - (pos + 1));
+
+        // The cell holds the item of this lap, claim the position
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        // The producer has not filled the cell yet
+        else if (diff < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    void *data = cell->data;
+    // Free for the producer one lap ahead
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return data;
+}
+
+int mpmc_queue_empty(mpmc_queue *queue)
+{
+    // Sequentially consistent, a worker about to park relies on this load not passing its registration
+    return atomic_load(&queue->enqueue_pos) == atomic_load(&queue->dequeue_pos);
+}
@@ -0,0 +1,40 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stdatomic.h>
+#include "types.h"
+
+// Bounded multi-producer multi-consumer ring (Vyukov, "Bounded MPMC queue", 1024cores.net). Every cell
+// carries a sequence number telling producers and consumers whose turn it is, so a push or pop is one
+// CAS on its position counter and no thread ever waits for another one to finish.
+
+typedef struct mpmc_cell
+{
+    atomic_size_t sequence;
+    void *data;
+} mpmc_cell;
+
+typedef struct mpmc_queue
+{
+    mpmc_cell *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+} mpmc_queue;
+
+// Capacity is rounded up to a power of two, returns -1 if the cells could not be allocated
+int mpmc_queue_init(mpmc_queue *queue, size_t capacity);
+
+void mpmc_queue_destroy(mpmc_queue *queue);
+
+// Returns -1 if the queue is full
+int mpmc_queue_push(mpmc_queue *queue, void *data);
+
+// Returns NULL if the queue is empty
+void *mpmc_queue_pop(mpmc_queue *queue);
+
+// Returns 0 if a push has claimed a cell no pop has claimed yet, without touching the cells. The item
+// may still be in flight, so a pop right after can return NULL.
+int mpmc_queue_empty(mpmc_queue *queue);
+
+#endif
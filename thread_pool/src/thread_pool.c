@@ -1,6 +1,13 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
+#include "ws_deque.h"
+#include "affinity.h"
+#include "mpmc_queue.h"
+#include "eventcount.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include "malloc.h"
+#include "string.h"
 #include <unistd.h>
 #include "time.h"
 
@@ -10,6 +17,12 @@
 #define THPOOL_DEBUG 0
 #endif
 
+#ifdef THPOOL_TRACE
+#define THPOOL_TRACE 1
+#else
+#define THPOOL_TRACE 0
+#endif
+
 #if !defined(DISABLE_PRINT) || defined(THPOOL_DEBUG)
 #define err(str) fprintf(stderr, str)
 #else
@@ -17,31 +30,84 @@
 #endif
 
 #define ALLOC(a) malloc(a)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define WS_DEQUE_CAPACITY 256
+#define RING_CAPACITY 4096
+// Pause iterations an idle worker spins before it parks, adapted per worker within these bounds
+#define SPIN_MIN 16
+#define SPIN_INITIAL 256
+#define SPIN_MAX 4096
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax()
+#endif
+// Task nodes come from slabs and are recycled through free lists, workers keep a small private cache
+#define TASK_SLAB_SIZE 256
+#define TASK_CACHE_MAX 128
+#define TASK_CACHE_BATCH 64
 // Structures
-typedef struct event
-{
-    int counter;
-    pthread_cond_t event_cond;
-    pthread_mutex_t event_mtx;
-} event;
-
 typedef struct task
 {
     struct task *prev;
     void *arg;
     void (*function)(void *arg);
+    // parallel_for chunks call range_function(begin, end, arg) instead of function
+    thread_pool_range_fn range_function;
+    size_t begin;
+    size_t end;
+    // Group whose counters the task is part of, NULL for plain tasks
+    struct thread_pool_group *group;
+    // Argument copied by add_task_copy_thread_pool, arg points here then
+    _Alignas(16) unsigned char inline_arg[THREAD_POOL_INLINE_ARG_SIZE];
+#if THPOOL_TRACE
+    unsigned long long enqueue_ns;
+#endif
 } task;
 
+typedef struct thread_pool_group
+{
+    struct thread_pool *pool;
+    // Tasks added and not finished yet, held ones included, wait_group_thread_pool waits for zero
+    atomic_size_t tasks;
+    // Tasks, unfinished prerequisites and 1 until the group is closed, the group completes at zero
+    atomic_size_t refs;
+    atomic_int complete;
+    pthread_mutex_t mtx;
+    pthread_cond_t idle;
+
+    // Everything below is guarded by mtx
+    thread_pool_priority priority;
+    int closed;
+    // Unfinished prerequisites, tasks added meanwhile are held back instead of submitted
+    size_t blockers;
+    task *held_first;
+    task *held_last;
+    size_t held_len;
+    // Groups to unblock once this one completes
+    struct thread_pool_group **dependents;
+    size_t dependents_len;
+    size_t dependents_capacity;
+} thread_pool_group;
+
+typedef struct task_slab
+{
+    struct task_slab *next;
+    task tasks[TASK_SLAB_SIZE];
+} task_slab;
+
 typedef struct task_queue
 {
     // sync
     pthread_mutex_t rwlock;
 
-    event *has_task;
-
     task *front;
     task *back;
-    volatile size_t size;
+    // Written under rwlock, read without it as a hint whether popping is worth the lock
+    atomic_size_t size;
 } task_queue;
 
 typedef struct thread
@@ -49,48 +115,128 @@ typedef struct thread
     size_t id;
     pthread_t thread_ptr;
     struct thread_pool *pool;
+    // CPU the worker is pinned to, -1 if unpinned, and its dense NUMA node
+    int cpu;
+    size_t node;
+
+    // Work-stealing scheduler only
+    ws_deque deque;
+    unsigned int rng;
+
+    // Recycled task nodes only this worker touches, linked through prev
+    task *free_tasks;
+    size_t free_tasks_len;
+
+    // Pause iterations before parking, grows while spinning finds work and shrinks while it does not
+    unsigned int spin;
 } thread;
 
 typedef struct thread_pool
 {
     thread **threads;
+    size_t thread_count;
+    // Workers whose pthread exists, fewer than thread_count only while creating the pool or if that failed
+    size_t threads_started;
+    size_t nodes_len;
+    thread_pool_scheduler scheduler;
+    // Guards nothing but the wait_thread_pool sleep on thread_end_wait
     pthread_mutex_t th_count_mtx;
     pthread_cond_t thread_end_wait;
-    task_queue queue;
-
-    volatile size_t count_th_alive;
-    volatile size_t count_th_working;
-
-    volatile int stop;
+    // One list per priority. FIFO: the only queues, or beside the ring, work-stealing: tasks submitted
+    // from outside the pool and tasks of other than normal priority
+    task_queue queues[THREAD_POOL_PRIORITY_LEVELS];
+
+    // FIFO with THREAD_POOL_QUEUE_RING only, normal priority tasks, the normal list takes its overflow
+    int use_ring;
+    mpmc_queue ring;
+
+    // tasks added and not finished yet
+    atomic_size_t tasks_pending;
+    // Work-stealing scheduler only, tasks sitting in a deque or the shared queue
+    atomic_size_t tasks_available;
+    // Idle workers sleep here, every submitted task wakes at most one of them
+    eventcount wake;
+    // Upper bound of thread->spin, 0 on a single CPU where spinning only delays the submitter
+    unsigned int spin_max;
+
+    // Task allocator
+    pthread_mutex_t alloc_mtx;
+    task_slab *slabs;
+    size_t slabs_count;
+    task *free_tasks;
+    size_t free_tasks_len;
+    atomic_size_t tasks_in_use;
+
+    thread_pool_trace_fn trace_function;
+    void *trace_user;
+
+    atomic_int stop;
 } thread_pool;
 
 // Prototypes
 
-static int task_queue_init(task_queue *queue);
+static void task_queue_init(task_queue *queue);
 static void task_queue_clear(task_queue *queue);
-static void task_queue_push(task_queue *queue, task *new_task);
+static void task_queue_push_chain(task_queue *queue, task *first, task *last, size_t count);
 static task *task_queue_pop(task_queue *queue);
 static void task_queue_destroy(task_queue *queue);
 
 static int thread_init(thread_pool_t pool, thread **thr, size_t id);
+static int thread_start(thread *thr);
+static int thread_pin(thread_pool_t pool, const thread_pool_config *config);
 static void thread_exec(thread *thr);
+static int thread_park(thread_pool_t pool, thread *thr);
+static int tasks_queued(thread_pool_t pool);
 static void thread_destroy(thread *thr);
 
-static void event_init(event *ev);
-static void event_reset(event *ev);
-static void event_wait(event *ev);
-static void event_notify(event *ev);
-static void event_notify_all(event *ev);
-static void event_deinit(event *ev);
-static void event_destroy(event *ev);
+static task *task_alloc_chain(thread_pool_t pool, size_t count);
+static void task_release(thread_pool_t pool, task *task_p);
+static void task_chain_release(thread_pool_t pool, task *first);
+static int task_slab_create(thread_pool_t pool);
+static void task_init(task *task_p, void (*function_p)(void *), void *arg);
+static void task_run(thread_pool_t pool, thread *thr, task *task_p);
+static int submit_tasks(thread_pool_t pool, task *first, task *last, size_t count, thread_pool_priority priority);
+static task *task_range_chain(thread_pool_t pool, size_t begin, size_t end, size_t grain,
+                              thread_pool_range_fn function_p, void *ctx, task **last, size_t *count);
+static int pool_help(thread_pool_t pool);
+
+static int group_submit(thread_pool_group_t group, task *first, task *last, size_t count);
+static void group_unref(thread_pool_group_t group, size_t count);
+static void group_unblock(thread_pool_group_t group);
+static void group_wait(thread_pool_group_t group, int until_complete);
+
+static int ws_submit(thread_pool_t pool, task *first, task *last, size_t count, thread_pool_priority priority);
+static task *ws_next_task(thread_pool_t pool, thread *thr);
+static void pending_task_done(thread_pool_t pool);
+static int fifo_submit(thread_pool_t pool, task *first, task *last, size_t count, thread_pool_priority priority);
+static task *next_task(thread_pool_t pool, thread *thr);
+static task *shared_next_task(thread_pool_t pool, thread_pool_priority begin, thread_pool_priority end);
+
+// Worker the calling thread belongs to, NULL outside of any pool
+static __thread thread *current_thread = NULL;
 
 // Impl
 thread_pool_t create_thread_pool(size_t thread_count)
 {
-    if (thread_count < 0)
-    {
-        thread_count = 0;
-    }
+    thread_pool_config config;
+    init_thread_pool_config(&config, thread_count);
+    return create_thread_pool_with_config(&config);
+}
+
+void init_thread_pool_config(thread_pool_config *config, size_t thread_count)
+{
+    config->thread_count = thread_count;
+    config->scheduler = THREAD_POOL_SCHEDULER_FIFO;
+    config->queue = THREAD_POOL_QUEUE_LOCKED;
+    config->queue_capacity = RING_CAPACITY;
+    config->affinity = THREAD_POOL_AFFINITY_NONE;
+    config->cpus = NULL;
+    config->cpus_len = 0;
+}
+
+thread_pool_t create_thread_pool_with_config(const thread_pool_config *config)
+{
+    size_t thread_count = config->thread_count;
 
     thread_pool_t th_pool = NULL;
     th_pool = (thread_pool_t)ALLOC(sizeof(thread_pool));
@@ -100,13 +246,40 @@ thread_pool_t create_thread_pool(size_t thread_count)
         return NULL;
     }
 
-    th_pool->count_th_alive = 0;
-    th_pool->count_th_working = 0;
-    th_pool->stop = 0;
+    // Counts the workers set up so far, destroy_thread_pool cleans up after a failure at any step
+    th_pool->threads = NULL;
+    th_pool->thread_count = 0;
+    th_pool->threads_started = 0;
+    th_pool->scheduler = config->scheduler;
+    atomic_init(&th_pool->stop, 0);
+
+    atomic_init(&th_pool->tasks_pending, 0);
+    atomic_init(&th_pool->tasks_available, 0);
+    eventcount_init(&th_pool->wake);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    th_pool->spin_max = cpus > 1 ? SPIN_MAX : 0;
+
+    pthread_mutex_init(&th_pool->alloc_mtx, NULL);
+    th_pool->slabs = NULL;
+    th_pool->slabs_count = 0;
+    th_pool->free_tasks = NULL;
+    th_pool->free_tasks_len = 0;
+    atomic_init(&th_pool->tasks_in_use, 0);
+    th_pool->trace_function = NULL;
+    th_pool->trace_user = NULL;
+
+    for (size_t i = 0; i < THREAD_POOL_PRIORITY_LEVELS; ++i)
+        task_queue_init(&th_pool->queues[i]);
+    pthread_mutex_init(&th_pool->th_count_mtx, NULL);
+    pthread_cond_init(&th_pool->thread_end_wait, NULL);
+    th_pool->nodes_len = 1;
 
-    if (task_queue_init(&th_pool->queue) == -1)
+    th_pool->use_ring = th_pool->scheduler == THREAD_POOL_SCHEDULER_FIFO && config->queue == THREAD_POOL_QUEUE_RING;
+    if (th_pool->use_ring && mpmc_queue_init(&th_pool->ring, config->queue_capacity) == -1)
     {
-        err("create_thread_pool(): failed to allocate memory for task queue");
+        err("create_thread_pool(): failed to allocate memory for task ring");
+        th_pool->use_ring = 0;
+        destroy_thread_pool(th_pool);
         return NULL;
     }
 
@@ -114,15 +287,42 @@ thread_pool_t create_thread_pool(size_t thread_count)
     if (th_pool->threads == NULL)
     {
         err("create_thread_pool(): failed to allocate memory for threads");
+        destroy_thread_pool(th_pool);
         return NULL;
     }
 
-    pthread_mutex_init(&th_pool->th_count_mtx, NULL);
-    pthread_cond_init(&th_pool->thread_end_wait, NULL);
+    // Every worker must exist before any of them starts looking for work to steal
+    for (size_t i = 0; i < thread_count; ++i)
+    {
+        if (thread_init(th_pool, &th_pool->threads[i], i) == -1)
+        {
+            err("create_thread_pool(): failed to initialize thread");
+            destroy_thread_pool(th_pool);
+            return NULL;
+        }
+        th_pool->thread_count++;
+    }
+
+    if (config->affinity != THREAD_POOL_AFFINITY_NONE && thread_count)
+    {
+        if (thread_pin(th_pool, config) == -1)
+        {
+            err("create_thread_pool(): failed to pin threads, is every listed CPU allowed?");
+            destroy_thread_pool(th_pool);
+            return NULL;
+        }
+    }
 
     for (size_t i = 0; i < thread_count; ++i)
     {
-        thread_init(th_pool, &th_pool->threads[i], i);
+        if (thread_start(th_pool->threads[i]) != 0)
+        {
+            // The workers already running would wait forever for the others' tasks, stop them
+            err("create_thread_pool(): failed to start thread");
+            destroy_thread_pool(th_pool);
+            return NULL;
+        }
+        th_pool->threads_started++;
     }
 
     return th_pool;
@@ -130,9 +330,7 @@ thread_pool_t create_thread_pool(size_t thread_count)
 
 int add_task_thread_pool(thread_pool_t th_pool, void (*function_p)(void *), void *arg)
 {
-    task *new_task;
-
-    new_task = (task *)ALLOC(sizeof(task));
+    task *new_task = task_alloc_chain(th_pool, 1);
 
     if (new_task == NULL)
     {
@@ -140,17 +338,278 @@ int add_task_thread_pool(thread_pool_t th_pool, void (*function_p)(void *), void
         return -1;
     }
 
-    new_task->function = function_p;
-    new_task->arg = arg;
+    task_init(new_task, function_p, arg);
+    return submit_tasks(th_pool, new_task, new_task, 1, THREAD_POOL_PRIORITY_NORMAL);
+}
+
+int add_task_priority_thread_pool(thread_pool_t th_pool, void (*function_p)(void *), void *arg,
+                                  thread_pool_priority priority)
+{
+    if ((unsigned int)priority >= THREAD_POOL_PRIORITY_LEVELS)
+    {
+        err("add_task_priority_thread_pool(): unknown priority");
+        return -1;
+    }
+
+    task *new_task = task_alloc_chain(th_pool, 1);
+
+    if (new_task == NULL)
+    {
+        err("add_task_priority_thread_pool(): failed to allocate memory for new task");
+        return -1;
+    }
+
+    task_init(new_task, function_p, arg);
+    return submit_tasks(th_pool, new_task, new_task, 1, priority);
+}
+
+int add_task_copy_thread_pool(thread_pool_t th_pool, void (*function_p)(void *), const void *arg, size_t arg_size)
+{
+    if (arg_size > THREAD_POOL_INLINE_ARG_SIZE)
+    {
+        err("add_task_copy_thread_pool(): argument does not fit into the task");
+        return -1;
+    }
+
+    task *new_task = task_alloc_chain(th_pool, 1);
+
+    if (new_task == NULL)
+    {
+        err("add_task_copy_thread_pool(): failed to allocate memory for new task");
+        return -1;
+    }
+
+    task_init(new_task, function_p, new_task->inline_arg);
+    memcpy(new_task->inline_arg, arg, arg_size);
+    return submit_tasks(th_pool, new_task, new_task, 1, THREAD_POOL_PRIORITY_NORMAL);
+}
+
+int add_tasks_thread_pool(thread_pool_t th_pool, const thread_pool_task *tasks, size_t count)
+{
+    if (count == 0)
+        return 0;
+
+    task *first = task_alloc_chain(th_pool, count);
+    if (first == NULL)
+    {
+        err("add_tasks_thread_pool(): failed to allocate memory for new tasks");
+        return -1;
+    }
+
+    task *last = first;
+    for (size_t i = 0; i < count; ++i, last = last->prev)
+    {
+        task_init(last, tasks[i].function, tasks[i].arg);
+        if (i + 1 == count)
+            break;
+    }
+
+    return submit_tasks(th_pool, first, last, count, THREAD_POOL_PRIORITY_NORMAL);
+}
+
+int parallel_for_thread_pool(thread_pool_t th_pool, size_t begin, size_t end, size_t grain,
+                             thread_pool_range_fn function_p, void *ctx)
+{
+    if (begin >= end)
+        return 0;
+
+    task *last;
+    size_t count;
+    task *first = task_range_chain(th_pool, begin, end, grain, function_p, ctx, &last, &count);
+    if (first == NULL)
+    {
+        err("parallel_for_thread_pool(): failed to allocate memory for new tasks");
+        return -1;
+    }
+
+    return submit_tasks(th_pool, first, last, count, THREAD_POOL_PRIORITY_NORMAL);
+}
+
+thread_pool_group_t create_group_thread_pool(thread_pool_t th_pool)
+{
+    thread_pool_group_t group = (thread_pool_group_t)ALLOC(sizeof(thread_pool_group));
+    if (group == NULL)
+    {
+        err("create_group_thread_pool(): failed to allocate memory for group");
+        return NULL;
+    }
+
+    group->pool = th_pool;
+    atomic_init(&group->tasks, 0);
+    atomic_init(&group->refs, 1);
+    atomic_init(&group->complete, 0);
+    pthread_mutex_init(&group->mtx, NULL);
+    pthread_cond_init(&group->idle, NULL);
+    group->priority = THREAD_POOL_PRIORITY_NORMAL;
+    group->closed = 0;
+    group->blockers = 0;
+    group->held_first = NULL;
+    group->held_last = NULL;
+    group->held_len = 0;
+    group->dependents = NULL;
+    group->dependents_len = 0;
+    group->dependents_capacity = 0;
+    return group;
+}
+
+int add_group_task_thread_pool(thread_pool_group_t group, void (*function_p)(void *), void *arg)
+{
+    task *new_task = task_alloc_chain(group->pool, 1);
+    if (new_task == NULL)
+    {
+        err("add_group_task_thread_pool(): failed to allocate memory for new task");
+        return -1;
+    }
+
+    task_init(new_task, function_p, arg);
+    return group_submit(group, new_task, new_task, 1);
+}
+
+int parallel_for_group_thread_pool(thread_pool_group_t group, size_t begin, size_t end, size_t grain,
+                                   thread_pool_range_fn function_p, void *ctx)
+{
+    if (begin >= end)
+        return 0;
+
+    task *last;
+    size_t count;
+    task *first = task_range_chain(group->pool, begin, end, grain, function_p, ctx, &last, &count);
+    if (first == NULL)
+    {
+        err("parallel_for_group_thread_pool(): failed to allocate memory for new tasks");
+        return -1;
+    }
+
+    return group_submit(group, first, last, count);
+}
+
+void set_group_priority_thread_pool(thread_pool_group_t group, thread_pool_priority priority)
+{
+    if ((unsigned int)priority >= THREAD_POOL_PRIORITY_LEVELS)
+    {
+        err("set_group_priority_thread_pool(): unknown priority");
+        return;
+    }
+
+    pthread_mutex_lock(&group->mtx);
+    group->priority = priority;
+    pthread_mutex_unlock(&group->mtx);
+}
+
+int add_group_dependency_thread_pool(thread_pool_group_t group, thread_pool_group_t prerequisite)
+{
+    // Locks are only ever nested prerequisite first, completion unblocks dependents after unlocking
+    pthread_mutex_lock(&prerequisite->mtx);
+    if (atomic_load(&prerequisite->complete))
+    {
+        pthread_mutex_unlock(&prerequisite->mtx);
+        return 0;
+    }
+
+    if (prerequisite->dependents_len == prerequisite->dependents_capacity)
+    {
+        size_t capacity = prerequisite->dependents_capacity ? 2 * prerequisite->dependents_capacity : 4;
+        thread_pool_group_t *dependents = (thread_pool_group_t *)realloc(prerequisite->dependents, capacity * sizeof(thread_pool_group_t));
+        if (dependents == NULL)
+        {
+            pthread_mutex_unlock(&prerequisite->mtx);
+            err("add_group_dependency_thread_pool(): failed to allocate memory for dependency");
+            return -1;
+        }
+        prerequisite->dependents = dependents;
+        prerequisite->dependents_capacity = capacity;
+    }
+    prerequisite->dependents[prerequisite->dependents_len++] = group;
+
+    pthread_mutex_lock(&group->mtx);
+    group->blockers++;
+    atomic_fetch_add(&group->refs, 1);
+    pthread_mutex_unlock(&group->mtx);
+
+    pthread_mutex_unlock(&prerequisite->mtx);
+    return 0;
+}
+
+void close_group_thread_pool(thread_pool_group_t group)
+{
+    pthread_mutex_lock(&group->mtx);
+    int was_closed = group->closed;
+    group->closed = 1;
+    pthread_mutex_unlock(&group->mtx);
+
+    if (!was_closed)
+        group_unref(group, 1);
+}
+
+void wait_group_thread_pool(thread_pool_group_t group)
+{
+    group_wait(group, 0);
+}
+
+void destroy_group_thread_pool(thread_pool_group_t group)
+{
+    if (group == NULL)
+        return;
+
+    close_group_thread_pool(group);
+    group_wait(group, 1);
+
+    // The thread that completed the group may still be inside its critical section
+    pthread_mutex_lock(&group->mtx);
+    pthread_mutex_unlock(&group->mtx);
+
+    pthread_mutex_destroy(&group->mtx);
+    pthread_cond_destroy(&group->idle);
+    free(group->dependents);
+    free(group);
+}
 
-    task_queue_push(&th_pool->queue, new_task);
+void get_stats_thread_pool(thread_pool_t th_pool, thread_pool_stats *stats)
+{
+    pthread_mutex_lock(&th_pool->alloc_mtx);
+    stats->task_slabs = th_pool->slabs_count;
+    stats->task_capacity = th_pool->slabs_count * TASK_SLAB_SIZE;
+    stats->tasks_free_shared = th_pool->free_tasks_len;
+    pthread_mutex_unlock(&th_pool->alloc_mtx);
+
+    stats->tasks_in_use = MIN(atomic_load(&th_pool->tasks_in_use), stats->task_capacity - stats->tasks_free_shared);
+    stats->tasks_free_cached = stats->task_capacity - stats->tasks_free_shared - stats->tasks_in_use;
+}
+
+int set_trace_thread_pool(thread_pool_t th_pool, thread_pool_trace_fn function_p, void *user)
+{
+#if THPOOL_TRACE
+    th_pool->trace_function = function_p;
+    th_pool->trace_user = user;
     return 0;
+#else
+    (void)th_pool;
+    (void)function_p;
+    (void)user;
+    return -1;
+#endif
+}
+
+size_t get_node_count_thread_pool(thread_pool_t th_pool)
+{
+    return th_pool->nodes_len;
+}
+
+size_t get_worker_node_thread_pool(thread_pool_t th_pool, size_t worker)
+{
+    return worker < th_pool->thread_count ? th_pool->threads[worker]->node : 0;
+}
+
+size_t get_current_worker_thread_pool(thread_pool_t th_pool)
+{
+    thread *self = current_thread;
+    return self != NULL && self->pool == th_pool ? self->id : (size_t)-1;
 }
 
 void wait_thread_pool(thread_pool_t th_pool)
 {
     pthread_mutex_lock(&th_pool->th_count_mtx);
-    while (th_pool->queue.size || th_pool->count_th_working)
+    while (atomic_load(&th_pool->tasks_pending))
     {
         pthread_cond_wait(&th_pool->thread_end_wait, &th_pool->th_count_mtx);
     }
@@ -162,92 +621,73 @@ void destroy_thread_pool(thread_pool_t th_pool)
     if (th_pool == NULL)
         return;
 
-    volatile int num_threads = th_pool->count_th_alive;
-    th_pool->stop = 1;
+    // Parked workers wake up, spinning ones see the flag, both exit once nothing is left to run
+    atomic_store(&th_pool->stop, 1);
+    eventcount_notify(&th_pool->wake, (size_t)-1);
 
-    double TIMEOUT = 1.0;
-    time_t start, end;
-    double tpassed = 0.0;
-    time(&start);
-    while (tpassed < TIMEOUT && th_pool->count_th_alive)
+    // Workers may still be stealing from each other until they have all exited
+    for (size_t i = 0; i < th_pool->threads_started; ++i)
     {
-        event_notify_all(th_pool->queue.has_task);
-        time(&end);
-        tpassed = difftime(end, start);
+        pthread_join(th_pool->threads[i]->thread_ptr, NULL);
     }
 
-    while (th_pool->count_th_alive)
+    for (size_t i = 0; i < th_pool->thread_count; ++i)
     {
-        event_notify_all(th_pool->queue.has_task);
-        sleep(1);
+        thread_destroy(th_pool->threads[i]);
     }
 
     pthread_mutex_destroy(&th_pool->th_count_mtx);
     pthread_cond_destroy(&th_pool->thread_end_wait);
 
-    task_queue_destroy(&th_pool->queue);
+    for (size_t i = 0; i < THREAD_POOL_PRIORITY_LEVELS; ++i)
+        task_queue_destroy(&th_pool->queues[i]);
+    if (th_pool->use_ring)
+        mpmc_queue_destroy(&th_pool->ring);
 
-    for (int i = 0; i < num_threads; ++i)
+    // Every task node, queued or recycled, lives in one of the slabs
+    while (th_pool->slabs)
     {
-        thread_destroy(th_pool->threads[i]);
+        task_slab *next = th_pool->slabs->next;
+        free(th_pool->slabs);
+        th_pool->slabs = next;
     }
+    pthread_mutex_destroy(&th_pool->alloc_mtx);
 
     free(th_pool->threads);
     free(th_pool);
 }
 
-static int task_queue_init(task_queue *queue)
+static void task_queue_init(task_queue *queue)
 {
-    queue->size = 0;
+    atomic_init(&queue->size, 0);
     queue->front = NULL;
     queue->back = NULL;
 
-    queue->has_task = (event *)ALLOC(sizeof(struct event));
-    if (queue->has_task == NULL)
-    {
-        return -1;
-    }
-
-    event_init(queue->has_task);
-
     pthread_mutex_init(&(queue->rwlock), NULL);
-    return 0;
 }
 
+// Queued nodes belong to the pool slabs, they are only dropped here
 static void task_queue_clear(task_queue *queue)
 {
-    for (int i = 0; i < queue->size; ++i)
-    {
-        free(task_queue_pop(queue));
-    }
-
     queue->front = NULL;
     queue->back = NULL;
-    queue->size = 0;
-    event_reset(queue->has_task);
+    atomic_store_explicit(&queue->size, 0, memory_order_relaxed);
 }
 
-static void task_queue_push(task_queue *queue, task *new_task)
+// Appends tasks already linked through prev from first to last with one lock
+static void task_queue_push_chain(task_queue *queue, task *first, task *last, size_t count)
 {
     pthread_mutex_lock(&(queue->rwlock));
-    new_task->prev = NULL;
+    last->prev = NULL;
 
-    switch (queue->size)
-    {
-    case 0:
-        queue->front = new_task;
-        queue->back = new_task;
-        break;
-
-    default:
-        queue->back->prev = new_task;
-        queue->back = new_task;
-        break;
-    }
-
-    queue->size++;
-    event_notify(queue->has_task);
+    size_t size = atomic_load_explicit(&queue->size, memory_order_relaxed);
+    if (size == 0)
+        queue->front = first;
+    else
+        queue->back->prev = first;
+    queue->back = last;
 
+    atomic_store_explicit(&queue->size, size + count, memory_order_relaxed);
     pthread_mutex_unlock(&(queue->rwlock));
 }
 
@@ -255,23 +695,15 @@ static task *task_queue_pop(task_queue *queue)
 {
     pthread_mutex_lock(&(queue->rwlock));
 
-    task *pop_task = queue->front;
-
-    switch (queue->size)
+    task *pop_task = NULL;
+    size_t size = atomic_load_explicit(&queue->size, memory_order_relaxed);
+    if (size)
     {
-    case 0:
-        break;
-    case 1:
-        queue->front = 0;
-        queue->back = 0;
-        queue->size--;
-        break;
-
-    default:
-        queue->front = queue->front->prev;
-        queue->size--;
-        event_notify(queue->has_task);
-        break;
+        pop_task = queue->front;
+        queue->front = pop_task->prev;
+        if (size == 1)
+            queue->back = NULL;
+        atomic_store_explicit(&queue->size, size - 1, memory_order_relaxed);
     }
 
     pthread_mutex_unlock(&(queue->rwlock));
@@ -281,7 +713,6 @@ static task *task_queue_pop(task_queue *queue)
 static void task_queue_destroy(task_queue *queue)
 {
     task_queue_clear(queue);
-    event_destroy(queue->has_task);
     pthread_mutex_destroy(&(queue->rwlock));
 }
 
@@ -295,109 +726,637 @@ static int thread_init(thread_pool_t pool, thread **thr, size_t id)
     }
     (*thr)->pool = pool;
     (*thr)->id = id;
-
-    pthread_create(&(*thr)->thread_ptr, NULL, (void *(*)(void *))thread_exec, *thr);
+    (*thr)->cpu = -1;
+    (*thr)->node = 0;
+    (*thr)->rng = (unsigned int)(id * 2654435761u) | 1u;
+    (*thr)->free_tasks = NULL;
+    (*thr)->free_tasks_len = 0;
+    (*thr)->spin = MIN(SPIN_INITIAL, pool->spin_max);
+
+    if (ws_deque_init(&(*thr)->deque, WS_DEQUE_CAPACITY) == -1)
+    {
+        err("thread_init(): Could not allocate memory for deque\n");
+        free(*thr);
+        *thr = NULL;
+        return -1;
+    }
     return 0;
 }
 
+// Picks the CPU and node of every worker, the workers are not running yet
+static int thread_pin(thread_pool_t pool, const thread_pool_config *config)
+{
+    affinity_topology topology;
+    if (affinity_topology_init(&topology) == -1)
+        return -1;
+
+    int result = -1;
+    int *cpus = (int *)ALLOC(pool->thread_count * sizeof(int));
+    if (cpus != NULL && affinity_assign(&topology, config, cpus) == 0)
+    {
+        pool->nodes_len = topology.nodes_len;
+        for (size_t i = 0; i < pool->thread_count; ++i)
+        {
+            pool->threads[i]->cpu = cpus[i];
+            pool->threads[i]->node = (size_t)affinity_cpu_node(&topology, cpus[i]);
+        }
+        result = 0;
+    }
+
+    free(cpus);
+    affinity_topology_destroy(&topology);
+    return result;
+}
+
+static int thread_start(thread *thr)
+{
+    if (thr->cpu < 0)
+        return pthread_create(&thr->thread_ptr, NULL, (void *(*)(void *))thread_exec, thr);
+
+    // Pinned before it runs, so its stack and everything it allocates first lands on its node
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(thr->cpu, &set);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int result = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    if (result == 0)
+        result = pthread_create(&thr->thread_ptr, &attr, (void *(*)(void *))thread_exec, thr);
+    pthread_attr_destroy(&attr);
+    return result;
+}
+
 static void thread_exec(thread *thr)
 {
     thread_pool_t pool = thr->pool;
+    current_thread = thr;
 
-    pthread_mutex_lock(&pool->th_count_mtx);
-    pool->count_th_alive++;
-    pthread_mutex_unlock(&pool->th_count_mtx);
+    while (1)
+    {
+        task *task_p = next_task(pool, thr);
+        if (task_p)
+        {
+            task_run(pool, thr, task_p);
+            task_release(pool, task_p);
+            pending_task_done(pool);
+        }
+        else if (!thread_park(pool, thr))
+        {
+            break;
+        }
+    }
+}
+
+// Waits for tasks to become available, spinning first and then sleeping on the pool's eventcount.
+// Returns 0 once the pool is stopping and nothing is left to run.
+static int thread_park(thread_pool_t pool, thread *thr)
+{
+    for (unsigned int i = 0; i < thr->spin; ++i)
+    {
+        if (tasks_queued(pool))
+        {
+            // Work tends to come in bursts, spin longer next time
+            thr->spin = MIN(2 * thr->spin, pool->spin_max);
+            return 1;
+        }
+        if (atomic_load_explicit(&pool->stop, memory_order_relaxed))
+            break;
+        cpu_relax();
+    }
+    if (thr->spin > SPIN_MIN)
+        thr->spin /= 2;
 
-    while (!pool->stop)
+    // Registered before the second look, so a task submitted after it wakes this worker
+    unsigned int key = eventcount_prepare(&pool->wake);
+    if (tasks_queued(pool))
     {
-        event_wait(pool->queue.has_task);
+        eventcount_cancel(&pool->wake);
+        return 1;
+    }
+    if (atomic_load(&pool->stop))
+    {
+        eventcount_cancel(&pool->wake);
+        return 0;
+    }
 
-        // cppcheck-suppress oppositeInnerCondition
-        if (pool->stop)
+    eventcount_wait(&pool->wake, key);
+    return 1;
+}
+
+static void thread_destroy(thread *thr)
+{
+    ws_deque_destroy(&thr->deque);
+    free(thr);
+}
+
+static int ws_submit(thread_pool_t pool, task *first, task *last, size_t count, thread_pool_priority priority)
+{
+    // Counted before the push so a worker that takes a task right away never sees the counters underflow
+    atomic_fetch_add(&pool->tasks_pending, count);
+    atomic_fetch_add(&pool->tasks_available, count);
+
+    // The deques do not keep priorities apart, other levels are only honored in the shared queues. A
+    // deque that can not grow spills the rest into the shared queue like a full ring does, so the
+    // submission never fails halfway with some of the tasks already running.
+    thread *self = current_thread;
+    task *task_p = first;
+    size_t pushed = 0;
+    for (; self != NULL && self->pool == pool && priority == THREAD_POOL_PRIORITY_NORMAL && pushed < count; ++pushed)
+    {
+        task *next = task_p->prev;
+        if (ws_deque_push(&self->deque, task_p) == -1)
             break;
+        task_p = next;
+    }
 
-        pthread_mutex_lock(&pool->th_count_mtx);
-        pool->count_th_working++;
-        pthread_mutex_unlock(&pool->th_count_mtx);
+    if (pushed < count)
+        task_queue_push_chain(&pool->queues[priority], task_p, last, count - pushed);
 
-        void (*func)(void *);
+    eventcount_notify(&pool->wake, count);
+    return 0;
+}
 
-        task *task_p = task_queue_pop(&pool->queue);
-        if (task_p)
+static task *ws_next_task(thread_pool_t pool, thread *thr)
+{
+    // Urgent tasks, then own work with the newest task on top so children run while their data is hot
+    task *task_p = shared_next_task(pool, THREAD_POOL_PRIORITY_HIGH, THREAD_POOL_PRIORITY_NORMAL);
+    if (task_p == NULL)
+        task_p = (task *)ws_deque_take(&thr->deque);
+    if (task_p == NULL)
+        task_p = shared_next_task(pool, THREAD_POOL_PRIORITY_NORMAL, THREAD_POOL_PRIORITY_LOW);
+
+    // Steal the oldest task of a random victim, sweep every other worker once. Workers on the
+    // own node are swept first, their tasks' data is more likely in local memory and shared cache.
+    int retry = 1;
+    while (task_p == NULL && retry && pool->thread_count > 1)
+    {
+        retry = 0;
+        thr->rng ^= thr->rng << 13;
+        thr->rng ^= thr->rng >> 17;
+        thr->rng ^= thr->rng << 5;
+        size_t start = thr->rng % pool->thread_count;
+
+        for (int remote = 0; remote < (pool->nodes_len > 1 ? 2 : 1) && task_p == NULL; ++remote)
         {
-            func = task_p->function;
-            void *arg = task_p->arg;
-            func(arg);
-            free(task_p);
+            for (size_t i = 0; i < pool->thread_count && task_p == NULL; ++i)
+            {
+                thread *victim = pool->threads[(start + i) % pool->thread_count];
+                if (victim != thr && (pool->nodes_len == 1 || (victim->node != thr->node) == remote))
+                    task_p = (task *)ws_deque_steal(&victim->deque, &retry);
+            }
         }
+    }
 
-        pthread_mutex_lock(&pool->th_count_mtx);
-        pool->count_th_working--;
-        if (!pool->count_th_working)
-            pthread_cond_signal(&pool->thread_end_wait);
-        pthread_mutex_unlock(&pool->th_count_mtx);
+    if (task_p == NULL)
+        task_p = shared_next_task(pool, THREAD_POOL_PRIORITY_LOW, THREAD_POOL_PRIORITY_LEVELS);
+
+    if (task_p)
+        atomic_fetch_sub(&pool->tasks_available, 1);
+
+    return task_p;
+}
+
+static int fifo_submit(thread_pool_t pool, task *first, task *last, size_t count, thread_pool_priority priority)
+{
+    // Counted before the push so a worker that finishes a task right away never sees it underflow
+    atomic_fetch_add(&pool->tasks_pending, count);
+
+    // A pushed task may run and be recycled right away, so its successor is read first
+    task *task_p = first;
+    size_t pushed = 0;
+    for (; pool->use_ring && priority == THREAD_POOL_PRIORITY_NORMAL && pushed < count; ++pushed)
+    {
+        task *next = task_p->prev;
+        if (mpmc_queue_push(&pool->ring, task_p) == -1)
+            break;
+        task_p = next;
     }
 
+    if (pushed < count)
+        task_queue_push_chain(&pool->queues[priority], task_p, last, count - pushed);
+
+    eventcount_notify(&pool->wake, count);
+    return 0;
+}
+
+// thr is NULL for a thread outside the pool, it only takes from the shared queue
+static task *next_task(thread_pool_t pool, thread *thr)
+{
+    if (pool->scheduler == THREAD_POOL_SCHEDULER_WORK_STEALING && thr != NULL)
+        return ws_next_task(pool, thr);
+
+    task *task_p = shared_next_task(pool, THREAD_POOL_PRIORITY_HIGH, THREAD_POOL_PRIORITY_LEVELS);
+    if (task_p && pool->scheduler == THREAD_POOL_SCHEDULER_WORK_STEALING)
+        atomic_fetch_sub(&pool->tasks_available, 1);
+    return task_p;
+}
+
+// Highest priority task of the shared queues in [begin, end), the ring comes before the normal list
+// that holds its overflow
+static task *shared_next_task(thread_pool_t pool, thread_pool_priority begin, thread_pool_priority end)
+{
+    task *task_p = NULL;
+    for (size_t i = begin; i < end && task_p == NULL; ++i)
+    {
+        if (i == THREAD_POOL_PRIORITY_NORMAL && pool->use_ring)
+            task_p = (task *)mpmc_queue_pop(&pool->ring);
+        if (task_p == NULL && atomic_load_explicit(&pool->queues[i].size, memory_order_relaxed))
+            task_p = task_queue_pop(&pool->queues[i]);
+    }
+    return task_p;
+}
+
+// Whether a worker may find a task, the FIFO queues answer from their own positions so taking a
+// task costs no extra atomic
+static int tasks_queued(thread_pool_t pool)
+{
+    if (pool->scheduler == THREAD_POOL_SCHEDULER_WORK_STEALING)
+        return atomic_load(&pool->tasks_available) != 0;
+
+    for (size_t i = 0; i < THREAD_POOL_PRIORITY_LEVELS; ++i)
+    {
+        if (atomic_load(&pool->queues[i].size))
+            return 1;
+    }
+    return pool->use_ring && !mpmc_queue_empty(&pool->ring);
+}
+
+static void pending_task_done(thread_pool_t pool)
+{
+    if (atomic_fetch_sub(&pool->tasks_pending, 1) != 1)
+        return;
+
     pthread_mutex_lock(&pool->th_count_mtx);
-    pool->count_th_alive--;
+    pthread_cond_broadcast(&pool->thread_end_wait);
     pthread_mutex_unlock(&pool->th_count_mtx);
 }
 
-static void thread_destroy(thread *thr)
+static int task_slab_create(thread_pool_t pool)
 {
-    pthread_join(thr->thread_ptr, NULL);
-    free(thr);
+    task_slab *slab = (task_slab *)ALLOC(sizeof(task_slab));
+    if (slab == NULL)
+        return -1;
+
+    for (size_t i = 0; i < TASK_SLAB_SIZE; ++i)
+    {
+        slab->tasks[i].prev = pool->free_tasks;
+        pool->free_tasks = &slab->tasks[i];
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slabs_count++;
+    pool->free_tasks_len += TASK_SLAB_SIZE;
+    return 0;
 }
 
-static void event_init(event *ev)
+// Returns count nodes linked through prev, a worker of the pool refills its private cache on the way
+static task *task_alloc_chain(thread_pool_t pool, size_t count)
 {
-    pthread_mutex_init(&ev->event_mtx, NULL);
-    pthread_cond_init(&ev->event_cond, NULL);
+    thread *self = (current_thread != NULL && current_thread->pool == pool) ? current_thread : NULL;
+    task *first = NULL, *last = NULL;
+    size_t taken = 0;
+
+    while (self != NULL && taken < count && self->free_tasks)
+    {
+        task *task_p = self->free_tasks;
+        self->free_tasks = task_p->prev;
+        self->free_tasks_len--;
+
+        if (last)
+            last->prev = task_p;
+        else
+            first = task_p;
+        last = task_p;
+        taken++;
+    }
+
+    if (taken < count)
+    {
+        pthread_mutex_lock(&pool->alloc_mtx);
+
+        size_t wanted = count - taken + (self != NULL ? TASK_CACHE_BATCH : 0);
+        while (pool->free_tasks_len < wanted && task_slab_create(pool) == 0)
+            ;
+
+        if (pool->free_tasks_len < count - taken)
+        {
+            pthread_mutex_unlock(&pool->alloc_mtx);
+            if (last)
+                last->prev = NULL;
+            atomic_fetch_add(&pool->tasks_in_use, taken);
+            task_chain_release(pool, first);
+            return NULL;
+        }
 
-    event_reset(ev);
+        for (; taken < count; ++taken)
+        {
+            task *task_p = pool->free_tasks;
+            pool->free_tasks = task_p->prev;
+            pool->free_tasks_len--;
+
+            if (last)
+                last->prev = task_p;
+            else
+                first = task_p;
+            last = task_p;
+        }
+
+        for (size_t i = 0; self != NULL && i < TASK_CACHE_BATCH && pool->free_tasks; ++i)
+        {
+            task *task_p = pool->free_tasks;
+            pool->free_tasks = task_p->prev;
+            pool->free_tasks_len--;
+            task_p->prev = self->free_tasks;
+            self->free_tasks = task_p;
+            self->free_tasks_len++;
+        }
+
+        pthread_mutex_unlock(&pool->alloc_mtx);
+    }
+
+    last->prev = NULL;
+    atomic_fetch_add(&pool->tasks_in_use, count);
+    return first;
 }
 
-static void event_reset(event *ev)
+static void task_release(thread_pool_t pool, task *task_p)
 {
-    ev->counter = 0;
+    thread *self = (current_thread != NULL && current_thread->pool == pool) ? current_thread : NULL;
+    atomic_fetch_sub(&pool->tasks_in_use, 1);
+
+    if (self == NULL)
+    {
+        pthread_mutex_lock(&pool->alloc_mtx);
+        task_p->prev = pool->free_tasks;
+        pool->free_tasks = task_p;
+        pool->free_tasks_len++;
+        pthread_mutex_unlock(&pool->alloc_mtx);
+        return;
+    }
+
+    task_p->prev = self->free_tasks;
+    self->free_tasks = task_p;
+    self->free_tasks_len++;
+
+    // Tasks submitted from outside the pool pile up in the worker caches, hand a batch back
+    if (self->free_tasks_len > TASK_CACHE_MAX)
+    {
+        pthread_mutex_lock(&pool->alloc_mtx);
+        for (size_t i = 0; i < TASK_CACHE_BATCH; ++i)
+        {
+            task *cached = self->free_tasks;
+            self->free_tasks = cached->prev;
+            self->free_tasks_len--;
+            cached->prev = pool->free_tasks;
+            pool->free_tasks = cached;
+            pool->free_tasks_len++;
+        }
+        pthread_mutex_unlock(&pool->alloc_mtx);
+    }
+}
+
+static void task_chain_release(thread_pool_t pool, task *first)
+{
+    while (first)
+    {
+        task *next = first->prev;
+        task_release(pool, first);
+        first = next;
+    }
 }
 
-static void event_wait(event *ev)
+static void task_init(task *task_p, void (*function_p)(void *), void *arg)
 {
-    pthread_mutex_lock(&ev->event_mtx);
+    task_p->function = function_p;
+    task_p->arg = arg;
+    task_p->range_function = NULL;
+    task_p->group = NULL;
+}
+
+// Chunks of [begin, end) as a chain of range tasks, NULL if allocation failed
+static task *task_range_chain(thread_pool_t pool, size_t begin, size_t end, size_t grain,
+                              thread_pool_range_fn function_p, void *ctx, task **last, size_t *count)
+{
+    if (grain == 0)
+        grain = 1;
 
-    while (ev->counter != 1)
+    *count = (end - begin + grain - 1) / grain;
+    task *first = task_alloc_chain(pool, *count);
+    if (first == NULL)
+        return NULL;
+
+    *last = first;
+    for (size_t chunk_begin = begin; chunk_begin < end; chunk_begin += grain, *last = (*last)->prev)
     {
-        pthread_cond_wait(&ev->event_cond, &ev->event_mtx);
+        task_init(*last, NULL, ctx);
+        (*last)->range_function = function_p;
+        (*last)->begin = chunk_begin;
+        (*last)->end = chunk_begin + MIN(grain, end - chunk_begin);
+        if (end - chunk_begin <= grain)
+            break;
     }
-    ev->counter = 0;
-    pthread_mutex_unlock(&ev->event_mtx);
+    return first;
 }
 
-static void event_notify(event *ev)
+// Runs one queued task on the calling thread, returns 0 if there was none to take
+static int pool_help(thread_pool_t pool)
 {
-    pthread_mutex_lock(&ev->event_mtx);
-    ev->counter = 1;
-    pthread_cond_signal(&ev->event_cond);
-    pthread_mutex_unlock(&ev->event_mtx);
+    thread *self = (current_thread != NULL && current_thread->pool == pool) ? current_thread : NULL;
+    task *task_p = next_task(pool, self);
+    if (task_p == NULL)
+        return 0;
+
+    task_run(pool, self, task_p);
+    task_release(pool, task_p);
+    pending_task_done(pool);
+    return 1;
 }
 
-static void event_notify_all(event *ev)
+static int group_submit(thread_pool_group_t group, task *first, task *last, size_t count)
 {
-    pthread_mutex_lock(&ev->event_mtx);
-    ev->counter = 1;
-    pthread_cond_broadcast(&ev->event_cond);
-    pthread_mutex_unlock(&ev->event_mtx);
+    task *task_p = first;
+    for (size_t i = 0; i < count; ++i, task_p = task_p->prev)
+        task_p->group = group;
+
+    pthread_mutex_lock(&group->mtx);
+    if (group->closed)
+    {
+        pthread_mutex_unlock(&group->mtx);
+        last->prev = NULL;
+        task_chain_release(group->pool, first);
+        err("add_group_task_thread_pool(): the group is closed");
+        return -1;
+    }
+
+    atomic_fetch_add(&group->tasks, count);
+    atomic_fetch_add(&group->refs, count);
+    thread_pool_priority priority = group->priority;
+
+    if (group->blockers)
+    {
+        last->prev = NULL;
+        if (group->held_len)
+            group->held_last->prev = first;
+        else
+            group->held_first = first;
+        group->held_last = last;
+        group->held_len += count;
+        pthread_mutex_unlock(&group->mtx);
+        return 0;
+    }
+    pthread_mutex_unlock(&group->mtx);
+
+    // Never fails, so the counters raised above need no undoing
+    return submit_tasks(group->pool, first, last, count, priority);
+}
+
+// Drops references, the thread dropping the last one completes the group and unblocks its dependents
+static void group_unref(thread_pool_group_t group, size_t count)
+{
+    if (atomic_fetch_sub(&group->refs, count) != count)
+        return;
+
+    pthread_mutex_lock(&group->mtx);
+    thread_pool_group_t *dependents = group->dependents;
+    size_t dependents_len = group->dependents_len;
+    group->dependents = NULL;
+    group->dependents_len = 0;
+    group->dependents_capacity = 0;
+    atomic_store(&group->complete, 1);
+    pthread_cond_broadcast(&group->idle);
+    pthread_mutex_unlock(&group->mtx);
+
+    // The group may be destroyed from here on
+    for (size_t i = 0; i < dependents_len; ++i)
+        group_unblock(dependents[i]);
+    free(dependents);
+}
+
+static void group_unblock(thread_pool_group_t group)
+{
+    pthread_mutex_lock(&group->mtx);
+    task *first = NULL;
+    task *last = NULL;
+    size_t count = 0;
+    thread_pool_priority priority = group->priority;
+    if (--group->blockers == 0 && group->held_len)
+    {
+        first = group->held_first;
+        last = group->held_last;
+        count = group->held_len;
+        group->held_first = NULL;
+        group->held_last = NULL;
+        group->held_len = 0;
+    }
+    pthread_mutex_unlock(&group->mtx);
+
+    // The held tasks are already counted in tasks and refs, submitting them can not fail
+    if (count)
+        submit_tasks(group->pool, first, last, count, priority);
+    group_unref(group, 1);
+}
+
+// Runs queued tasks of any group while waiting, so waiting inside a task does not cost a worker
+static void group_wait(thread_pool_group_t group, int until_complete)
+{
+    thread_pool_t pool = group->pool;
+    int nested = current_thread != NULL && current_thread->pool == pool;
+
+    while (until_complete ? !atomic_load(&group->complete) : atomic_load(&group->tasks) != 0)
+    {
+        if (pool_help(pool))
+            continue;
+
+        // Nothing queued right now. A thread outside the pool can sleep until the group is done, a
+        // worker only naps: tasks it could run may be queued while every other worker waits as well.
+        pthread_mutex_lock(&group->mtx);
+        if (until_complete ? !atomic_load(&group->complete) : atomic_load(&group->tasks) != 0)
+        {
+            if (nested)
+            {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += 100000;
+                if (deadline.tv_nsec >= 1000000000)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&group->idle, &group->mtx, &deadline);
+            }
+            else
+            {
+                pthread_cond_wait(&group->idle, &group->mtx);
+            }
+        }
+        pthread_mutex_unlock(&group->mtx);
+    }
+}
+
+#if THPOOL_TRACE
+static unsigned long long trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
 }
+#endif
 
-static void event_deinit(event *ev)
+// thr is NULL for a thread outside the pool helping in wait_group_thread_pool
+static void task_run(thread_pool_t pool, thread *thr, task *task_p)
 {
-    pthread_mutex_destroy(&(ev->event_mtx));
-    pthread_cond_destroy(&(ev->event_cond));
+#if THPOOL_TRACE
+    thread_pool_trace_event trace;
+    trace.worker = thr ? thr->id : (size_t)-1;
+    trace.enqueue_ns = task_p->enqueue_ns;
+    trace.start_ns = trace_now_ns();
+#else
+    (void)thr;
+#endif
+
+    if (task_p->range_function)
+        task_p->range_function(task_p->begin, task_p->end, task_p->arg);
+    else
+        task_p->function(task_p->arg);
+
+#if THPOOL_TRACE
+    if (pool->trace_function)
+    {
+        trace.end_ns = trace_now_ns();
+        pool->trace_function(&trace, pool->trace_user);
+    }
+#else
+    (void)pool;
+#endif
+
+    // Before the pool counts the task as done, so released dependents are queued by then
+    thread_pool_group_t group = task_p->group;
+    if (group)
+    {
+        if (atomic_fetch_sub(&group->tasks, 1) == 1)
+        {
+            pthread_mutex_lock(&group->mtx);
+            pthread_cond_broadcast(&group->idle);
+            pthread_mutex_unlock(&group->mtx);
+        }
+        group_unref(group, 1);
+    }
 }
 
-static void event_destroy(event *ev)
+// Always succeeds, a full ring or a deque that can not grow spills into the locked shared queue. Callers
+// count the tasks before submitting them and rely on that.
+static int submit_tasks(thread_pool_t pool, task *first, task *last, size_t count, thread_pool_priority priority)
 {
-    event_deinit(ev);
-    free(ev);
-}
\ No newline at end of file
+#if THPOOL_TRACE
+    unsigned long long now = trace_now_ns();
+    task *task_p = first;
+    for (size_t i = 0; i < count; ++i, task_p = task_p->prev)
+        task_p->enqueue_ns = now;
+#endif
+
+    if (pool->scheduler == THREAD_POOL_SCHEDULER_WORK_STEALING)
+        return ws_submit(pool, first, last, count, priority);
+    return fifo_submit(pool, first, last, count, priority);
+}
@@ -0,0 +1,130 @@
+#include "ws_deque.h"
+#include "malloc.h"
+
+static ws_array *ws_array_create(long size)
+{
+    ws_array *array = (ws_array *)malloc(sizeof(ws_array) + size * sizeof(_Atomic(void *)));
+    if (array == NULL)
+        return NULL;
+
+    array->size = size;
+    array->retired = NULL;
+    return array;
+}
+
+static void *ws_array_get(ws_array *array, long idx)
+{
+    return atomic_load_explicit(&array->items[idx & (array->size - 1)], memory_order_relaxed);
+}
+
+static void ws_array_put(ws_array *array, long idx, void *item)
+{
+    atomic_store_explicit(&array->items[idx & (array->size - 1)], item, memory_order_relaxed);
+}
+
+int ws_deque_init(ws_deque *deque, long capacity)
+{
+    long size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    ws_array *array = ws_array_create(size);
+    if (array == NULL)
+        return -1;
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array);
+    return 0;
+}
+
+void ws_deque_destroy(ws_deque *deque)
+{
+    ws_array *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    while (array)
+    {
+        ws_array *retired = array->retired;
+        free(array);
+        array = retired;
+    }
+}
+
+int ws_deque_push(ws_deque *deque, void *item)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    ws_array *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (b - t > array->size - 1)
+    {
+        ws_array *bigger = ws_array_create(array->size * 2);
+        if (bigger == NULL)
+            return -1;
+
+        for (long i = t; i < b; ++i)
+            ws_array_put(bigger, i, ws_array_get(array, i));
+
+        bigger->retired = array;
+        atomic_store_explicit(&deque->array, bigger, memory_order_release);
+        array = bigger;
+    }
+
+    ws_array_put(array, b, item);
+    // A release store rather than the paper's fence + relaxed store, same cost on x86 and visible to race detectors
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+    return 0;
+}
+
+void *ws_deque_take(ws_deque *deque)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    ws_array *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b)
+    {
+        // Empty
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    void *item = ws_array_get(array, b);
+    if (t == b)
+    {
+        // Last item, race against thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+            item = NULL;
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+void *ws_deque_steal(ws_deque *deque, int *retry)
+{
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (t >= b)
+        return NULL;
+
+    ws_array *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    void *item = ws_array_get(array, t);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+    {
+        *retry = 1;
+        return NULL;
+    }
+    return item;
+}
+
+long ws_deque_size(ws_deque *deque)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
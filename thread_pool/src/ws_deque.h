@@ -0,0 +1,42 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stdatomic.h>
+#include "types.h"
+
+// Chase-Lev work-stealing deque (Le, Pop, Cohen, Zappa Nardelli, "Correct and Efficient
+// Work-Stealing for Weak Memory Models", PPoPP 2013). The owner pushes and takes at the
+// bottom, any other thread steals from the top.
+
+typedef struct ws_array
+{
+    long size;
+    // Buffers replaced by a resize may still be read by a concurrent thief, they are freed with the deque
+    struct ws_array *retired;
+    _Atomic(void *) items[];
+} ws_array;
+
+typedef struct ws_deque
+{
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    _Atomic(ws_array *) array;
+} ws_deque;
+
+int ws_deque_init(ws_deque *deque, long capacity);
+
+void ws_deque_destroy(ws_deque *deque);
+
+// Owner only, returns -1 if the buffer could not grow
+int ws_deque_push(ws_deque *deque, void *item);
+
+// Owner only, returns NULL when the deque is empty
+void *ws_deque_take(ws_deque *deque);
+
+// Any thread, returns NULL when the deque is empty or another thread won the race (then *retry is set)
+void *ws_deque_steal(ws_deque *deque, int *retry);
+
+// Approximate number of items, may be stale as soon as it returns
+long ws_deque_size(ws_deque *deque);
+
+#endif